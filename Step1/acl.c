@@ -0,0 +1,487 @@
+/*
+ * acl.c
+ * 5-tuple ACL classifier (tuple-space search) loaded from Rules.txt.
+ *
+ * Rules.txt, one rule per line:
+ *   <priority> <allow|deny> <proto> <src> <sport> <dst> <dport> [flags]
+ *     proto : tcp | udp | icmp | any | <number>
+ *     src/dst: a.b.c.d[/len] | any
+ *     ports : N | LO-HI | any
+ *     flags : SET/MASK over FSRPAUEC, e.g. S/SA = SYN without ACK (TCP only)
+ *
+ * Rules are grouped into tuples by (src_len, dst_len, proto given?, exact
+ * dport?). Within a tuple the masked header fields form an exact hash key,
+ * so a lookup is one hash probe per tuple plus a check of the remaining
+ * range fields. Tuples are visited in order of their best rule, and the
+ * search stops as soon as no remaining tuple can beat the current match.
+ */
+
+#include "acl.h"
+#include "worker.h"
+#include "droplog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#define ACL_RULES_FILE "Rules.txt"
+#define ACL_REPORT_RULES 50      /* per-rule hit lines printed by acl_report */
+
+typedef struct {
+    uint32_t src, dst;
+    uint16_t dport;
+    uint8_t proto;
+} acl_key_t;
+
+typedef struct {
+    uint8_t src_len, dst_len;
+    bool has_proto;        /* key includes proto */
+    bool exact_dport;      /* key includes dport */
+    uint32_t src_mask, dst_mask;
+    int best_rank;         /* smallest rule index in this tuple */
+
+    acl_key_t *keys;       /* unique keys */
+    uint32_t *span_first;  /* [key] -> first entry in rules[] */
+    uint32_t *span_count;
+    uint32_t key_count;
+    int32_t *slots;        /* open addressing: key index or -1 */
+    uint32_t slot_mask;
+
+    uint32_t *rules;       /* rule indices, grouped by key, ascending rank */
+    uint32_t rule_count;
+} acl_tuple_t;
+
+static acl_rule_t *rules = NULL;    /* sorted by (priority, line) after build: index == rank */
+static int rule_count = 0, rule_cap = 0;
+static acl_tuple_t *tuples = NULL;
+static int tuple_count = 0;
+
+/* Per-thread, per-rule hit counters and drop totals */
+static worker_counters_t rule_hits;
+static struct {
+    uint64_t drops;
+} __attribute__((aligned(CACHE_LINE))) acl_stats[MAX_WORKERS];
+
+static double build_ms = 0.0;
+
+static inline uint32_t prefix_mask(int len) {
+    return len == 0 ? 0 : (uint32_t)(0xFFFFFFFFu << (32 - len));
+}
+
+static inline uint32_t key_hash(const acl_key_t *k) {
+    uint64_t x = ((uint64_t)k->src << 32) ^ k->dst ^ ((uint64_t)k->dport << 8) ^ k->proto;
+    x ^= x >> 33; x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return (uint32_t)x;
+}
+
+static inline bool key_eq(const acl_key_t *a, const acl_key_t *b) {
+    return a->src == b->src && a->dst == b->dst && a->dport == b->dport && a->proto == b->proto;
+}
+
+static void rule_key(const acl_tuple_t *t, const acl_rule_t *r, acl_key_t *k) {
+    k->src = r->src_net & t->src_mask;
+    k->dst = r->dst_net & t->dst_mask;
+    k->proto = t->has_proto ? (uint8_t)r->proto : 0;
+    k->dport = t->exact_dport ? r->dport_lo : 0;
+}
+
+static void free_tuples(void) {
+    for (int i = 0; i < tuple_count; ++i) {
+        acl_tuple_t *t = &tuples[i];
+        free(t->keys); free(t->span_first); free(t->span_count);
+        free(t->slots); free(t->rules);
+    }
+    free(tuples);
+    tuples = NULL;
+    tuple_count = 0;
+}
+
+void acl_reset(void) {
+    free_tuples();
+    free(rules);
+    rules = NULL;
+    rule_count = rule_cap = 0;
+    worker_counters_free(&rule_hits);
+    memset(acl_stats, 0, sizeof(acl_stats));
+}
+
+int acl_rule_count(void) { return rule_count; }
+int acl_tuple_count(void) { return tuple_count; }
+const acl_rule_t *acl_rule_at(int idx) { return (idx >= 0 && idx < rule_count) ? &rules[idx] : NULL; }
+
+int acl_add_rule(const acl_rule_t *r) {
+    if (rule_count == rule_cap) {
+        int cap = rule_cap ? rule_cap * 2 : 64;
+        acl_rule_t *n = realloc(rules, (size_t)cap * sizeof(*n));
+        if (!n) return -1;
+        rules = n;
+        rule_cap = cap;
+    }
+    acl_rule_t *d = &rules[rule_count];
+    *d = *r;
+    d->src_net &= prefix_mask(d->src_len);
+    d->dst_net &= prefix_mask(d->dst_len);
+    if (!d->line) d->line = rule_count + 1;
+    rule_count++;
+    return 0;
+}
+
+/* ---- parsing ---- */
+
+static int parse_cidr(const char *s, uint32_t *net, uint8_t *len) {
+    if (strcmp(s, "any") == 0 || strcmp(s, "*") == 0) { *net = 0; *len = 0; return 0; }
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s", s);
+    int l = 32;
+    char *slash = strchr(buf, '/');
+    if (slash) {
+        *slash = '\0';
+        char *end;
+        long v = strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end || v < 0 || v > 32) return -1;
+        l = (int)v;
+    }
+    struct in_addr a;
+    if (inet_pton(AF_INET, buf, &a) != 1) return -1;
+    *net = ntohl(a.s_addr) & prefix_mask(l);
+    *len = (uint8_t)l;
+    return 0;
+}
+
+static int parse_ports(const char *s, uint16_t *lo, uint16_t *hi) {
+    if (strcmp(s, "any") == 0 || strcmp(s, "*") == 0) { *lo = 0; *hi = 65535; return 0; }
+    char *end;
+    long a = strtol(s, &end, 10), b = a;
+    if (end == s) return -1;
+    if (*end == '-') {
+        const char *s2 = end + 1;
+        b = strtol(s2, &end, 10);
+        if (end == s2) return -1;
+    }
+    if (*end || a < 0 || b > 65535 || a > b) return -1;
+    *lo = (uint16_t)a;
+    *hi = (uint16_t)b;
+    return 0;
+}
+
+static int parse_flag_letters(const char *s, const char *stop, uint8_t *out) {
+    static const char letters[] = "FSRPAUEC";   /* bit order of byte 13 */
+    *out = 0;
+    for (; s < stop; ++s) {
+        const char *p = strchr(letters, toupper((unsigned char)*s));
+        if (!p) return -1;
+        *out |= (uint8_t)(1u << (p - letters));
+    }
+    return 0;
+}
+
+static int parse_flags(const char *s, uint8_t *set, uint8_t *mask) {
+    if (strcmp(s, "any") == 0) { *set = *mask = 0; return 0; }
+    const char *slash = strchr(s, '/');
+    if (parse_flag_letters(s, slash ? slash : s + strlen(s), set) != 0) return -1;
+    if (!slash) { *mask = *set; return 0; }
+    if (parse_flag_letters(slash + 1, slash + 1 + strlen(slash + 1), mask) != 0) return -1;
+    *mask |= *set;
+    return 0;
+}
+
+int acl_parse_rule(const char *line, acl_rule_t *out) {
+    char prio[16], act[16], proto[16], src[64], sport[32], dst[64], dport[32], flags[32] = "any";
+    int n = sscanf(line, "%15s %15s %15s %63s %31s %63s %31s %31s",
+                   prio, act, proto, src, sport, dst, dport, flags);
+    if (n < 7) return -1;
+
+    memset(out, 0, sizeof(*out));
+    char *end;
+    out->priority = (int)strtol(prio, &end, 10);
+    if (*end) return -1;
+
+    if (strcmp(act, "allow") == 0 || strcmp(act, "accept") == 0) out->action = ACL_ALLOW;
+    else if (strcmp(act, "deny") == 0 || strcmp(act, "drop") == 0) out->action = ACL_DENY;
+    else return -1;
+
+    if (strcmp(proto, "any") == 0) out->proto = ACL_PROTO_ANY;
+    else if (strcmp(proto, "tcp") == 0) out->proto = IPPROTO_TCP;
+    else if (strcmp(proto, "udp") == 0) out->proto = IPPROTO_UDP;
+    else if (strcmp(proto, "icmp") == 0) out->proto = IPPROTO_ICMP;
+    else {
+        long p = strtol(proto, &end, 10);
+        if (*end || p < 0 || p > 255) return -1;
+        out->proto = (int)p;
+    }
+
+    if (parse_cidr(src, &out->src_net, &out->src_len) != 0) return -1;
+    if (parse_cidr(dst, &out->dst_net, &out->dst_len) != 0) return -1;
+    if (parse_ports(sport, &out->sport_lo, &out->sport_hi) != 0) return -1;
+    if (parse_ports(dport, &out->dport_lo, &out->dport_hi) != 0) return -1;
+    if (parse_flags(flags, &out->flags_set, &out->flags_mask) != 0) return -1;
+    return 0;
+}
+
+/* ---- build ---- */
+
+static int cmp_rule(const void *a, const void *b) {
+    const acl_rule_t *x = a, *y = b;
+    if (x->priority != y->priority) return (x->priority > y->priority) - (x->priority < y->priority);
+    return (x->line > y->line) - (x->line < y->line);
+}
+
+static const acl_tuple_t *sort_tuple;   /* qsort context for cmp_tuple_rule */
+
+static int cmp_tuple_rule(const void *a, const void *b) {
+    uint32_t i = *(const uint32_t *)a, j = *(const uint32_t *)b;
+    acl_key_t ka, kb;
+    rule_key(sort_tuple, &rules[i], &ka);
+    rule_key(sort_tuple, &rules[j], &kb);
+    if (ka.src != kb.src) return ka.src < kb.src ? -1 : 1;
+    if (ka.dst != kb.dst) return ka.dst < kb.dst ? -1 : 1;
+    if (ka.proto != kb.proto) return ka.proto < kb.proto ? -1 : 1;
+    if (ka.dport != kb.dport) return ka.dport < kb.dport ? -1 : 1;
+    return (i > j) - (i < j);
+}
+
+static int cmp_tuple(const void *a, const void *b) {
+    const acl_tuple_t *x = a, *y = b;
+    return (x->best_rank > y->best_rank) - (x->best_rank < y->best_rank);
+}
+
+static int tuple_of(const acl_rule_t *r, bool create) {
+    bool has_proto = r->proto != ACL_PROTO_ANY;
+    bool exact = r->dport_lo == r->dport_hi;
+    for (int i = 0; i < tuple_count; ++i) {
+        const acl_tuple_t *t = &tuples[i];
+        if (t->src_len == r->src_len && t->dst_len == r->dst_len &&
+            t->has_proto == has_proto && t->exact_dport == exact) return i;
+    }
+    if (!create) return -1;
+    acl_tuple_t *n = realloc(tuples, (size_t)(tuple_count + 1) * sizeof(*n));
+    if (!n) return -1;
+    tuples = n;
+    acl_tuple_t *t = &tuples[tuple_count];
+    memset(t, 0, sizeof(*t));
+    t->src_len = r->src_len;
+    t->dst_len = r->dst_len;
+    t->has_proto = has_proto;
+    t->exact_dport = exact;
+    t->src_mask = prefix_mask(r->src_len);
+    t->dst_mask = prefix_mask(r->dst_len);
+    t->best_rank = INT_MAX;
+    return tuple_count++;
+}
+
+static int build_tuple(acl_tuple_t *t) {
+    sort_tuple = t;
+    qsort(t->rules, t->rule_count, sizeof(uint32_t), cmp_tuple_rule);
+
+    t->keys = malloc(t->rule_count * sizeof(acl_key_t));
+    t->span_first = malloc(t->rule_count * sizeof(uint32_t));
+    t->span_count = malloc(t->rule_count * sizeof(uint32_t));
+    if (!t->keys || !t->span_first || !t->span_count) return -1;
+
+    for (uint32_t i = 0; i < t->rule_count; ++i) {
+        acl_key_t k;
+        rule_key(t, &rules[t->rules[i]], &k);
+        if (t->key_count == 0 || !key_eq(&t->keys[t->key_count - 1], &k)) {
+            t->keys[t->key_count] = k;
+            t->span_first[t->key_count] = i;
+            t->span_count[t->key_count] = 0;
+            t->key_count++;
+        }
+        t->span_count[t->key_count - 1]++;
+    }
+
+    uint32_t slots = 16;
+    while (slots < t->key_count * 2) slots <<= 1;
+    t->slots = malloc(slots * sizeof(int32_t));
+    if (!t->slots) return -1;
+    memset(t->slots, 0xff, slots * sizeof(int32_t));
+    t->slot_mask = slots - 1;
+    for (uint32_t k = 0; k < t->key_count; ++k) {
+        uint32_t h = key_hash(&t->keys[k]) & t->slot_mask;
+        while (t->slots[h] >= 0) h = (h + 1) & t->slot_mask;
+        t->slots[h] = (int32_t)k;
+    }
+    return 0;
+}
+
+int acl_build(void) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    free_tuples();
+    if (rule_count) qsort(rules, (size_t)rule_count, sizeof(acl_rule_t), cmp_rule);
+
+    /* count rules per tuple, then fill */
+    int *tuple_idx = malloc((size_t)(rule_count ? rule_count : 1) * sizeof(int));
+    if (!tuple_idx) return -1;
+    for (int i = 0; i < rule_count; ++i) {
+        int ti = tuple_of(&rules[i], true);
+        if (ti < 0) { free(tuple_idx); return -1; }
+        tuple_idx[i] = ti;
+        tuples[ti].rule_count++;
+        if (i < tuples[ti].best_rank) tuples[ti].best_rank = i;
+    }
+    for (int ti = 0; ti < tuple_count; ++ti) {
+        tuples[ti].rules = malloc(tuples[ti].rule_count * sizeof(uint32_t));
+        if (!tuples[ti].rules) { free(tuple_idx); return -1; }
+        tuples[ti].rule_count = 0;
+    }
+    for (int i = 0; i < rule_count; ++i) {
+        acl_tuple_t *t = &tuples[tuple_idx[i]];
+        t->rules[t->rule_count++] = (uint32_t)i;
+    }
+    free(tuple_idx);
+
+    for (int ti = 0; ti < tuple_count; ++ti)
+        if (build_tuple(&tuples[ti]) != 0) return -1;
+    qsort(tuples, (size_t)tuple_count, sizeof(acl_tuple_t), cmp_tuple);
+
+    worker_counters_free(&rule_hits);
+    worker_counters_init(&rule_hits, (size_t)rule_count);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    build_ms = (double)(t1.tv_sec - t0.tv_sec) * 1e3 + (double)(t1.tv_nsec - t0.tv_nsec) / 1e6;
+    return 0;
+}
+
+/* ---- classify ---- */
+
+static inline bool rule_rest_matches(const acl_rule_t *r, const pkt_meta_t *m) {
+    if (m->src_port < r->sport_lo || m->src_port > r->sport_hi) return false;
+    if (m->dst_port < r->dport_lo || m->dst_port > r->dport_hi) return false;
+    if (r->flags_mask) {
+        if (m->proto != IPPROTO_TCP) return false;
+        if ((m->tcp_flags & r->flags_mask) != r->flags_set) return false;
+    }
+    return true;
+}
+
+int acl_classify(const pkt_meta_t *m) {
+    int best = INT_MAX;
+    for (int ti = 0; ti < tuple_count; ++ti) {
+        const acl_tuple_t *t = &tuples[ti];
+        if (t->best_rank >= best) break;   /* tuples are sorted by best_rank */
+
+        acl_key_t k;
+        k.src = m->src_ip & t->src_mask;
+        k.dst = m->dst_ip & t->dst_mask;
+        k.proto = t->has_proto ? m->proto : 0;
+        k.dport = t->exact_dport ? m->dst_port : 0;
+
+        uint32_t h = key_hash(&k) & t->slot_mask;
+        int32_t ki;
+        while ((ki = t->slots[h]) >= 0 && !key_eq(&t->keys[ki], &k)) h = (h + 1) & t->slot_mask;
+        if (ki < 0) continue;
+
+        const uint32_t *r = t->rules + t->span_first[ki];
+        for (uint32_t i = 0; i < t->span_count[ki]; ++i) {
+            if ((int)r[i] >= best) break;  /* span is in rank order */
+            if (rule_rest_matches(&rules[r[i]], m)) { best = (int)r[i]; break; }
+        }
+    }
+    return best == INT_MAX ? -1 : best;
+}
+
+/* ---- pipeline stage ---- */
+
+static int load_rules(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char line[256];
+    int lineno = 0, loaded = 0;
+    while (fgets(line, sizeof(line), f)) {
+        ++lineno;
+        char *s = line;
+        while (*s && isspace((unsigned char)*s)) s++;
+        if (*s == '\0' || *s == '#') continue;
+        char *hash = strchr(s, '#');
+        if (hash) *hash = '\0';
+        acl_rule_t r;
+        if (acl_parse_rule(s, &r) != 0) {
+            printf("[ACL] Warning: %s:%d: cannot parse rule, skipped\n", path, lineno);
+            continue;
+        }
+        r.line = lineno;
+        if (acl_add_rule(&r) == 0) loaded++;
+    }
+    fclose(f);
+    return loaded;
+}
+
+void acl_init(void) {
+    acl_reset();
+    int n = load_rules(ACL_RULES_FILE);
+    if (n < 0) {
+        printf("[ACL] %s not found. No rules loaded.\n", ACL_RULES_FILE);
+        return;
+    }
+    if (acl_build() != 0) {
+        printf("[ACL] Warning: out of memory building classifier, rules disabled\n");
+        acl_reset();
+        return;
+    }
+    printf("[ACL] Loaded %d rule(s) into %d tuple(s) in %.1f ms\n", rule_count, tuple_count, build_ms);
+}
+
+static const char *proto_name(int p, char *buf, size_t len) {
+    switch (p) {
+        case ACL_PROTO_ANY: return "any";
+        case IPPROTO_TCP: return "TCP";
+        case IPPROTO_UDP: return "UDP";
+        case IPPROTO_ICMP: return "ICMP";
+        default: snprintf(buf, len, "%d", p); return buf;
+    }
+}
+
+/* drop line detail, formatted by the droplog writer: u[0] rule, u[1] its line */
+static int fmt_acl(const droplog_event_t *e, char *out, size_t len) {
+    char pb[8];
+    return snprintf(out, len, "proto=%s | rule=%u (line %u)", proto_name(e->proto, pb, sizeof(pb)), e->u[0], e->u[1]);
+}
+
+bool acl_check(const struct pcap_pkthdr *header, const pkt_meta_t *m) {
+    if (rule_count == 0 || !m->is_ipv4) return true;
+
+    int idx = acl_classify(m);
+    if (idx < 0) return true;
+
+    uint64_t *row = worker_counters_row(&rule_hits);
+    if (row) WORKER_COUNTER_ADD(&row[idx], 1);
+    if (rules[idx].action == ACL_ALLOW) return true;
+
+    WORKER_COUNTER_ADD(&acl_stats[worker_id()].drops, 1);
+    droplog_event_t *e = droplog_begin(DL_STAGE_ACL, header, m, "acl_deny", fmt_acl);
+    if (e) {
+        e->u[0] = (uint32_t)idx;
+        e->u[1] = (uint32_t)rules[idx].line;
+        droplog_commit(e);
+    }
+    return false;
+}
+
+void acl_report(void) {
+    if (rule_count == 0) return;
+    uint64_t drops = 0;
+    for (int w = 0; w < worker_count(); ++w) drops += WORKER_COUNTER_READ(&acl_stats[w].drops);
+
+    printf("\n📊 [ACL STATISTICS]\n");
+    printf("   Rules: %d in %d tuple(s)\n", rule_count, tuple_count);
+    printf("   Dropped by ACL: %" PRIu64 " packets\n", drops);
+    int unused = 0, listed = 0;
+    for (int i = 0; i < rule_count; ++i) {
+        uint64_t hits = worker_counters_sum(&rule_hits, (size_t)i);
+        if (hits == 0) { unused++; continue; }
+        if (listed++ >= ACL_REPORT_RULES) continue;
+        printf("   line %-5d prio %-6d %-5s %" PRIu64 " hits\n", rules[i].line, rules[i].priority,
+               rules[i].action == ACL_DENY ? "deny" : "allow", hits);
+    }
+    if (listed > ACL_REPORT_RULES) printf("   ... and %d more matched rule(s)\n", listed - ACL_REPORT_RULES);
+    if (unused) printf("   Never matched: %d rule(s)\n", unused);
+}
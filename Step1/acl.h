@@ -0,0 +1,56 @@
+#ifndef ACL_H
+#define ACL_H
+
+/*
+ * acl.h
+ * Multi-field (5-tuple + TCP flags) firewall rules from Rules.txt,
+ * classified with tuple-space search.
+ */
+
+#include <pcap.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "packet.h"
+
+typedef enum {
+    ACL_ALLOW = 0,   /* stop rule evaluation, continue with the filter chain */
+    ACL_DENY  = 1    /* drop */
+} acl_action_t;
+
+#define ACL_PROTO_ANY (-1)
+
+typedef struct {
+    int priority;                 /* lower value wins; ties go to the earlier rule */
+    acl_action_t action;
+    int proto;                    /* IPPROTO_* or ACL_PROTO_ANY */
+    uint32_t src_net, dst_net;    /* host byte order, already masked */
+    uint8_t src_len, dst_len;     /* prefix lengths, 0 = any */
+    uint16_t sport_lo, sport_hi;  /* inclusive ranges, 0-65535 = any */
+    uint16_t dport_lo, dport_hi;
+    uint8_t flags_set;            /* TCP: (flags & flags_mask) == flags_set */
+    uint8_t flags_mask;           /* 0 = don't care */
+    int line;                     /* source line (0 if added programmatically) */
+} acl_rule_t;
+
+/* Load Rules.txt and build the classifier (no rules => stage is a no-op) */
+void acl_init(void);
+
+/* Programmatic interface (used by acl_init and bench_acl) */
+void acl_reset(void);
+int  acl_parse_rule(const char *line, acl_rule_t *out);   /* 0 ok, -1 syntax error */
+int  acl_add_rule(const acl_rule_t *r);
+int  acl_build(void);                                      /* 0 ok, -1 OOM */
+int  acl_rule_count(void);
+int  acl_tuple_count(void);
+const acl_rule_t *acl_rule_at(int idx);                   /* in priority order */
+
+/* Index of the winning rule (priority order) or -1 */
+int  acl_classify(const pkt_meta_t *m);
+
+/* Return true == ALLOW, false == DENY (i.e., drop) */
+bool acl_check(const struct pcap_pkthdr *header, const pkt_meta_t *m);
+
+/* Report statistics */
+void acl_report(void);
+
+#endif /* ACL_H */
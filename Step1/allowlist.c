@@ -0,0 +1,70 @@
+/*
+ * allowlist.c
+ * Trusted sources from Allow.txt (same format as IP.txt). Matching packets
+ * bypass ban/acl/denylist/rate-limit/malformed; preprocess still sees them.
+ */
+
+#include "allowlist.h"
+#include "ipset.h"
+#include "worker.h"
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#define ALLOWLIST_FILE "Allow.txt"
+
+static ipset_t allow_set;
+
+/* Per-thread bypass counters */
+static struct {
+    uint64_t pkts;
+    uint64_t bytes;
+} __attribute__((aligned(CACHE_LINE))) allow_stats[MAX_WORKERS];
+
+static worker_counters_t entry_hits;
+
+void allowlist_init(void) {
+    ipset_free(&allow_set);
+    worker_counters_free(&entry_hits);
+    memset(allow_stats, 0, sizeof(allow_stats));
+
+    ipset_builder_t *b = ipset_builder_new();
+    if (!b) return;
+    int n = ipset_builder_add_ip_file(b, ALLOWLIST_FILE);
+    if (ipset_builder_finish(b, &allow_set) != 0) return;
+    worker_counters_init(&entry_hits, allow_set.net_count);
+    if (n < 0) printf("[Allowlist] %s not found. No trusted sources.\n", ALLOWLIST_FILE);
+    else printf("[Allowlist] Loaded %d trusted IP/prefix(es)\n", n);
+}
+
+bool allowlist_bypass(const struct pcap_pkthdr *header, const pkt_meta_t *m) {
+    if (allow_set.net_count == 0 || !m->is_ipv4) return false;
+    int hit = ipset_match_ip(&allow_set, m->src_ip);
+    if (hit < 0) return false;
+
+    int w = worker_id();
+    WORKER_COUNTER_ADD(&allow_stats[w].pkts, 1);
+    WORKER_COUNTER_ADD(&allow_stats[w].bytes, header->len);
+    uint64_t *row = worker_counters_row(&entry_hits);
+    if (row) WORKER_COUNTER_ADD(&row[hit], 1);
+    return true;
+}
+
+void allowlist_report(void) {
+    if (allow_set.net_count == 0) return;
+    uint64_t pkts = 0, bytes = 0;
+    for (int w = 0; w < worker_count(); ++w) {
+        pkts += WORKER_COUNTER_READ(&allow_stats[w].pkts);
+        bytes += WORKER_COUNTER_READ(&allow_stats[w].bytes);
+    }
+    printf("\n📊 [ALLOWLIST STATISTICS]\n");
+    printf("   Trusted entries: %u\n", allow_set.net_count);
+    printf("   Bypassed filters: %" PRIu64 " packets, %" PRIu64 " bytes\n", pkts, bytes);
+    for (uint32_t i = 0; i < allow_set.net_count; ++i) {
+        uint64_t hits = worker_counters_sum(&entry_hits, i);
+        if (!hits) continue;
+        char name[32];
+        ipset_entry_to_str(&allow_set, i, name, sizeof(name));
+        printf("     %-20s %" PRIu64 " packets\n", name, hits);
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef ALLOWLIST_H
+#define ALLOWLIST_H
+
+#include <pcap.h>
+#include <stdbool.h>
+#include "packet.h"
+
+/* Load trusted sources (exact IPs and CIDRs) from Allow.txt */
+void allowlist_init(void);
+
+/* True if the packet's source is trusted and should skip the filtering
+ * chain; bypassed packets/bytes are counted separately. */
+bool allowlist_bypass(const struct pcap_pkthdr *header, const pkt_meta_t *m);
+
+/* Report statistics */
+void allowlist_report(void);
+
+#endif /* ALLOWLIST_H */
@@ -0,0 +1,457 @@
+/*
+ * antispoof.c
+ * Source address validation right after parsing: bogon / martian sources
+ * and a reverse-path (uRPF) check against the kernel FIB.
+ *
+ * Bogons are classified in constant time: one byte per /16 gives the class
+ * of the whole /16, and the three /16s that hold special /24s (192.0,
+ * 198.51, 203.0) are marked AS_SPLIT and resolved against a 4-entry list.
+ *
+ * uRPF asks the kernel with RTM_GETROUTE for the route back to the source,
+ * as fib_validate_source does for the forwarding path:
+ *   loose   the route is unicast (not unreachable or prohibit; a blackhole
+ *           route cannot be told from a failed lookup and passes)
+ *   strict  ... and it leaves through the interface the packet arrived on
+ * Answers are cached per source /24 in a direct-mapped table of 64-bit
+ * words (a more specific route inside a /24 is not seen):
+ *   bits 40-63  /24 prefix
+ *   bits 24-39  route generation (1..65535, 0 = empty)
+ *   bit  21     lookup pending (no answer yet)
+ *   bit  20     usable unicast route
+ *   bits  0-19  output ifindex
+ * Sources that are one of our own addresses are not checked: capture sees
+ * the host's outbound packets too, and the kernel answers RTN_LOCAL for them.
+ * A listener thread on the RTMGRP_IPV4_ROUTE / IFADDR / LINK groups bumps
+ * the generation on every notification, which invalidates the whole cache
+ * at once. The capture thread never waits on netlink: a miss marks the slot
+ * pending, queues the source on the thread's own ring and passes the packet
+ * (as do later packets of the /24 until the answer is in); a resolver
+ * thread does the RTM_GETROUTE lookups and fills the cache. At most
+ * RPF_QUERY_BUDGET misses per thread and packet second are queued, past that
+ * packets pass unverified (counted), which bounds what a flood of random
+ * spoofed sources can cost.
+ */
+
+#include "antispoof.h"
+#include "worker.h"
+#include "droplog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#define AS_SPLIT          0x80       /* class16[]: see split24[] */
+#define RPF_CACHE_SLOTS   16384      /* power of two, 128 KiB */
+#define RPF_PENDING       (1ull << 21)
+#define RPF_USABLE        (1ull << 20)
+#define RPF_OIF_MASK      0xFFFFFull
+#define RPF_QUERY_BUDGET  2000       /* netlink lookups per thread per second */
+#define RPF_QUERY_TIMEOUT_MS 100
+#define RPF_QUEUE_SIZE    4096       /* queued lookups per capture thread, power of two */
+#define RPF_IDLE_NS       1000000
+
+static const char *class_names[AS_CLASSES] = { "martian", "reserved", "private" };
+static const char *rpf_names[] = { "off", "loose", "strict" };
+
+/* AS_CLASS_* + 1 of each /16, 0 = ordinary address space */
+static uint8_t class16[65536];
+
+static const struct { uint32_t net; int len; as_class_t cls; } bogons[] = {
+    { 0x00000000,  8, AS_CLASS_MARTIAN  },   /* "this" network */
+    { 0x7F000000,  8, AS_CLASS_MARTIAN  },   /* loopback */
+    { 0xE0000000,  4, AS_CLASS_MARTIAN  },   /* multicast */
+    { 0xF0000000,  4, AS_CLASS_MARTIAN  },   /* reserved + limited broadcast */
+    { 0xC6120000, 15, AS_CLASS_RESERVED },   /* 198.18/15 benchmarking */
+    { 0x0A000000,  8, AS_CLASS_PRIVATE  },   /* RFC 1918 */
+    { 0xAC100000, 12, AS_CLASS_PRIVATE  },
+    { 0xC0A80000, 16, AS_CLASS_PRIVATE  },
+    { 0x64400000, 10, AS_CLASS_PRIVATE  },   /* 100.64/10 CGN */
+    { 0xA9FE0000, 16, AS_CLASS_PRIVATE  },   /* link-local */
+};
+
+/* Reserved /24s (src >> 8): IETF protocol assignments, TEST-NET-1/2/3 */
+static const uint32_t split24[] = { 0xC00000, 0xC00002, 0xC63364, 0xCB0071 };
+
+static uint32_t drop_classes = 1u << AS_CLASS_MARTIAN | 1u << AS_CLASS_RESERVED;
+static rpf_mode_t rpf_mode = RPF_LOOSE;
+static int lo_ifindex;
+
+static uint64_t rpf_cache[RPF_CACHE_SLOTS];
+static uint32_t rpf_gen = 1;
+
+static int listen_fd = -1;
+static pthread_t listener;
+static bool listener_running;
+static volatile int listener_stop;
+static uint64_t invalidations;
+
+/* sources waiting for a lookup: one SPSC ring per capture thread */
+typedef struct {
+    uint32_t head __attribute__((aligned(CACHE_LINE)));   /* capture thread */
+    uint32_t tail __attribute__((aligned(CACHE_LINE)));   /* resolver */
+    uint32_t src[RPF_QUEUE_SIZE];
+} rpf_queue_t;
+
+static rpf_queue_t *queues[MAX_WORKERS];
+static int queue_count;
+static __thread rpf_queue_t *my_queue;
+static __thread bool queue_unavailable;
+static __thread time_t budget_sec;
+static __thread uint32_t budget_used;
+
+/* resolver thread and its query socket */
+static int nl_fd = -1;
+static uint32_t nl_seq;
+static pthread_t resolver;
+static bool resolver_running;
+static volatile int resolver_stop;
+static uint64_t lookup_errors;
+
+/* per-thread counters */
+static struct {
+    uint64_t cls[AS_CLASSES];    /* sources in each class, dropped or not */
+    uint64_t land;               /* src == dst (counted as martian) */
+    uint64_t bogon_dropped;
+    uint64_t hit, miss, pending, unverified;
+    uint64_t fail_loose, fail_strict;
+} __attribute__((aligned(CACHE_LINE))) as_stats[MAX_WORKERS];
+
+static int classify(uint32_t src, uint32_t dst) {
+    if (src == dst) return AS_CLASS_MARTIAN;
+    uint8_t c = class16[src >> 16];
+    if (c != AS_SPLIT) return (int)c - 1;
+    for (size_t i = 0; i < sizeof(split24) / sizeof(split24[0]); ++i)
+        if (src >> 8 == split24[i]) return AS_CLASS_RESERVED;
+    return -1;
+}
+
+static inline uint64_t gen_tag(void) {
+    return __atomic_load_n(&rpf_gen, __ATOMIC_RELAXED) % 0xFFFFu + 1;
+}
+
+static inline uint64_t *cache_slot(uint32_t prefix) {
+    uint32_t x = prefix * 0x9e3779b9u;
+    x ^= x >> 16;
+    return &rpf_cache[x & (RPF_CACHE_SLOTS - 1)];
+}
+
+/* Route back to src: 1 usable unicast route (*oif set), 0 none, -1 lookup failed */
+static int fib_lookup(uint32_t src, int *oif) {
+    struct {
+        struct nlmsghdr nh;
+        struct rtmsg rt;
+        struct rtattr ra;
+        uint32_t dst;
+    } req;
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = sizeof(req);
+    req.nh.nlmsg_type = RTM_GETROUTE;
+    req.nh.nlmsg_flags = NLM_F_REQUEST;
+    req.nh.nlmsg_seq = ++nl_seq;
+    req.rt.rtm_family = AF_INET;
+    req.rt.rtm_dst_len = 32;
+    req.ra.rta_type = RTA_DST;
+    req.ra.rta_len = RTA_LENGTH(sizeof(uint32_t));
+    req.dst = htonl(src);
+    if (send(nl_fd, &req, sizeof(req), 0) < 0) return -1;
+
+    char buf[1024] __attribute__((aligned(NLMSG_ALIGNTO)));
+    for (;;) {
+        ssize_t n = recv(nl_fd, buf, sizeof(buf), 0);
+        if (n <= 0) return -1;   /* timeout: a late reply is skipped by seq next time */
+        int len = (int)n;
+        for (struct nlmsghdr *nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+            if (nh->nlmsg_seq != nl_seq) continue;
+            if (nh->nlmsg_type == NLMSG_ERROR) {
+                int err = ((struct nlmsgerr *)NLMSG_DATA(nh))->error;
+                /* unreachable / prohibit routes; a blackhole answers -EINVAL like a
+                 * bad request, so it counts as a failed lookup and passes */
+                return err == -ENETUNREACH || err == -EHOSTUNREACH || err == -EACCES ? 0 : -1;
+            }
+            if (nh->nlmsg_type != RTM_NEWROUTE) return -1;
+            struct rtmsg *rt = NLMSG_DATA(nh);
+            if (rt->rtm_type != RTN_UNICAST) return 0;
+            *oif = 0;
+            int alen = (int)RTM_PAYLOAD(nh);
+            for (struct rtattr *ra = RTM_RTA(rt); RTA_OK(ra, alen); ra = RTA_NEXT(ra, alen))
+                if (ra->rta_type == RTA_OIF) memcpy(oif, RTA_DATA(ra), sizeof(int));
+            return 1;
+        }
+    }
+}
+
+static rpf_queue_t *queue_get(void) {
+    if (my_queue || queue_unavailable) return my_queue;
+    int slot = __atomic_fetch_add(&queue_count, 1, __ATOMIC_RELAXED);
+    rpf_queue_t *q = slot < MAX_WORKERS ? aligned_alloc(CACHE_LINE, sizeof(rpf_queue_t)) : NULL;
+    if (!q) { queue_unavailable = true; return NULL; }
+    q->head = q->tail = 0;
+    __atomic_store_n(&queues[slot], q, __ATOMIC_RELEASE);
+    return my_queue = q;
+}
+
+/* Resolve one queued source and store the answer for its /24 */
+static void resolve(uint32_t src) {
+    uint32_t prefix = src >> 8;
+    uint64_t tag = gen_tag();   /* before the lookup: a change meanwhile invalidates the answer */
+    uint64_t *slot = cache_slot(prefix);
+    uint64_t v = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    if (v >> 40 == prefix && (v >> 24 & 0xFFFF) == tag && !(v & RPF_PENDING)) return;   /* queued twice */
+    int oif = 0;
+    int r = fib_lookup(src, &oif);
+    if (r < 0) {
+        __atomic_fetch_add(&lookup_errors, 1, __ATOMIC_RELAXED);
+        /* let a later packet of the /24 queue it again */
+        __atomic_compare_exchange_n(slot, &v, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        return;
+    }
+    v = (uint64_t)prefix << 40 | tag << 24 | (r ? RPF_USABLE : 0) | ((uint64_t)oif & RPF_OIF_MASK);
+    __atomic_store_n(slot, v, __ATOMIC_RELAXED);
+}
+
+static void *resolver_main(void *arg) {
+    (void)arg;
+    while (!resolver_stop) {
+        bool idle = true;
+        int n = __atomic_load_n(&queue_count, __ATOMIC_RELAXED);
+        for (int i = 0; i < n && i < MAX_WORKERS; ++i) {
+            rpf_queue_t *q = __atomic_load_n(&queues[i], __ATOMIC_ACQUIRE);
+            if (!q) continue;
+            uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+            for (uint32_t t = q->tail; t != head; ++t) {
+                resolve(q->src[t & (RPF_QUEUE_SIZE - 1)]);
+                __atomic_store_n(&q->tail, t + 1, __ATOMIC_RELEASE);
+                idle = false;
+            }
+        }
+        if (idle) {
+            struct timespec ts = { 0, RPF_IDLE_NS };
+            nanosleep(&ts, NULL);
+        }
+    }
+    return NULL;
+}
+
+static void *listener_main(void *arg) {
+    (void)arg;
+    char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct pollfd p = { .fd = listen_fd, .events = POLLIN };
+    while (!listener_stop) {
+        if (poll(&p, 1, 500) <= 0) continue;
+        ssize_t n = recv(listen_fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n < 0 && errno != ENOBUFS) continue;   /* ENOBUFS: notifications lost, flush anyway */
+        __atomic_fetch_add(&rpf_gen, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&invalidations, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/* drop line detail, formatted by the droplog writer: u[0] AS_DROP_*,
+ * u[1] class or arrival ifindex, u[2] route ifindex */
+enum { AS_DROP_BOGON, AS_DROP_NO_ROUTE, AS_DROP_STRICT };
+
+static int fmt_drop(const droplog_event_t *e, char *out, size_t len) {
+    if (e->u[0] == AS_DROP_BOGON)
+        return snprintf(out, len, "class=%s | reason=%s", class_names[e->u[1]], e->reason);
+    if (e->u[0] == AS_DROP_NO_ROUTE)
+        return snprintf(out, len, "no route back | reason=%s", e->reason);
+    char in_name[IF_NAMESIZE] = "?", out_name[IF_NAMESIZE] = "?";
+    if_indextoname(e->u[1], in_name);
+    if_indextoname(e->u[2], out_name);
+    return snprintf(out, len, "in=%s route=%s | reason=%s", in_name, out_name, e->reason);
+}
+
+static void log_drop(const struct pcap_pkthdr *h, const pkt_meta_t *m, const char *reason,
+                     uint32_t kind, uint32_t a, uint32_t b) {
+    droplog_event_t *e = droplog_begin(DL_STAGE_ANTISPOOF, h, m, reason, fmt_drop);
+    if (!e) return;
+    e->u[0] = kind;
+    e->u[1] = a;
+    e->u[2] = b;
+    droplog_commit(e);
+}
+
+void antispoof_init(void) {
+    memset(class16, 0, sizeof(class16));
+    for (size_t i = 0; i < sizeof(bogons) / sizeof(bogons[0]); ++i) {
+        uint32_t first = bogons[i].net >> 16, count = bogons[i].len >= 16 ? 1 : 1u << (16 - bogons[i].len);
+        for (uint32_t k = 0; k < count; ++k) class16[first + k] = (uint8_t)(bogons[i].cls + 1);
+    }
+    for (size_t i = 0; i < sizeof(split24) / sizeof(split24[0]); ++i) class16[split24[i] >> 8] = AS_SPLIT;
+    memset(rpf_cache, 0, sizeof(rpf_cache));
+    memset(as_stats, 0, sizeof(as_stats));
+    lo_ifindex = (int)if_nametoindex("lo");
+    if (rpf_mode == RPF_OFF) return;
+
+    listen_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    struct sockaddr_nl sa = { .nl_family = AF_NETLINK,
+                              .nl_groups = RTMGRP_IPV4_ROUTE | RTMGRP_IPV4_IFADDR | RTMGRP_LINK };
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+        fprintf(stderr, "antispoof: route netlink unavailable (%s), uRPF disabled\n", strerror(errno));
+        if (listen_fd >= 0) close(listen_fd);
+        listen_fd = -1;
+        rpf_mode = RPF_OFF;
+        return;
+    }
+    listener_stop = 0;
+    listener_running = pthread_create(&listener, NULL, listener_main, NULL) == 0;
+    if (!listener_running)
+        fprintf(stderr, "antispoof: no route listener, cached uRPF answers are never refreshed\n");
+
+    nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (nl_fd >= 0) {
+        struct timeval tv = { 0, RPF_QUERY_TIMEOUT_MS * 1000 };
+        setsockopt(nl_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        resolver_stop = 0;
+        resolver_running = pthread_create(&resolver, NULL, resolver_main, NULL) == 0;
+    }
+    if (!resolver_running) {
+        fprintf(stderr, "antispoof: no route resolver, uRPF disabled\n");
+        rpf_mode = RPF_OFF;
+    }
+}
+
+void antispoof_shutdown(void) {
+    if (listener_running) {
+        listener_stop = 1;
+        pthread_join(listener, NULL);
+        listener_running = false;
+    }
+    if (listen_fd >= 0) close(listen_fd);
+    listen_fd = -1;
+    if (resolver_running) {
+        resolver_stop = 1;
+        pthread_join(resolver, NULL);
+        resolver_running = false;
+    }
+    if (nl_fd >= 0) close(nl_fd);
+    nl_fd = -1;
+}
+
+void antispoof_set_drop_classes(uint32_t mask) {
+    drop_classes = mask;
+}
+
+int antispoof_parse_classes(const char *list, uint32_t *mask) {
+    if (strcasecmp(list, "none") == 0) { *mask = 0; return 0; }
+    if (strcasecmp(list, "all") == 0) { *mask = (1u << AS_CLASSES) - 1; return 0; }
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", list);
+    uint32_t m = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        int c = 0;
+        while (c < AS_CLASSES && strcasecmp(tok, class_names[c]) != 0) ++c;
+        if (c == AS_CLASSES) return -1;
+        m |= 1u << c;
+    }
+    *mask = m;
+    return 0;
+}
+
+void antispoof_set_rpf(rpf_mode_t mode) {
+    rpf_mode = mode;
+}
+
+int antispoof_parse_rpf(const char *s) {
+    for (int i = 0; i < 3; ++i) if (strcasecmp(s, rpf_names[i]) == 0) return i;
+    return -1;
+}
+
+bool antispoof_check(const struct pcap_pkthdr *header, const pkt_meta_t *m, int ifindex) {
+    if (!m->is_ipv4) return true;
+    /* loopback legitimately carries 127/8 and src == dst */
+    if (ifindex && ifindex == lo_ifindex) return true;
+    int w = worker_id();
+
+    int cls = classify(m->src_ip, m->dst_ip);
+    if (cls >= 0) {
+        WORKER_COUNTER_ADD(&as_stats[w].cls[cls], 1);
+        if (m->src_ip == m->dst_ip) WORKER_COUNTER_ADD(&as_stats[w].land, 1);
+        if (drop_classes & (1u << cls)) {
+            WORKER_COUNTER_ADD(&as_stats[w].bogon_dropped, 1);
+            log_drop(header, m, m->src_ip == m->dst_ip ? "land" :
+                                cls == AS_CLASS_MARTIAN ? "martian_src" :
+                                cls == AS_CLASS_RESERVED ? "bogon_src" : "private_src",
+                     AS_DROP_BOGON, (uint32_t)cls, 0);
+            return false;
+        }
+    }
+    if (rpf_mode == RPF_OFF) return true;
+    /* our own outbound traffic: the route back is RTN_LOCAL */
+    if (packet_is_local(m->src_ip)) return true;
+
+    uint32_t prefix = m->src_ip >> 8;
+    uint64_t tag = gen_tag();
+    uint64_t *slot = cache_slot(prefix);
+    uint64_t v = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    if (v >> 40 != prefix || (v >> 24 & 0xFFFF) != tag) {
+        /* miss: queue the lookup, pass the packet */
+        if (budget_sec != header->ts.tv_sec) { budget_sec = header->ts.tv_sec; budget_used = 0; }
+        rpf_queue_t *q = budget_used < RPF_QUERY_BUDGET ? queue_get() : NULL;
+        if (!q || q->head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) >= RPF_QUEUE_SIZE) {
+            WORKER_COUNTER_ADD(&as_stats[w].unverified, 1);
+            return true;
+        }
+        ++budget_used;
+        __atomic_store_n(slot, (uint64_t)prefix << 40 | tag << 24 | RPF_PENDING, __ATOMIC_RELAXED);
+        q->src[q->head & (RPF_QUEUE_SIZE - 1)] = m->src_ip;
+        __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+        WORKER_COUNTER_ADD(&as_stats[w].miss, 1);
+        return true;
+    }
+    if (v & RPF_PENDING) { WORKER_COUNTER_ADD(&as_stats[w].pending, 1); return true; }
+    WORKER_COUNTER_ADD(&as_stats[w].hit, 1);
+
+    int oif = (int)(v & RPF_OIF_MASK);
+    if (!(v & RPF_USABLE)) {
+        WORKER_COUNTER_ADD(&as_stats[w].fail_loose, 1);
+        log_drop(header, m, "urpf_fail", AS_DROP_NO_ROUTE, 0, 0);
+        return false;
+    }
+    if (rpf_mode == RPF_STRICT && ifindex && oif && oif != ifindex) {
+        WORKER_COUNTER_ADD(&as_stats[w].fail_strict, 1);
+        log_drop(header, m, "urpf_strict", AS_DROP_STRICT, (uint32_t)ifindex, (uint32_t)oif);
+        return false;
+    }
+    return true;
+}
+
+void antispoof_report(void) {
+    uint64_t cls[AS_CLASSES] = {0}, s[8] = {0};
+    for (int w = 0; w < worker_count(); ++w) {
+        for (int c = 0; c < AS_CLASSES; ++c) cls[c] += WORKER_COUNTER_READ(&as_stats[w].cls[c]);
+        s[0] += WORKER_COUNTER_READ(&as_stats[w].land);
+        s[1] += WORKER_COUNTER_READ(&as_stats[w].bogon_dropped);
+        s[2] += WORKER_COUNTER_READ(&as_stats[w].hit);
+        s[3] += WORKER_COUNTER_READ(&as_stats[w].miss);
+        s[4] += WORKER_COUNTER_READ(&as_stats[w].unverified);
+        s[5] += WORKER_COUNTER_READ(&as_stats[w].pending);
+        s[6] += WORKER_COUNTER_READ(&as_stats[w].fail_loose);
+        s[7] += WORKER_COUNTER_READ(&as_stats[w].fail_strict);
+    }
+
+    printf("\n📊 [ANTISPOOF STATISTICS] (uRPF=%s)\n", rpf_names[rpf_mode]);
+    printf("   Bogon sources: %" PRIu64 " martian (%" PRIu64 " src == dst), %" PRIu64 " reserved, %" PRIu64 " private; dropped %" PRIu64 "\n",
+           cls[AS_CLASS_MARTIAN], s[0], cls[AS_CLASS_RESERVED], cls[AS_CLASS_PRIVATE], s[1]);
+    if (rpf_mode == RPF_OFF) return;
+    uint64_t lookups = s[2] + s[3];
+    printf("   uRPF failed: %" PRIu64 " no route back, %" PRIu64 " wrong interface (strict)\n", s[6], s[7]);
+    printf("   FIB cache: %" PRIu64 " hits, %" PRIu64 " netlink lookups (%.1f%% hit), %" PRIu64 " invalidations\n",
+           s[2], s[3], lookups ? 100.0 * (double)s[2] / (double)lookups : 0.0,
+           __atomic_load_n(&invalidations, __ATOMIC_RELAXED));
+    printf("   Passed unverified: %" PRIu64 " waiting for a lookup, %" PRIu64 " over the %d lookups/s budget, %" PRIu64 " lookup errors\n",
+           s[5], s[4], RPF_QUERY_BUDGET, __atomic_load_n(&lookup_errors, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,44 @@
+#ifndef ANTISPOOF_H
+#define ANTISPOOF_H
+
+#include <pcap.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "packet.h"
+
+/* Source address classes (bit = 1u << class) */
+typedef enum {
+    AS_CLASS_MARTIAN  = 0,   /* 0/8, 127/8, multicast, 240/4, src == dst */
+    AS_CLASS_RESERVED = 1,   /* documentation, benchmarking, IETF protocol nets */
+    AS_CLASS_PRIVATE  = 2,   /* RFC 1918, CGN 100.64/10, link-local */
+    AS_CLASSES
+} as_class_t;
+
+/* Reverse-path check of the source against the kernel FIB */
+typedef enum {
+    RPF_OFF    = 0,
+    RPF_LOOSE  = 1,   /* any usable route back to the source (default) */
+    RPF_STRICT = 2    /* the route back leaves through the arrival interface */
+} rpf_mode_t;
+
+/* Opens the netlink sockets and starts the route-change listener and the
+ * lookup resolver (uRPF on) */
+void antispoof_init(void);
+void antispoof_shutdown(void);
+
+/* Classes that drop (default martian + reserved; private sources are counted) */
+void antispoof_set_drop_classes(uint32_t mask);
+/* "all", "none" or a comma list of martian,reserved,private; 0 ok, -1 unknown */
+int antispoof_parse_classes(const char *list, uint32_t *mask);
+void antispoof_set_rpf(rpf_mode_t mode);
+/* "off", "loose" or "strict"; -1 if unknown */
+int antispoof_parse_rpf(const char *s);
+
+/* Return true == ALLOW. ifindex: interface the packet arrived on (0 = unknown,
+ * strict mode then falls back to loose) */
+bool antispoof_check(const struct pcap_pkthdr *header, const pkt_meta_t *m, int ifindex);
+
+/* Report statistics */
+void antispoof_report(void);
+
+#endif /* ANTISPOOF_H */
@@ -0,0 +1,299 @@
+/*
+ * ban.c
+ * Temporary source bans driven by rate-limit drops, expired by a timer wheel.
+ *
+ * Every source the rate limiter drops gets a "strike" entry; once it collects
+ * ban_threshold drops inside ban_window seconds it is banned for ban_ttl
+ * seconds and rejected right after antispoof and the allowlist, before the
+ * other filter stages run.
+ *
+ * Table: fixed-size open addressing, each slot one 64-bit word
+ * (src_ip << 32 | ban_expiry_sec), so ban_check reads it lock-free with a
+ * single atomic load. Strike entries carry expiry 0. All writers (strikes,
+ * bans, expiry) hold ban_lock. Removed entries become tombstones and are
+ * reused by later inserts; probes are capped, which also bounds the table.
+ *
+ * Expiry: a 256-slot hashed timer wheel with 1 s ticks, advanced from
+ * packet timestamps. Deadlines further out than one revolution simply stay
+ * in their slot until a pass finds them due.
+ *
+ * Active bans can be exported and restored (ban_export / ban_restore) so the
+ * rate limiter's state file carries them across restarts.
+ *
+ * Ban and expiry lines go through droplog (DL_STAGE_BAN): the capture
+ * thread only stores an event in its ring, which is cheap enough to do
+ * under ban_lock, and the writer thread formats and prints it.
+ */
+
+#include "ban.h"
+#include "worker.h"
+#include "dropcap.h"
+#include "droplog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <inttypes.h>
+
+#define BAN_TABLE_SIZE   32768          /* power of two */
+#define BAN_MAX_ENTRIES  (BAN_TABLE_SIZE / 2)
+#define BAN_MAX_PROBE    32
+#define BAN_WHEEL_SLOTS  256            /* power of two, 1 s per slot */
+
+#define SLOT_EMPTY     0ULL
+#define SLOT_TOMBSTONE 0xFFFFFFFF00000000ULL   /* 255.255.255.255 never sources traffic */
+
+static int ban_threshold = 20;
+static int ban_window = 10;
+static int ban_ttl = 300;
+
+static uint64_t slots[BAN_TABLE_SIZE];          /* read lock-free */
+
+/* writer-only side state, guarded by ban_lock */
+static pthread_mutex_t ban_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t deadline[BAN_TABLE_SIZE];       /* strike window end or ban expiry */
+static uint32_t strikes[BAN_TABLE_SIZE];
+static uint32_t banned_at[BAN_TABLE_SIZE];
+static int32_t wheel_next[BAN_TABLE_SIZE], wheel_prev[BAN_TABLE_SIZE];
+static int32_t wheel_head[BAN_WHEEL_SLOTS];
+static uint32_t wheel_tick = 0;                 /* last processed second */
+static int live_entries = 0;
+
+/* per-entry drops while banned (atomic adds from the check path) */
+static uint64_t ban_hits[BAN_TABLE_SIZE];
+
+static int active_bans = 0;                     /* atomic; 0 => ban_check fast exit */
+static struct {
+    uint64_t banned_pkts;
+} __attribute__((aligned(CACHE_LINE))) ban_stats[MAX_WORKERS];
+static uint64_t stat_bans = 0, stat_expired = 0, stat_table_full = 0, stat_restored = 0;
+
+static inline uint32_t ip_hash(uint32_t ip) {
+    uint32_t x = ip; x ^= x >> 16; x *= 0x7feb352d; x ^= x >> 15; x *= 0x846ca68b; x ^= x >> 16;
+    return x & (BAN_TABLE_SIZE - 1);
+}
+
+/* ban issued: u = { ttl, strikes, window }; expired: u = { seconds banned,
+ * hits low, hits high } */
+static int fmt_banned(const droplog_event_t *e, char *out, size_t len) {
+    return snprintf(out, len, "reason=%s | banned for %us after %u rate-limit drops in %us",
+                    e->reason, e->u[0], e->u[1], e->u[2]);
+}
+
+static int fmt_expired(const droplog_event_t *e, char *out, size_t len) {
+    return snprintf(out, len, "reason=%s | banned %us | dropped %" PRIu64 " packets while banned",
+                    e->reason, e->u[0], (uint64_t)e->u[2] << 32 | e->u[1]);
+}
+
+/* Event for src_ip at packet-time second now; NULL if the ring is full */
+static droplog_event_t *ban_event(uint32_t src_ip, uint32_t now, const char *reason, droplog_fmt_t fmt) {
+    struct pcap_pkthdr h = { .ts = { .tv_sec = now } };
+    droplog_event_t *e = droplog_begin(DL_STAGE_BAN, &h, NULL, reason, fmt);
+    if (e) { e->flags = 0; e->src_ip = src_ip; }
+    return e;
+}
+
+/* ---- timer wheel (ban_lock held) ---- */
+
+static void wheel_unlink(int32_t i) {
+    int32_t n = wheel_next[i], p = wheel_prev[i];
+    if (p >= 0) wheel_next[p] = n;
+    else wheel_head[deadline[i] & (BAN_WHEEL_SLOTS - 1)] = n;
+    if (n >= 0) wheel_prev[n] = p;
+    wheel_next[i] = wheel_prev[i] = -1;
+}
+
+static void wheel_link(int32_t i, uint32_t when) {
+    deadline[i] = when;
+    int32_t *head = &wheel_head[when & (BAN_WHEEL_SLOTS - 1)];
+    wheel_prev[i] = -1;
+    wheel_next[i] = *head;
+    if (*head >= 0) wheel_prev[*head] = i;
+    *head = i;
+}
+
+static void remove_entry(int32_t i) {
+    wheel_unlink(i);
+    __atomic_store_n(&slots[i], SLOT_TOMBSTONE, __ATOMIC_RELEASE);
+    live_entries--;
+}
+
+static void expire_slot(uint32_t slot, uint32_t now) {
+    int32_t i = wheel_head[slot];
+    while (i >= 0) {
+        int32_t next = wheel_next[i];
+        if (deadline[i] <= now) {
+            uint64_t w = __atomic_load_n(&slots[i], __ATOMIC_RELAXED);
+            if ((uint32_t)w != 0) {
+                droplog_event_t *e = ban_event((uint32_t)(w >> 32), now, "ban_expired", fmt_expired);
+                if (e) {
+                    uint64_t hits = __atomic_load_n(&ban_hits[i], __ATOMIC_RELAXED);
+                    e->u[0] = deadline[i] - banned_at[i];
+                    e->u[1] = (uint32_t)hits;
+                    e->u[2] = (uint32_t)(hits >> 32);
+                    droplog_commit(e);
+                }
+                stat_expired++;
+                __atomic_sub_fetch(&active_bans, 1, __ATOMIC_RELAXED);
+            }
+            remove_entry(i);
+        }
+        i = next;
+    }
+}
+
+static void wheel_advance(uint32_t now) {
+    if (wheel_tick == 0) { __atomic_store_n(&wheel_tick, now, __ATOMIC_RELAXED); return; }
+    if (now <= wheel_tick) return;   /* threads may deliver slightly older timestamps */
+    uint32_t steps = now - wheel_tick;
+    if (steps > BAN_WHEEL_SLOTS) steps = BAN_WHEEL_SLOTS;   /* one full revolution covers every slot */
+    for (uint32_t t = now - steps + 1; t != now + 1; ++t) expire_slot(t & (BAN_WHEEL_SLOTS - 1), now);
+    __atomic_store_n(&wheel_tick, now, __ATOMIC_RELAXED);
+}
+
+/* ---- table (ban_lock held for find_or_insert) ---- */
+
+static int32_t find_or_insert(uint32_t ip) {
+    uint32_t h = ip_hash(ip);
+    int32_t free_slot = -1;
+    for (int p = 0; p < BAN_MAX_PROBE; ++p, h = (h + 1) & (BAN_TABLE_SIZE - 1)) {
+        uint64_t w = slots[h];
+        if (w == SLOT_EMPTY) { if (free_slot < 0) free_slot = (int32_t)h; break; }
+        if (w == SLOT_TOMBSTONE) { if (free_slot < 0) free_slot = (int32_t)h; continue; }
+        if ((uint32_t)(w >> 32) == ip) return (int32_t)h;
+    }
+    if (free_slot < 0 || live_entries >= BAN_MAX_ENTRIES) { stat_table_full++; return -1; }
+    strikes[free_slot] = 0;
+    banned_at[free_slot] = 0;
+    __atomic_store_n(&ban_hits[free_slot], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&slots[free_slot], (uint64_t)ip << 32, __ATOMIC_RELEASE);
+    live_entries++;
+    return free_slot;
+}
+
+/* ---- public API ---- */
+
+void ban_init(void) {
+    pthread_mutex_lock(&ban_lock);
+    memset(slots, 0, sizeof(slots));
+    memset(ban_hits, 0, sizeof(ban_hits));
+    memset(wheel_next, 0xff, sizeof(wheel_next));
+    memset(wheel_prev, 0xff, sizeof(wheel_prev));
+    memset(wheel_head, 0xff, sizeof(wheel_head));
+    wheel_tick = 0;
+    live_entries = 0;
+    active_bans = 0;
+    memset(ban_stats, 0, sizeof(ban_stats));
+    stat_bans = stat_expired = stat_table_full = stat_restored = 0;
+    pthread_mutex_unlock(&ban_lock);
+}
+
+void ban_set_params(int threshold, int window_sec, int ttl_sec) {
+    if (threshold > 0) ban_threshold = threshold;
+    if (window_sec > 0) ban_window = window_sec;
+    if (ttl_sec > 0) ban_ttl = ttl_sec;
+}
+
+bool ban_check(const struct pcap_pkthdr *header, const pkt_meta_t *m) {
+    if (__atomic_load_n(&active_bans, __ATOMIC_RELAXED) == 0 || !m->is_ipv4) return true;
+
+    uint32_t now = (uint32_t)header->ts.tv_sec;
+    if (now > __atomic_load_n(&wheel_tick, __ATOMIC_RELAXED) && pthread_mutex_trylock(&ban_lock) == 0) {
+        wheel_advance(now);
+        pthread_mutex_unlock(&ban_lock);
+    }
+
+    uint32_t h = ip_hash(m->src_ip);
+    for (int p = 0; p < BAN_MAX_PROBE; ++p, h = (h + 1) & (BAN_TABLE_SIZE - 1)) {
+        uint64_t w = __atomic_load_n(&slots[h], __ATOMIC_ACQUIRE);
+        if (w == SLOT_EMPTY) break;
+        if ((uint32_t)(w >> 32) != m->src_ip) continue;
+        if ((uint32_t)w <= now) break;   /* strike only, or ban already expired */
+        __atomic_add_fetch(&ban_hits[h], 1, __ATOMIC_RELAXED);
+        WORKER_COUNTER_ADD(&ban_stats[worker_id()].banned_pkts, 1);
+        dropcap_note(header, "BAN", "banned_src", true);   /* no drop line, but captured */
+        return false;
+    }
+    return true;
+}
+
+void ban_note_drop(uint32_t src_ip, uint32_t now) {
+    pthread_mutex_lock(&ban_lock);
+    wheel_advance(now);
+    int32_t i = find_or_insert(src_ip);
+    if (i < 0) { pthread_mutex_unlock(&ban_lock); return; }
+
+    uint64_t w = slots[i];
+    if ((uint32_t)w > now) { pthread_mutex_unlock(&ban_lock); return; }   /* already banned */
+
+    if (strikes[i] == 0) wheel_link(i, now + (uint32_t)ban_window);
+    if (++strikes[i] < (uint32_t)ban_threshold) { pthread_mutex_unlock(&ban_lock); return; }
+
+    /* promote to ban: move to the expiry slot and publish the expiry */
+    uint32_t expires = now + (uint32_t)ban_ttl;
+    wheel_unlink(i);
+    wheel_link(i, expires);
+    banned_at[i] = now;
+    __atomic_store_n(&slots[i], ((uint64_t)src_ip << 32) | expires, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&active_bans, 1, __ATOMIC_RELAXED);
+    stat_bans++;
+    uint32_t n = strikes[i];
+    pthread_mutex_unlock(&ban_lock);
+
+    droplog_event_t *e = ban_event(src_ip, now, "ban_issued", fmt_banned);
+    if (!e) return;
+    e->u[0] = (uint32_t)ban_ttl;
+    e->u[1] = n;
+    e->u[2] = (uint32_t)ban_window;
+    droplog_commit(e);
+}
+
+int ban_export(ban_record_t *out, int max) {
+    int n = 0;
+    pthread_mutex_lock(&ban_lock);
+    for (int32_t i = 0; i < BAN_TABLE_SIZE && n < max; ++i) {
+        uint64_t w = slots[i];
+        if (w == SLOT_EMPTY || w == SLOT_TOMBSTONE || (uint32_t)w == 0) continue;
+        out[n++] = (ban_record_t){ (uint32_t)(w >> 32), (uint32_t)w, banned_at[i] };
+    }
+    pthread_mutex_unlock(&ban_lock);
+    return n;
+}
+
+int ban_restore(const ban_record_t *in, int n, int64_t shift_sec, uint32_t now_sec) {
+    int restored = 0;
+    pthread_mutex_lock(&ban_lock);
+    for (int k = 0; k < n; ++k) {
+        int64_t expires = (int64_t)in[k].expires + shift_sec;
+        if (expires <= (int64_t)now_sec || expires > UINT32_MAX) continue;
+        int32_t i = find_or_insert(in[k].src_ip);
+        if (i < 0) break;
+        if ((uint32_t)slots[i] != 0) continue;   /* already banned */
+        if (strikes[i] != 0) wheel_unlink(i);
+        strikes[i] = (uint32_t)ban_threshold;
+        int64_t since = (int64_t)in[k].banned_at + shift_sec;
+        banned_at[i] = since > 0 ? (uint32_t)since : 0;
+        wheel_link(i, (uint32_t)expires);
+        __atomic_store_n(&slots[i], ((uint64_t)in[k].src_ip << 32) | (uint32_t)expires, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&active_bans, 1, __ATOMIC_RELAXED);
+        restored++;
+    }
+    stat_restored += (uint64_t)restored;
+    pthread_mutex_unlock(&ban_lock);
+    return restored;
+}
+
+void ban_report(void) {
+    uint64_t banned_pkts = 0;
+    for (int w = 0; w < worker_count(); ++w) banned_pkts += WORKER_COUNTER_READ(&ban_stats[w].banned_pkts);
+
+    pthread_mutex_lock(&ban_lock);
+    printf("\n📊 [BAN STATISTICS]\n");
+    printf("   Bans issued: %" PRIu64 " (threshold=%d drops/%ds, ttl=%ds), restored from state: %" PRIu64 "\n",
+           stat_bans, ban_threshold, ban_window, ban_ttl, stat_restored);
+    printf("   Bans expired: %" PRIu64 ", active: %d\n", stat_expired, __atomic_load_n(&active_bans, __ATOMIC_RELAXED));
+    printf("   Dropped while banned: %" PRIu64 " packets\n", banned_pkts);
+    printf("   Table: %d/%d entries, %" PRIu64 " offenders not tracked (table full)\n",
+           live_entries, BAN_MAX_ENTRIES, stat_table_full);
+    pthread_mutex_unlock(&ban_lock);
+}
@@ -0,0 +1,42 @@
+#ifndef BAN_H
+#define BAN_H
+
+/*
+ * ban.h
+ * Dynamic, TTL-based temporary bans for sources the rate limiter keeps
+ * dropping. Checked right after antispoof and the allowlist, before the
+ * costlier filter stages.
+ */
+
+#include <pcap.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "packet.h"
+
+void ban_init(void);
+
+/* threshold: rate-limit drops within window_sec that trigger a ban
+ * ttl_sec: how long the ban lasts (values <= 0 keep the current setting) */
+void ban_set_params(int threshold, int window_sec, int ttl_sec);
+
+/* Return true == ALLOW, false == banned (drop silently, counted) */
+bool ban_check(const struct pcap_pkthdr *header, const pkt_meta_t *m);
+
+/* Called by the rate limiter for every drop (src in host byte order) */
+void ban_note_drop(uint32_t src_ip, uint32_t now_sec);
+
+/* Warm restarts (rate_limit.c keeps these in its state file): active bans,
+ * expiry and start in packet-timestamp seconds */
+#define BAN_EXPORT_MAX 16384
+typedef struct { uint32_t src_ip; uint32_t expires; uint32_t banned_at; } ban_record_t;
+
+/* copy out up to max active bans; returns the number written */
+int ban_export(ban_record_t *out, int max);
+/* re-ban records shifted by shift_sec, skipping those expired by now_sec;
+ * returns the number restored */
+int ban_restore(const ban_record_t *in, int n, int64_t shift_sec, uint32_t now_sec);
+
+/* Report statistics */
+void ban_report(void);
+
+#endif /* BAN_H */
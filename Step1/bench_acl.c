@@ -0,0 +1,136 @@
+/*
+ * bench_acl.c
+ * Rule-count scaling benchmark for the ACL classifier.
+ *
+ * Generates random rule sets (mixed prefix lengths, exact/range/any ports,
+ * protocols and flag rules), classifies random packets with tuple-space
+ * search and with a linear first-match scan, checks they agree and prints
+ * the per-lookup cost of each.
+ *
+ * Build/run: make bench_acl && ./bench_acl [packets]
+ */
+
+#include "acl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+static uint32_t rnd(void) {
+    rng_state ^= rng_state << 13; rng_state ^= rng_state >> 7; rng_state ^= rng_state << 17;
+    return (uint32_t)rng_state;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/* Mostly specific rules (blocklists, per-service exceptions) with a few
+ * broad ones, roughly the shape of real firewall rule sets. */
+static void random_rule(acl_rule_t *r) {
+    static const uint8_t src_lens[] = { 8, 16, 24, 24, 32, 32, 32, 32 };
+    static const uint8_t dst_lens[] = { 24, 32, 32, 32 };
+    memset(r, 0, sizeof(*r));
+    r->priority = (int)(rnd() % 100000);
+    r->action = (rnd() % 4) ? ACL_DENY : ACL_ALLOW;
+    r->proto = (rnd() % 3) ? IPPROTO_TCP : IPPROTO_UDP;
+    r->src_net = rnd();
+    r->src_len = src_lens[rnd() % 8];
+    r->dst_net = 0xC0A80000 | (rnd() & 0xFFFF);
+    r->dst_len = dst_lens[rnd() % 4];
+    r->sport_lo = 0; r->sport_hi = 65535;
+    switch (rnd() % 4) {
+        case 0: r->dport_lo = (uint16_t)(rnd() % 1024); r->dport_hi = (uint16_t)(r->dport_lo + rnd() % 2000); break;
+        case 1: r->dport_lo = 0; r->dport_hi = 65535; break;
+        default: r->dport_lo = r->dport_hi = (uint16_t)(rnd() % 1024); break;
+    }
+    if (r->proto == IPPROTO_TCP && rnd() % 8 == 0) { r->flags_set = 0x02; r->flags_mask = 0x12; }
+    if (rnd() % 200 == 0) { r->src_len = 0; r->dst_len = 16; r->proto = ACL_PROTO_ANY; }
+}
+
+/* Half the packets are aimed at a random rule, half are random misses */
+static void random_packet(pkt_meta_t *m) {
+    memset(m, 0, sizeof(*m));
+    m->is_ipv4 = true;
+    m->src_ip = rnd();
+    m->dst_ip = 0xC0A80000 | (rnd() & 0xFFFF);
+    m->proto = (rnd() % 3) ? IPPROTO_TCP : IPPROTO_UDP;
+    m->src_port = (uint16_t)(1024 + rnd() % 60000);
+    m->dst_port = (uint16_t)(rnd() % 1024);
+    if (acl_rule_count() && (rnd() & 1)) {
+        const acl_rule_t *r = acl_rule_at((int)(rnd() % (uint32_t)acl_rule_count()));
+        uint32_t sm = r->src_len ? 0xFFFFFFFFu << (32 - r->src_len) : 0;
+        uint32_t dm = r->dst_len ? 0xFFFFFFFFu << (32 - r->dst_len) : 0;
+        m->src_ip = r->src_net | (m->src_ip & ~sm);
+        m->dst_ip = r->dst_net | (m->dst_ip & ~dm);
+        if (r->proto != ACL_PROTO_ANY) m->proto = (uint8_t)r->proto;
+        m->dst_port = r->dport_lo;
+    }
+    if (m->proto == IPPROTO_TCP) m->tcp_flags = (rnd() & 1) ? 0x02 : 0x10;
+}
+
+static int linear_classify(const pkt_meta_t *m) {
+    for (int i = 0; i < acl_rule_count(); ++i) {
+        const acl_rule_t *r = acl_rule_at(i);
+        uint32_t sm = r->src_len ? 0xFFFFFFFFu << (32 - r->src_len) : 0;
+        uint32_t dm = r->dst_len ? 0xFFFFFFFFu << (32 - r->dst_len) : 0;
+        if ((m->src_ip & sm) != r->src_net || (m->dst_ip & dm) != r->dst_net) continue;
+        if (r->proto != ACL_PROTO_ANY && r->proto != m->proto) continue;
+        if (m->src_port < r->sport_lo || m->src_port > r->sport_hi) continue;
+        if (m->dst_port < r->dport_lo || m->dst_port > r->dport_hi) continue;
+        if (r->flags_mask && (m->proto != IPPROTO_TCP || (m->tcp_flags & r->flags_mask) != r->flags_set)) continue;
+        return i;
+    }
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    int npkts = argc > 1 ? atoi(argv[1]) : 200000;
+    if (npkts <= 0) npkts = 200000;
+    static const int sizes[] = { 100, 1000, 10000, 50000 };
+
+    pkt_meta_t *pkts = malloc((size_t)npkts * sizeof(pkt_meta_t));
+    if (!pkts) return 1;
+
+    printf("%8s %8s %10s %12s %12s %8s %9s\n", "rules", "tuples", "build_ms", "tss_ns/pkt", "lin_ns/pkt", "speedup", "matched");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        acl_reset();
+        for (int i = 0; i < sizes[s]; ++i) {
+            acl_rule_t r;
+            random_rule(&r);
+            acl_add_rule(&r);
+        }
+        double b0 = now_ns();
+        if (acl_build() != 0) { fprintf(stderr, "build failed\n"); return 1; }
+        double build_ms = (now_ns() - b0) / 1e6;
+        for (int i = 0; i < npkts; ++i) random_packet(&pkts[i]);
+
+        int matched = 0;
+        volatile int sink = 0;
+        double t0 = now_ns();
+        for (int i = 0; i < npkts; ++i) { int r = acl_classify(&pkts[i]); sink += r; matched += r >= 0; }
+        double tss = (now_ns() - t0) / npkts;
+
+        int lin_pkts = npkts / (sizes[s] >= 10000 ? 20 : 1);
+        t0 = now_ns();
+        for (int i = 0; i < lin_pkts; ++i) sink += linear_classify(&pkts[i]);
+        double lin = (now_ns() - t0) / lin_pkts;
+
+        for (int i = 0; i < lin_pkts; ++i) {
+            if (acl_classify(&pkts[i]) != linear_classify(&pkts[i])) {
+                fprintf(stderr, "MISMATCH at %d rules, packet %d\n", sizes[s], i);
+                return 1;
+            }
+        }
+
+        printf("%8d %8d %10.2f %12.1f %12.1f %7.1fx %8.1f%%\n", sizes[s], acl_tuple_count(), build_ms, tss, lin,
+               lin / tss, 100.0 * matched / npkts);
+    }
+    acl_reset();
+    free(pkts);
+    return 0;
+}
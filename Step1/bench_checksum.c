@@ -0,0 +1,137 @@
+/*
+ * bench_checksum.c
+ * Throughput of the Internet checksum kernels across packet sizes.
+ *
+ * For each size, every kernel the CPU supports verifies a TCP segment under
+ * its IPv4 pseudo header in place, next to the previous approach (malloc a
+ * pseudo header + segment copy, zero the checksum field, scalar ntohs loop).
+ * All results are cross-checked against that reference first, including
+ * odd lengths and unaligned buffers. Each timing is the best of REPEATS runs.
+ *
+ * Build/run: make bench_checksum && ./bench_checksum [iterations_scale]
+ */
+
+#include "checksum.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+static const size_t sizes[] = { 20, 40, 64, 128, 576, 1500, 4096, 9000, 65535 };
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+#define TCP_CSUM_OFF 16
+#define REPEATS 3        /* best of, to shed scheduler noise */
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/* the former malformed.c path: copy, zero the field, scalar RFC 1071 */
+static uint16_t legacy_calc(const uint8_t *data, size_t len) {
+    uint32_t sum = 0;
+    const uint16_t *ptr = (const uint16_t *)data;
+    while (len > 1) { sum += ntohs(*ptr++); len -= 2; }
+    if (len == 1) sum += (uint32_t)*(const uint8_t *)ptr << 8;
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)(~sum & 0xffff);
+}
+
+static int legacy_ok(uint32_t saddr, uint32_t daddr, const uint8_t *seg, size_t len) {
+    uint8_t *buf = malloc(12 + len);
+    if (!buf) return 1;
+    memcpy(buf, &saddr, 4);
+    memcpy(buf + 4, &daddr, 4);
+    buf[8] = 0; buf[9] = 6;
+    uint16_t l = htons((uint16_t)len);
+    memcpy(buf + 10, &l, 2);
+    memcpy(buf + 12, seg, len);
+    buf[12 + TCP_CSUM_OFF] = buf[12 + TCP_CSUM_OFF + 1] = 0;
+    uint16_t cs = legacy_calc(buf, 12 + len);
+    uint16_t orig = (uint16_t)(seg[TCP_CSUM_OFF] << 8 | seg[TCP_CSUM_OFF + 1]);
+    free(buf);
+    return cs == orig;
+}
+
+/* random segment with a correct checksum at TCP_CSUM_OFF */
+static void make_segment(uint8_t *seg, size_t len, uint32_t saddr, uint32_t daddr) {
+    for (size_t i = 0; i < len; ++i) seg[i] = (uint8_t)rand();
+    seg[TCP_CSUM_OFF] = seg[TCP_CSUM_OFF + 1] = 0;
+    uint16_t cs = (uint16_t)~csum_fold(csum_partial(seg, len, csum_pseudo_v4(saddr, daddr, 6, (uint16_t)len)));
+    memcpy(seg + TCP_CSUM_OFF, &cs, 2);
+}
+
+static int self_check(void) {
+    static uint8_t buf[65536 + 64];
+    uint32_t saddr = inet_addr("10.1.2.3"), daddr = inet_addr("192.168.7.9");
+    int bad = 0;
+    for (size_t len = 20; len < 70000 && !bad; len = len < 300 ? len + 1 : len * 3 / 2) {
+        if (len > 65535) len = 65535;
+        for (size_t off = 0; off < 4; ++off) {
+            uint8_t *seg = buf + off;
+            make_segment(seg, len, saddr, daddr);
+            if (!legacy_ok(saddr, daddr, seg, len)) bad++;
+            for (int impl = CSUM_IMPL_SCALAR; impl <= CSUM_IMPL_AVX2; ++impl) {
+                if (!checksum_set_impl((csum_impl_t)impl)) continue;
+                if (!csum_ipv4_l4_ok(saddr, daddr, 6, seg, len)) bad++;
+                seg[len / 2] ^= 0x40;   /* single bit flip must fail */
+                if (csum_ipv4_l4_ok(saddr, daddr, 6, seg, len)) bad++;
+                seg[len / 2] ^= 0x40;
+            }
+        }
+        if (len == 65535) break;
+    }
+    return bad;
+}
+
+int main(int argc, char **argv) {
+    double scale = argc > 1 ? atof(argv[1]) : 1.0;
+    if (scale <= 0) scale = 1.0;
+    srand(1);
+    int bad = self_check();
+    printf("self-check: %s\n", bad ? "FAILED" : "all kernels agree with the reference");
+    if (bad) return 1;
+
+    checksum_init();
+    printf("runtime dispatch selects: %s\n\n", checksum_impl_name(checksum_get_impl()));
+    printf("%8s %14s", "bytes", "legacy ns");
+    for (int impl = CSUM_IMPL_SCALAR; impl <= CSUM_IMPL_AVX2; ++impl)
+        if (checksum_set_impl((csum_impl_t)impl)) printf(" %10s ns %8s", checksum_impl_name((csum_impl_t)impl), "GB/s");
+    printf("\n");
+
+    static uint8_t seg[65536];
+    uint32_t saddr = inet_addr("10.1.2.3"), daddr = inet_addr("192.168.7.9");
+    for (size_t s = 0; s < NSIZES; ++s) {
+        size_t len = sizes[s];
+        make_segment(seg, len, saddr, daddr);
+        long iters = (long)(scale * 2e8 / (double)(len + 64));
+        if (iters < 100) iters = 100;
+        volatile int sink = 0;
+
+        double legacy = 1e30;
+        for (int rep = 0; rep < REPEATS; ++rep) {
+            double t0 = now_ns();
+            for (long i = 0; i < iters / 4; ++i) sink += legacy_ok(saddr, daddr, seg, len);
+            double ns = (now_ns() - t0) / (double)(iters / 4);
+            if (ns < legacy) legacy = ns;
+        }
+        printf("%8zu %14.1f", len, legacy);
+
+        for (int impl = CSUM_IMPL_SCALAR; impl <= CSUM_IMPL_AVX2; ++impl) {
+            if (!checksum_set_impl((csum_impl_t)impl)) continue;
+            double best = 1e30;
+            for (int rep = 0; rep < REPEATS; ++rep) {
+                double t0 = now_ns();
+                for (long i = 0; i < iters; ++i) sink += csum_ipv4_l4_ok(saddr, daddr, 6, seg, len);
+                double ns = (now_ns() - t0) / (double)iters;
+                if (ns < best) best = ns;
+            }
+            printf(" %13.1f %8.2f", best, (double)len / best);
+        }
+        printf("\n");
+        (void)sink;
+    }
+    return 0;
+}
@@ -2,10 +2,10 @@
  *
  * Two Parallel Pipelines:
  *   Pipeline 1 (Independent): preprocess (runs for ALL packets)
- *   Pipeline 2 (Sequential):  denylist -> rate_limit -> malformed
+ *   Pipeline 2 (Sequential):  parse -> antispoof (+allowlist bypass) -> ban -> fragment tracking -> hop count -> acl -> denylist -> rate_limit -> malformed
  *
  * Compile:
- *   gcc -Wall -Wextra -std=gnu11 capture.c preprocess.c denylist.c rate_limit.c malformed.c -o capture -lpcap -lpthread
+ *   gcc -Wall -Wextra -std=gnu11 capture.c preprocess.c denylist.c rate_limit.c malformed.c malformed_log.c checksum.c ipset.c worker.c packet.c acl.c ban.c allowlist.c fragment.c tcpopt.c hopcount.c antispoof.c droplog.c dropcap.c -o capture -lpcap -lpthread -lm
  */
 
 #define _DEFAULT_SOURCE
@@ -18,25 +18,40 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <ifaddrs.h>
+#include <net/if.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <stdbool.h>
 
 #include "preprocess.h"
+#include "droplog.h"
+#include "dropcap.h"
+#include "packet.h"
+#include "antispoof.h"
+#include "allowlist.h"
+#include "fragment.h"
+#include "hopcount.h"
+#include "acl.h"
+#include "ban.h"
 #include "denylist.h"
 #include "rate_limit.h"
 #include "malformed.h"
 
-/* forward declaration for the logging helper implemented separately */
-void malformed_log_packet(const struct pcap_pkthdr *h, const u_char *bytes);
-
 typedef struct {
     pcap_t *handle;
     char *devname;
+    int dc_if;
 } dev_thread_arg_t;
 
+/* pcap_loop user data */
+typedef struct {
+    int ifindex;   /* arrival interface, 0 if unknown */
+    int dc_if;     /* dropcap interface id, -1 if capture is off */
+} cap_ctx_t;
+
 static pcap_t **global_handles = NULL;
 static char  **global_names   = NULL;
+static int    *global_dc_ifs  = NULL;
 static size_t global_handle_count = 0;
 static pthread_t *threads = NULL;
 static volatile sig_atomic_t stop_requested = 0;
@@ -133,21 +148,25 @@ static char *build_dst_filter(char **addrs, size_t n) {
     return f;
 }
 
-/* callback: Two parallel pipelines
+/* per-packet work: Two parallel pipelines
  *
  * Pipeline 1 (INDEPENDENT - Always runs):
  *   - process_packet() - Collects stats for ALL packets
  *
  * Pipeline 2 (SEQUENTIAL - Filtering chain):
+ *   - packet_parse() - Parse the 5-tuple once for the stages below
+ *   - antispoof_check() - Bogon/martian sources, reverse-path check against the FIB
+ *   - allowlist_bypass() - Trusted sources skip the rest of the chain
+ *   - ban_check() - Sources temporarily banned by the rate limiter; drop silently
+ *   - frag_track() - Give later fragments their datagram's ports, flag fragment attacks
+ *   - hopcount_check() - TTL vs the source /24's learned hop count (spoofing signal)
+ *   - acl_check() - Rules.txt 5-tuple rules; if denied, drop and return
  *   - check_denylist() - If fails, drop and return
  *   - rate_limit_check() - If fails, drop and return
  *   - is_malformed() - If fails, drop and return
  *   - If passes all filters, packet is accepted
  */
-static void pcap_callback(u_char *user, const struct pcap_pkthdr *h, const u_char *bytes) {
-    (void)user;
-    if (!h || !bytes) return;
-
+static void filter_packet(const struct pcap_pkthdr *h, const u_char *bytes, int ifindex) {
     /* PIPELINE 1: Preprocess (ALWAYS RUNS - Independent of filtering) */
     process_packet(h, bytes);
 
@@ -160,27 +179,72 @@ static void pcap_callback(u_char *user, const struct pcap_pkthdr *h, const u_cha
         return;
     }
 
-    /* PIPELINE 2: Filtering Chain (denylist → rate_limit → malformed) */
-    
+    /* PIPELINE 2: Filtering Chain (antispoof → allowlist → ban → frag → hopcount → acl → denylist → rate_limit → malformed) */
+    pkt_meta_t meta;
+    packet_parse(h, bytes, &meta);
+
+    /* Forged sources first: a spoofer may well forge a trusted address */
+    if (!antispoof_check(h, &meta, ifindex)) {
+        /* Dropped as bogon / uRPF failure - console message already printed */
+        return;
+    }
+
+    /* Trusted sources (Allow.txt): already counted by preprocess, skip the chain */
+    if (allowlist_bypass(h, &meta)) {
+        return;
+    }
+
+    /* Sources currently banned for flooding, before the costlier stages */
+    if (!ban_check(h, &meta)) {
+        /* Dropped by ban table - counted, not printed */
+        return;
+    }
+
+    /* Fragments: attribute to the first fragment's ports (acted on by malformed) */
+    frag_track(h, &meta);
+
+    /* Spoofed sources: TTL inconsistent with the /24's usual hop count */
+    if (!hopcount_check(h, &meta)) {
+        /* Dropped (drop mode only) - console message already printed */
+        return;
+    }
+
+    /* Filter 0: 5-tuple ACL rules */
+    if (!acl_check(h, &meta)) {
+        /* Dropped by ACL - console message already printed */
+        return;
+    }
+
     /* Filter 1: Denylist check */
-    if (!check_denylist(h, bytes)) {
+    if (!check_denylist(h, &meta)) {
         /* Dropped by denylist - console message already printed */
         return;
     }
 
     /* Filter 2: Rate limit check */
-    if (!rate_limit_check(h, bytes)) {
+    if (!rate_limit_check(h, bytes, &meta)) {
         /* Dropped by rate limiter - console message already printed */
         return;
     }
 
     /* Filter 3: Malformed check */
-    if (is_malformed(h, bytes)) {
+    if (is_malformed(h, bytes, &meta)) {
         /* Dropped by malformed check - console message already printed */
+        malformed_log_packet(h, bytes);
         return;
     }
 
     /* Packet ACCEPTED - passed all filters */
+    hopcount_syn_accepted(h, &meta);
+}
+
+/* callback: the stages' drop/flag notes go to the pcapng capture (-P) */
+static void pcap_callback(u_char *user, const struct pcap_pkthdr *h, const u_char *bytes) {
+    const cap_ctx_t *ctx = (const cap_ctx_t *)user;
+    if (!h || !bytes) return;
+    dropcap_set_packet(h, bytes, ctx->dc_if);
+    filter_packet(h, bytes, ctx->ifindex);
+    dropcap_set_packet(NULL, NULL, -1);   /* queues the packet if it was noted */
 }
 
 /* per-handle thread */
@@ -188,7 +252,11 @@ static void *device_thread(void *arg) {
     dev_thread_arg_t *darg = (dev_thread_arg_t *)arg;
     pcap_t *handle = darg->handle;
     const char *name = darg->devname ? darg->devname : "unknown";
-    int rc = pcap_loop(handle, 0, pcap_callback, NULL);
+    cap_ctx_t ctx = {
+        .ifindex = darg->devname ? (int)if_nametoindex(darg->devname) : 0,
+        .dc_if = darg->dc_if,
+    };
+    int rc = pcap_loop(handle, 0, pcap_callback, (u_char *)&ctx);
     if (rc == -1) {
         fprintf(stderr, "[%s] pcap_loop error: %s\n", name, pcap_geterr(handle));
     }
@@ -201,32 +269,114 @@ int main(int argc, char **argv) {
     char errbuf[PCAP_ERRBUF_SIZE];
     int opt;
     char *single_dev = NULL;
-    double dummy_r = -1.0, dummy_b = -1.0; 
-    (void)dummy_r;
-    (void)dummy_b;/* left in case you want rate-limit flags later */
-
-    while ((opt = getopt(argc, argv, "i:n:r:b:h")) != -1) {
+    double rl_rate = -1.0, rl_burst = -1.0;   /* SYN per source; <= 0 keeps RateLimits.txt / default */
+    bool rl_adaptive = true;
+    int ban_ttl = 0;
+    rl_algo_t rl_algo = RL_ALGO_TOKEN_BUCKET;
+    rl_clock_t rl_clock = RL_CLOCK_PACKET;
+    rl_backend_t rl_backend = RL_BACKEND_TABLE;
+    const char *rl_state = NULL;            /* warm-restart state file (-s), off by default */
+    uint32_t mf_drop_mask = MF_DEFAULT_DROP;
+    int hcf_mode = HCF_MODE_PENALIZE;
+    uint32_t as_drop_classes = 1u << AS_CLASS_MARTIAN | 1u << AS_CLASS_RESERVED;
+    int rpf_mode = RPF_LOOSE;
+    int dl_interval = 10, dl_first_n = 5;   /* drop-line aggregation */
+    const char *dc_prefix = NULL;           /* pcapng capture of drops, off by default */
+    int dc_files = 0, dc_file_mb = 0;
+
+    while ((opt = getopt(argc, argv, "i:n:r:b:t:L:C:SAs:M:H:B:R:D:P:h")) != -1) {
         switch (opt) {
             case 'i': single_dev = optarg; break;
             case 'n': PACKET_LIMIT = atoi(optarg); if (PACKET_LIMIT <= 0) PACKET_LIMIT = 1; break;
-            case 'r': dummy_r = atof(optarg); break;
-            case 'b': dummy_b = atof(optarg); break;
+            case 'r': rl_rate = atof(optarg); break;
+            case 'b': rl_burst = atof(optarg); break;
+            case 'A': rl_adaptive = false; break;
+            case 't': ban_ttl = atoi(optarg); break;
+            case 'L': rl_algo = strcmp(optarg, "gcra") == 0 ? RL_ALGO_GCRA : RL_ALGO_TOKEN_BUCKET; break;
+            case 'C': rl_clock = strcmp(optarg, "mono") == 0 ? RL_CLOCK_MONOTONIC : RL_CLOCK_PACKET; break;
+            case 'S': rl_backend = RL_BACKEND_SKETCH; break;
+            case 'M':
+                if (malformed_parse_reasons(optarg, &mf_drop_mask) != 0) {
+                    fprintf(stderr, "Unknown malformed reason in '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'H':
+                if ((hcf_mode = hopcount_parse_mode(optarg)) < 0) {
+                    fprintf(stderr, "Unknown hop-count mode '%s' (off|flag|penalize|drop)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'B':
+                if (antispoof_parse_classes(optarg, &as_drop_classes) != 0) {
+                    fprintf(stderr, "Unknown bogon class in '%s' (martian,reserved,private|all|none)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'R':
+                if ((rpf_mode = antispoof_parse_rpf(optarg)) < 0) {
+                    fprintf(stderr, "Unknown uRPF mode '%s' (off|loose|strict)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'D':
+                if (droplog_parse_aggregation(optarg, &dl_interval, &dl_first_n) != 0) {
+                    fprintf(stderr, "Bad drop-log aggregation '%s' (seconds[:first_n]|off)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'P':
+                if (dropcap_parse_output(optarg, &dc_prefix, &dc_files, &dc_file_mb) != 0) {
+                    fprintf(stderr, "Bad drop capture '%s' (prefix[:files[:MiB]])\n", optarg);
+                    return 1;
+                }
+                break;
+            case 's': rl_state = strcmp(optarg, "off") == 0 ? NULL : optarg; break;
             case 'h':
             default:
-                fprintf(stderr, "Usage: %s [-i interface] [-n packet_limit]\n", argv[0]);
+                fprintf(stderr, "Usage: %s [-i interface] [-n packet_limit] [-r syn_rate] [-b syn_burst] [-A] [-t ban_ttl_sec] [-L tb|gcra] [-C packet|mono] [-S] [-s state_file] [-M malformed_reasons] [-H off|flag|penalize|drop] [-B bogon_classes] [-R off|loose|strict] [-D seconds[:first_n]|off] [-P prefix[:files[:MiB]]]\n", argv[0]);
                 return 1;
         }
     }
 
     /* init modules */
+    droplog_set_aggregation(dl_interval, dl_first_n);
+    droplog_init();
+    dropcap_set_output(dc_prefix, dc_files, dc_file_mb);
+    dropcap_init();
+    antispoof_set_drop_classes(as_drop_classes);
+    antispoof_set_rpf((rpf_mode_t)rpf_mode);
+    antispoof_init();
+    allowlist_init();
+    ban_init();
+    ban_set_params(0, 0, ban_ttl);
+    acl_init();
     denylist_init();
+    rate_limit_set_algo(rl_algo);
+    rate_limit_set_clock(rl_clock);
+    rate_limit_set_backend(rl_backend);
+    rate_limit_set_state_file(rl_state);
     rate_limit_init();
+    rate_limit_set_params(rl_rate, rl_burst);
+    if (!rl_adaptive) rate_limit_set_adaptive(false, -1, -1, -1);   /* after RateLimits.txt */
     malformed_init();
+    malformed_log_init();
+    frag_init();
+    hopcount_init();
+    hopcount_set_mode((hcf_mode_t)hcf_mode);
+    malformed_set_drop_mask(mf_drop_mask);
 
     /* collect local IPv4 addresses */
     size_t addr_count = 0;
     char **local_addrs = collect_local_ipv4(&addr_count);
     char *filter_expr = build_dst_filter(local_addrs, addr_count);
+    uint32_t local_ips[64];
+    size_t local_n = 0;
+    for (size_t i = 0; i < addr_count && local_n < 64; ++i) {
+        struct in_addr a;
+        if (inet_pton(AF_INET, local_addrs[i], &a) == 1) local_ips[local_n++] = ntohl(a.s_addr);
+    }
+    packet_set_local_addrs(local_ips, local_n);
     if (filter_expr) printf("Applying BPF filter: %s\n", filter_expr);
     else printf("No local IPv4 found — capturing all packets on IP-capable interfaces.\n");
 
@@ -255,8 +405,9 @@ int main(int argc, char **argv) {
 
     global_handles = calloc(possible, sizeof(pcap_t *));
     global_names   = calloc(possible, sizeof(char *));
+    global_dc_ifs  = calloc(possible, sizeof(int));
     threads        = calloc(possible, sizeof(pthread_t));
-    if (!global_handles || !global_names || !threads) {
+    if (!global_handles || !global_names || !global_dc_ifs || !threads) {
         fprintf(stderr, "Out of memory\n");
         goto cleanup_devs;
     }
@@ -303,6 +454,7 @@ int main(int argc, char **argv) {
         global_handles[idx] = handle;
         global_names[idx] = strdup(d->name ? d->name : "unknown");
         if (!global_names[idx]) global_names[idx] = strdup("unknown");
+        global_dc_ifs[idx] = dropcap_add_interface(d->name, dlt, 65536);
         ++idx;
     }
     global_handle_count = idx;
@@ -327,6 +479,7 @@ int main(int argc, char **argv) {
         dev_thread_arg_t *darg = calloc(1, sizeof(dev_thread_arg_t));
         if (!darg) continue;
         darg->handle = global_handles[i];
+        darg->dc_if = global_dc_ifs[i];
         darg->devname = strdup(global_names[i]);
         if (!darg->devname) darg->devname = strdup("unknown");
         if (pthread_create(&threads[started], NULL, device_thread, darg) != 0) {
@@ -339,15 +492,28 @@ int main(int argc, char **argv) {
     }
 
     for (size_t i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+    droplog_shutdown();   /* every drop line out before the statistics */
+    malformed_log_shutdown();
+    dropcap_shutdown();
 
     printf("\n═══════════════════════════════════════════════════════════════\n");
     printf("Finished capture. Processed packets: %d\n", captured_count);
     printf("═══════════════════════════════════════════════════════════════\n");
     
     /* Print all filter statistics */
+    antispoof_report();
+    allowlist_report();
+    ban_report();
+    acl_report();
     denylist_report();
     rate_limit_report();
+    rate_limit_save_state();
+    frag_report();
+    hopcount_report();
     malformed_report();
+    malformed_log_report();
+    droplog_report();
+    dropcap_report();
     
     /* Print preprocessing summary and CSV */
     report_and_reset();
@@ -359,6 +525,7 @@ cleanup_handles:
     for (size_t i = 0; i < global_handle_count; ++i) free(global_names[i]);
     free(global_handles);
     free(global_names);
+    free(global_dc_ifs);
     free(threads);
 
 cleanup_devs:
@@ -370,6 +537,10 @@ cleanup_addrs:
         free(local_addrs);
     }
     if (filter_expr) free(filter_expr);
+    antispoof_shutdown();
+    droplog_shutdown();
+    malformed_log_shutdown();
+    dropcap_shutdown();
 
     return 0;
 }
@@ -0,0 +1,133 @@
+/*
+ * checksum.c
+ * Internet checksum kernels and runtime dispatch (see checksum.h).
+ *
+ * All kernels add native-order 16-bit words; they differ only in width:
+ *   scalar  8 bytes per step into a 64-bit accumulator (32-bit halves)
+ *   SSE2    32 bytes per step, words widened to 2 x 4 x 32-bit lanes
+ *   AVX2    64 bytes per step, words widened to 2 x 8 x 32-bit lanes
+ * A 32-bit lane gains at most 2 * 0xffff per step, so the vector kernels
+ * spill their lanes into the 64-bit sum every CSUM_SPILL_STEPS steps (and
+ * at the end), which keeps them exact for any length. The SIMD kernels are
+ * compiled with target attributes, so the build needs no -m flags and the
+ * binary still runs on CPUs without AVX2.
+ */
+
+#include "checksum.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSUM_X86 1
+#endif
+
+#define CSUM_SPILL_STEPS 16384   /* 2 * 0xffff * 16384 < 2^32 */
+#define CSUM_SIMD_MIN    64      /* shorter buffers (IP headers) stay scalar */
+
+static uint64_t csum_scalar(const uint8_t *p, size_t len, uint64_t sum) {
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        sum += (v & 0xffffffffu) + (v >> 32);
+        p += 8; len -= 8;
+    }
+    if (len >= 4) { uint32_t v; memcpy(&v, p, 4); sum += v; p += 4; len -= 4; }
+    if (len >= 2) { uint16_t v; memcpy(&v, p, 2); sum += v; p += 2; len -= 2; }
+    if (len) { uint16_t v = 0; memcpy(&v, p, 1); sum += v; }
+    return sum;
+}
+
+#ifdef CSUM_X86
+__attribute__((target("sse2")))
+static uint64_t csum_sse2(const uint8_t *p, size_t len, uint64_t sum) {
+    const __m128i zero = _mm_setzero_si128();
+    while (len >= 32) {
+        size_t steps = len / 32;
+        if (steps > CSUM_SPILL_STEPS) steps = CSUM_SPILL_STEPS;
+        __m128i a0 = zero, a1 = zero;   /* two chains hide the add latency */
+        for (size_t i = 0; i < steps; ++i, p += 32) {
+            __m128i v0 = _mm_loadu_si128((const __m128i *)p);
+            __m128i v1 = _mm_loadu_si128((const __m128i *)(p + 16));
+            a0 = _mm_add_epi32(a0, _mm_add_epi32(_mm_unpacklo_epi16(v0, zero), _mm_unpackhi_epi16(v0, zero)));
+            a1 = _mm_add_epi32(a1, _mm_add_epi32(_mm_unpacklo_epi16(v1, zero), _mm_unpackhi_epi16(v1, zero)));
+        }
+        len -= steps * 32;
+        uint32_t lane[8];
+        _mm_storeu_si128((__m128i *)lane, a0);
+        _mm_storeu_si128((__m128i *)(lane + 4), a1);
+        for (int i = 0; i < 8; ++i) sum += lane[i];
+    }
+    return csum_scalar(p, len, sum);
+}
+
+__attribute__((target("avx2")))
+static uint64_t csum_avx2(const uint8_t *p, size_t len, uint64_t sum) {
+    const __m256i zero = _mm256_setzero_si256();
+    while (len >= 64) {
+        size_t steps = len / 64;
+        if (steps > CSUM_SPILL_STEPS) steps = CSUM_SPILL_STEPS;
+        __m256i a0 = zero, a1 = zero;
+        for (size_t i = 0; i < steps; ++i, p += 64) {
+            __m256i v0 = _mm256_loadu_si256((const __m256i *)p);
+            __m256i v1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+            a0 = _mm256_add_epi32(a0, _mm256_add_epi32(_mm256_unpacklo_epi16(v0, zero), _mm256_unpackhi_epi16(v0, zero)));
+            a1 = _mm256_add_epi32(a1, _mm256_add_epi32(_mm256_unpacklo_epi16(v1, zero), _mm256_unpackhi_epi16(v1, zero)));
+        }
+        len -= steps * 64;
+        uint32_t lane[16];
+        _mm256_storeu_si256((__m256i *)lane, a0);
+        _mm256_storeu_si256((__m256i *)(lane + 8), a1);
+        for (int i = 0; i < 16; ++i) sum += lane[i];
+    }
+    return csum_sse2(p, len, sum);
+}
+#endif
+
+typedef uint64_t (*csum_kernel_t)(const uint8_t *, size_t, uint64_t);
+
+static csum_kernel_t kernel = csum_scalar;
+static csum_impl_t kernel_impl = CSUM_IMPL_SCALAR;
+
+static bool cpu_has(csum_impl_t impl) {
+#ifdef CSUM_X86
+    __builtin_cpu_init();
+    if (impl == CSUM_IMPL_AVX2) return __builtin_cpu_supports("avx2");
+    if (impl == CSUM_IMPL_SSE2) return __builtin_cpu_supports("sse2");
+#endif
+    return impl == CSUM_IMPL_SCALAR;
+}
+
+bool checksum_set_impl(csum_impl_t impl) {
+    if (!cpu_has(impl)) return false;
+    switch (impl) {
+#ifdef CSUM_X86
+        case CSUM_IMPL_AVX2: kernel = csum_avx2; break;
+        case CSUM_IMPL_SSE2: kernel = csum_sse2; break;
+#endif
+        default: kernel = csum_scalar; break;
+    }
+    kernel_impl = impl;
+    return true;
+}
+
+void checksum_init(void) {
+    if (!checksum_set_impl(CSUM_IMPL_AVX2) && !checksum_set_impl(CSUM_IMPL_SSE2))
+        checksum_set_impl(CSUM_IMPL_SCALAR);
+}
+
+csum_impl_t checksum_get_impl(void) {
+    return kernel_impl;
+}
+
+const char *checksum_impl_name(csum_impl_t impl) {
+    switch (impl) {
+        case CSUM_IMPL_AVX2: return "avx2";
+        case CSUM_IMPL_SSE2: return "sse2";
+        default: return "scalar";
+    }
+}
+
+uint64_t csum_partial(const void *buf, size_t len, uint64_t sum) {
+    if (len < CSUM_SIMD_MIN) return csum_scalar(buf, len, sum);
+    return kernel(buf, len, sum);
+}
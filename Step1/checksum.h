@@ -0,0 +1,67 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+/*
+ * checksum.h
+ * RFC 1071 Internet checksum computed in place: no copies, no allocation.
+ *
+ * Sums are one's-complement running sums of the data read as native-order
+ * 16-bit words, kept unfolded in 64 bits so buffers can be chained (pseudo
+ * header + segment) and folded once. The one's-complement sum is byte-order
+ * independent, so a received header or segment is valid exactly when the
+ * folded sum over it, checksum field included, is 0xffff - the field never
+ * has to be zeroed or skipped.
+ *
+ * The bulk kernel (scalar, SSE2 or AVX2) is picked at checksum_init from
+ * the CPU's features; before that the scalar kernel is used.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    CSUM_IMPL_SCALAR = 0,
+    CSUM_IMPL_SSE2   = 1,
+    CSUM_IMPL_AVX2   = 2
+} csum_impl_t;
+
+/* Select the fastest kernel this CPU supports */
+void checksum_init(void);
+
+/* Force a kernel (benchmarks); false if the CPU lacks it */
+bool checksum_set_impl(csum_impl_t impl);
+csum_impl_t checksum_get_impl(void);
+const char *checksum_impl_name(csum_impl_t impl);
+
+/* sum += 16-bit words of buf[0..len) (an odd tail byte is zero-padded) */
+uint64_t csum_partial(const void *buf, size_t len, uint64_t sum);
+
+/* IPv4 pseudo header (addresses as they sit in the packet) */
+static inline uint64_t csum_pseudo_v4(uint32_t saddr_net, uint32_t daddr_net, uint8_t proto, uint16_t len) {
+    union { uint8_t b[4]; uint32_t w; } tail = { { 0, proto, (uint8_t)(len >> 8), (uint8_t)len } };
+    return (uint64_t)saddr_net + daddr_net + tail.w;
+}
+
+/* fold to 16 bits (not complemented) */
+static inline uint16_t csum_fold(uint64_t s) {
+    s = (s & 0xffffffffu) + (s >> 32);
+    s = (s & 0xffffffffu) + (s >> 32);
+    s = (s & 0xffffu) + (s >> 16);
+    s = (s & 0xffffu) + (s >> 16);
+    s = (s & 0xffffu) + (s >> 16);
+    return (uint16_t)s;
+}
+
+/* IPv4 header of ihl bytes (checksum field included) verifies */
+static inline bool csum_ipv4_header_ok(const void *iph, size_t ihl) {
+    return csum_fold(csum_partial(iph, ihl, 0)) == 0xffff;
+}
+
+/* TCP/UDP segment of len bytes under the IPv4 pseudo header verifies */
+static inline bool csum_ipv4_l4_ok(uint32_t saddr_net, uint32_t daddr_net, uint8_t proto,
+                                   const void *l4, size_t len) {
+    return csum_fold(csum_partial(l4, len, csum_pseudo_v4(saddr_net, daddr_net, proto, (uint16_t)len))) == 0xffff;
+}
+
+#endif /* CHECKSUM_H */
@@ -1,200 +1,219 @@
 /*
  * denylist.c
  * Loads dangerous IPs & ports from IP.txt / Ports.txt and logs denied packets to stdout.
+ * If denylist.bin (built by denylist_compile) is present it is mmap'd instead of parsing text.
  */
 
 #include "denylist.h"
+#include "ipset.h"
+#include "worker.h"
+#include "droplog.h"
 #include <stdio.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <netinet/ip.h>
-#include <netinet/tcp.h>
-#include <netinet/udp.h>
-#include <net/ethernet.h>
 #include <stdlib.h>
 #include <time.h>
-#include <ctype.h>
-
-#define MAX_DENY_IPS   1024
-#define MAX_DENY_PORTS 1024
-
-static char deny_ips[MAX_DENY_IPS][INET_ADDRSTRLEN];
-static int deny_ip_count = 0;
-static uint16_t deny_ports[MAX_DENY_PORTS];
-static int deny_port_count = 0;
-
-/* Drop counters */
-static int deny_ip_drops = 0;
-static int deny_port_drops = 0;
-
-/* Helper: trim newline and spaces (in-place) */
-static void trim(char *s) {
-    char *p = s;
-    while (*p && isspace((unsigned char)*p)) p++;
-    if (p != s) memmove(s, p, strlen(p) + 1);
-    char *end = s + strlen(s) - 1;
-    while (end >= s && isspace((unsigned char)*end)) { *end = '\0'; --end; }
-}
+#include <sys/stat.h>
+#include <inttypes.h>
 
-/* Load IP list from IP.txt */
-static void load_deny_ips(void) {
-    FILE *f = fopen("IP.txt", "r");
-    if (!f) {
-        printf("[Denylist] Warning: IP.txt not found. No IPs loaded.\n");
-        return;
-    }
-    char line[128];
-    while (fgets(line, sizeof(line), f)) {
-        trim(line);
-        if (strlen(line) == 0) continue;
-        if (deny_ip_count < MAX_DENY_IPS) {
-            strncpy(deny_ips[deny_ip_count], line, INET_ADDRSTRLEN);
-            deny_ips[deny_ip_count][INET_ADDRSTRLEN - 1] = '\0';
-            deny_ip_count++;
-        }
-    }
-    fclose(f);
-    printf("[Denylist] Loaded %d blocked IP(s)\n", deny_ip_count);
-}
+#define DENYLIST_IMAGE "denylist.bin"
+#define DENYLIST_TOP_N 10        /* rows per top-offenders table */
+#define DENYLIST_UNUSED_LIST 20  /* never-matched entries printed by name */
 
-/* Load port list from Ports.txt */
-static void load_deny_ports(void) {
-    FILE *f = fopen("Ports.txt", "r");
-    if (!f) {
-        printf("[Denylist] Warning: Ports.txt not found. No ports loaded.\n");
-        return;
-    }
-    char line[64];
-    while (fgets(line, sizeof(line), f)) {
-        trim(line);
-        if (strlen(line) == 0) continue;
-        int port = atoi(line);
-        if (port > 0 && port <= 65535 && deny_port_count < MAX_DENY_PORTS) {
-            deny_ports[deny_port_count++] = (uint16_t)port;
-        }
-    }
-    fclose(f);
-    printf("[Denylist] Loaded %d blocked port(s)\n", deny_port_count);
-}
+/* IPs/CIDRs and ports, either heap-built from text or mapped from DENYLIST_IMAGE */
+static ipset_t deny_set;
 
-/* small hex prefix (first n bytes) as space-separated hex in buffer */
-static void hex_prefix_to_str(const u_char *data, size_t len, size_t prefix, char *out, size_t outlen) {
-    size_t up = (len < prefix) ? len : prefix;
-    size_t p = 0;
-    for (size_t i = 0; i < up && p + 3 < outlen; ++i) {
-        int w = snprintf(out + p, outlen - p, "%02x", data[i]);
-        p += (w > 0) ? w : 0;
-        if (i + 1 < up && p + 2 < outlen) {
-            out[p++] = ' ';
-        }
-    }
-    out[p] = '\0';
+/* Per-thread drop totals, one cache line per capture thread */
+typedef struct {
+    uint64_t ip_drops;
+    uint64_t port_drops;
+} __attribute__((aligned(CACHE_LINE))) deny_stats_t;
+
+static deny_stats_t deny_stats[MAX_WORKERS];
+
+/* Per-thread, per-entry hit counts (index = ipset entry index) */
+static worker_counters_t ip_hits, port_hits;
+
+static void reset_stats(void) {
+    memset(deny_stats, 0, sizeof(deny_stats));
+    worker_counters_free(&ip_hits);
+    worker_counters_free(&port_hits);
+    worker_counters_init(&ip_hits, deny_set.net_count);
+    worker_counters_init(&port_hits, deny_set.port_count);
 }
 
-/* timestamp formatting like 2025-11-08T21:12:34.123456 */
-static void timestamp_to_str(const struct pcap_pkthdr *h, char *out, size_t outlen) {
-    struct tm tm;
-    time_t tsec = h->ts.tv_sec;
-    localtime_r(&tsec, &tm);
-    char base[64];
-    strftime(base, sizeof(base), "%Y-%m-%dT%H:%M:%S", &tm);
-    snprintf(out, outlen, "%s.%06ld", base, (long)h->ts.tv_usec);
+/* Warn when the text lists were edited after the image was compiled */
+static void warn_if_stale(const char *image) {
+    struct stat img, txt;
+    if (stat(image, &img) != 0) return;
+    if ((stat("IP.txt", &txt) == 0 && txt.st_mtime > img.st_mtime) ||
+        (stat("Ports.txt", &txt) == 0 && txt.st_mtime > img.st_mtime)) {
+        printf("[Denylist] Warning: IP.txt/Ports.txt newer than %s, rerun ./denylist_compile\n", image);
+    }
 }
 
-/* Determine if IP matches denylist */
-static int is_denied_ip(const char *ip) {
-    for (int i = 0; i < deny_ip_count; ++i)
-        if (strcmp(ip, deny_ips[i]) == 0)
-            return 1;
-    return 0;
+/* Map the precompiled image; no per-entry work */
+static bool load_deny_image(void) {
+    struct stat st;
+    if (stat(DENYLIST_IMAGE, &st) != 0) return false;
+    char err[128];
+    if (ipset_image_map(&deny_set, DENYLIST_IMAGE, err, sizeof(err)) != 0) {
+        printf("[Denylist] Warning: ignoring %s (%s), falling back to text lists\n", DENYLIST_IMAGE, err);
+        return false;
+    }
+    printf("[Denylist] Mapped %s: %u blocked IP/prefix(es), %u blocked port(s)\n",
+           DENYLIST_IMAGE, deny_set.net_count, deny_set.port_count);
+    warn_if_stale(DENYLIST_IMAGE);
+    return true;
 }
 
-/* Determine if port matches denylist */
-static int is_denied_port(uint16_t port) {
-    for (int i = 0; i < deny_port_count; ++i)
-        if (port == deny_ports[i])
-            return 1;
-    return 0;
+/* Parse IP.txt / Ports.txt */
+static void load_deny_text(void) {
+    ipset_builder_t *b = ipset_builder_new();
+    if (!b) {
+        printf("[Denylist] Warning: out of memory, no denylist loaded\n");
+        return;
+    }
+    int nips = ipset_builder_add_ip_file(b, "IP.txt");
+    if (nips < 0) printf("[Denylist] Warning: IP.txt not found. No IPs loaded.\n");
+    else printf("[Denylist] Loaded %d blocked IP(s)\n", nips);
+    int nports = ipset_builder_add_port_file(b, "Ports.txt");
+    if (nports < 0) printf("[Denylist] Warning: Ports.txt not found. No ports loaded.\n");
+    else printf("[Denylist] Loaded %d blocked port(s)\n", nports);
+    if (ipset_builder_finish(b, &deny_set) != 0)
+        printf("[Denylist] Warning: out of memory, no denylist loaded\n");
 }
 
-/* Public init: load lists */
+/* Public init: prefer the compiled image, else parse the text lists */
 void denylist_init(void) {
-    deny_ip_count = deny_port_count = 0;
-    load_deny_ips();
-    load_deny_ports();
+    ipset_free(&deny_set);
+    if (!load_deny_image()) load_deny_text();
+    reset_stats();
 }
 
-/* print drop info to terminal */
-static void print_deny(const struct pcap_pkthdr *header, const char *src_ip, const char *dst_ip,
-                       uint16_t src_port, uint16_t dst_port, const char *proto_str, const char *reason,
-                       const u_char *payload, size_t payload_len) {
-    char tsbuf[64];
-    timestamp_to_str(header, tsbuf, sizeof(tsbuf));
-    char hexbuf[256];
-    hex_prefix_to_str(payload, payload_len, 24, hexbuf, sizeof(hexbuf));
-
-    printf("🚫 [DENYLIST DROP] %s | %s:%u → %s:%u | proto=%s | reason=%s | payload=%s\n",
-           tsbuf, src_ip, (unsigned)src_port, dst_ip, (unsigned)dst_port,
-           proto_str, reason, hexbuf);
+/* drop line detail, formatted by the droplog writer */
+static int fmt_deny(const droplog_event_t *e, char *out, size_t len) {
+    const char *proto = (e->proto == IPPROTO_TCP) ? "TCP" : (e->proto == IPPROTO_UDP) ? "UDP" : "IP";
+    return snprintf(out, len, "proto=%s | reason=%s", proto, e->reason);
 }
 
-/* check_denylist: returns true to allow, false to drop (and print) */
-bool check_denylist(const struct pcap_pkthdr *header, const u_char *packet) {
-    if (header->caplen < sizeof(struct ether_header))
-        return true;
+static void log_deny(const struct pcap_pkthdr *header, const pkt_meta_t *m, const char *reason) {
+    droplog_event_t *e = droplog_begin(DL_STAGE_DENYLIST, header, m, reason, fmt_deny);
+    if (!e) return;
+    if (m->l4) droplog_payload(e, m->l4, m->l4_len);
+    droplog_commit(e);
+}
 
-    const struct ether_header *eth = (const struct ether_header *)packet;
-    if (ntohs(eth->ether_type) != ETHERTYPE_IP)
+/* check_denylist: returns true to allow, false to drop (and print).
+ * Ports come from m, so non-first fragments attributed by frag_track are
+ * matched on their datagram's ports. */
+bool check_denylist(const struct pcap_pkthdr *header, const pkt_meta_t *m) {
+    if (!m->is_ipv4)
         return true; // only IPv4 checks here
 
-    const struct ip *ip_hdr = (const struct ip *)(packet + sizeof(struct ether_header));
-    char src_ip[INET_ADDRSTRLEN], dst_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &ip_hdr->ip_src, src_ip, sizeof(src_ip));
-    inet_ntop(AF_INET, &ip_hdr->ip_dst, dst_ip, sizeof(dst_ip));
-
-    uint16_t dst_port = 0, src_port = 0;
-    uint8_t proto = ip_hdr->ip_p;
-    size_t ip_hdr_bytes = (size_t)ip_hdr->ip_hl * 4;
-    const u_char *l4 = packet + sizeof(struct ether_header) + ip_hdr_bytes;
-    size_t l4_len = (header->caplen > (sizeof(struct ether_header) + ip_hdr_bytes)) ?
-                    (header->caplen - (sizeof(struct ether_header) + ip_hdr_bytes)) : 0;
-
-    if (proto == IPPROTO_TCP && l4_len >= sizeof(struct tcphdr)) {
-        const struct tcphdr *tcp = (const struct tcphdr *)l4;
-        dst_port = ntohs(tcp->th_dport);
-        src_port = ntohs(tcp->th_sport);
-    } else if (proto == IPPROTO_UDP && l4_len >= sizeof(struct udphdr)) {
-        const struct udphdr *udp = (const struct udphdr *)l4;
-        dst_port = ntohs(udp->uh_dport);
-        src_port = ntohs(udp->uh_sport);
-    }
+    uint16_t dst_port = m->dst_port;
 
     /* IP-based deny */
-    if (is_denied_ip(src_ip) || is_denied_ip(dst_ip)) {
-        deny_ip_drops++;
-        print_deny(header, src_ip, dst_ip, src_port, dst_port,
-                   (proto == IPPROTO_TCP) ? "TCP" : (proto == IPPROTO_UDP) ? "UDP" : "IP",
-                   "deny_ip", l4, l4_len);
+    int hit = ipset_match_ip(&deny_set, m->src_ip);
+    if (hit < 0) hit = ipset_match_ip(&deny_set, m->dst_ip);
+    if (hit >= 0) {
+        uint64_t *row = worker_counters_row(&ip_hits);
+        WORKER_COUNTER_ADD(&deny_stats[worker_id()].ip_drops, 1);
+        if (row) WORKER_COUNTER_ADD(&row[hit], 1);
+        log_deny(header, m, "deny_ip");
         return false;
     }
 
     /* Port-based deny */
-    if (dst_port != 0 && is_denied_port(dst_port)) {
-        deny_port_drops++;
-        print_deny(header, src_ip, dst_ip, src_port, dst_port,
-                   (proto == IPPROTO_TCP) ? "TCP" : (proto == IPPROTO_UDP) ? "UDP" : "IP",
-                   "deny_port", l4, l4_len);
+    if (dst_port != 0 && (hit = ipset_match_port(&deny_set, dst_port)) >= 0) {
+        uint64_t *row = worker_counters_row(&port_hits);
+        WORKER_COUNTER_ADD(&deny_stats[worker_id()].port_drops, 1);
+        if (row) WORKER_COUNTER_ADD(&row[hit], 1);
+        log_deny(header, m, "deny_port");
         return false;
     }
 
     return true; /* allowed */
 }
 
+static uint64_t entry_hits(uint32_t idx, bool port) {
+    return worker_counters_sum(port ? &port_hits : &ip_hits, idx);
+}
+
+typedef struct { uint32_t idx; uint64_t hits; } deny_rank_t;
+
+/* keep the n largest in top[] (descending); returns new fill */
+static int rank_insert(deny_rank_t *top, int fill, int n, uint32_t idx, uint64_t hits) {
+    if (hits == 0 || (fill == n && hits <= top[n - 1].hits)) return fill;
+    int i = (fill < n) ? fill++ : n - 1;
+    while (i > 0 && top[i - 1].hits < hits) { top[i] = top[i - 1]; --i; }
+    top[i].idx = idx;
+    top[i].hits = hits;
+    return fill;
+}
+
+static void entry_name(uint32_t idx, bool port, char *out, size_t outlen) {
+    if (port) snprintf(out, outlen, "%u", (unsigned)deny_set.ports[idx]);
+    else ipset_entry_to_str(&deny_set, idx, out, outlen);
+}
+
+static void print_top(const char *title, const deny_rank_t *top, int fill, bool port) {
+    if (fill == 0) return;
+    printf("   Top %s:\n", title);
+    for (int i = 0; i < fill; ++i) {
+        char name[INET_ADDRSTRLEN + 4];
+        entry_name(top[i].idx, port, name, sizeof(name));
+        printf("     %2d. %-20s %" PRIu64 " hits\n", i + 1, name, top[i].hits);
+    }
+}
+
 /* Report denylist statistics */
 void denylist_report(void) {
+    uint64_t ip_drops = 0, port_drops = 0;
+    int n = worker_count();
+    for (int w = 0; w < n; ++w) {
+        ip_drops += WORKER_COUNTER_READ(&deny_stats[w].ip_drops);
+        port_drops += WORKER_COUNTER_READ(&deny_stats[w].port_drops);
+    }
+
     printf("\n📊 [DENYLIST STATISTICS]\n");
-    printf("   Blocked by IP: %d packets\n", deny_ip_drops);
-    printf("   Blocked by Port: %d packets\n", deny_port_drops);
-    printf("   Total blocked: %d packets\n", deny_ip_drops + deny_port_drops);
+    printf("   Blocked by IP: %" PRIu64 " packets\n", ip_drops);
+    printf("   Blocked by Port: %" PRIu64 " packets\n", port_drops);
+    printf("   Total blocked: %" PRIu64 " packets\n", ip_drops + port_drops);
+
+    deny_rank_t top_ip[DENYLIST_TOP_N], top_pfx[DENYLIST_TOP_N], top_port[DENYLIST_TOP_N];
+    int n_ip = 0, n_pfx = 0, n_port = 0;
+    uint32_t unused = 0;
+    for (uint32_t i = 0; i < deny_set.net_count; ++i) {
+        uint64_t hits = entry_hits(i, false);
+        if (hits == 0) { unused++; continue; }
+        if (ipset_entry_prefix_len(&deny_set, i) == 32)
+            n_ip = rank_insert(top_ip, n_ip, DENYLIST_TOP_N, i, hits);
+        else
+            n_pfx = rank_insert(top_pfx, n_pfx, DENYLIST_TOP_N, i, hits);
+    }
+    for (uint32_t i = 0; i < deny_set.port_count; ++i) {
+        uint64_t hits = entry_hits(i, true);
+        if (hits == 0) unused++;
+        else n_port = rank_insert(top_port, n_port, DENYLIST_TOP_N, i, hits);
+    }
+    print_top("IPs", top_ip, n_ip, false);
+    print_top("prefixes", top_pfx, n_pfx, false);
+    print_top("ports", top_port, n_port, true);
+
+    /* stale rules still cost lookup time: list candidates for pruning */
+    if (unused == 0) return;
+    printf("   Never matched: %u of %u entries\n", unused, deny_set.net_count + deny_set.port_count);
+    uint32_t listed = 0;
+    for (uint32_t i = 0; i < deny_set.net_count + deny_set.port_count && listed < DENYLIST_UNUSED_LIST; ++i) {
+        bool port = i >= deny_set.net_count;
+        uint32_t idx = port ? i - deny_set.net_count : i;
+        if (entry_hits(idx, port)) continue;
+        char name[INET_ADDRSTRLEN + 4];
+        entry_name(idx, port, name, sizeof(name));
+        printf("     %s%s\n", port ? "port " : "", name);
+        listed++;
+    }
+    if (unused > listed) printf("     ... and %u more\n", unused - listed);
 }
-
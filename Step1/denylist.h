@@ -3,12 +3,13 @@
 
 #include <pcap.h>
 #include <stdbool.h>
+#include "packet.h"
 
 /* Initialize denylist (hardcoded, or later load from CSV) */
 void denylist_init(void);
 
 /* Return true == ALLOW, false == DENY (i.e., drop) */
-bool check_denylist(const struct pcap_pkthdr *header, const u_char *packet);
+bool check_denylist(const struct pcap_pkthdr *header, const pkt_meta_t *m);
 
 /* Report statistics */
 void denylist_report(void);
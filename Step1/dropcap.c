@@ -0,0 +1,374 @@
+/*
+ * dropcap.c
+ * pcapng capture of dropped / flagged packets.
+ *
+ * pcap_callback brackets the filter chain with dropcap_set_packet; stages
+ * that drop or flag the packet add a note (stage, reason) through
+ * dropcap_note (droplog_begin does it for every drop line, ban_check for
+ * its silent drops). When the packet is done, a packet with notes is
+ * copied once, with all its notes, into the capture thread's own byte
+ * ring (DC_RING_BYTES, single producer, variable-length records, a wrap
+ * marker where a record does not fit at the end). A full ring loses the
+ * packet and counts it.
+ *
+ * The writer thread drains the rings into Enhanced Packet Blocks, one
+ * opt_comment per note, of the current file: files are preallocated with
+ * posix_fallocate (a full disk fails at open, not as SIGBUS on a store)
+ * and mmap'd, so a block is a memcpy. A block that does not fit closes the
+ * file (munmap, truncated to what was written so it ends on a valid block)
+ * and moves to the next file of the ring, overwriting the oldest: disk use
+ * never exceeds files x file size. Each file starts with its own Section
+ * Header Block and one Interface Description Block per capture handle.
+ */
+
+#include "dropcap.h"
+#include "worker.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define DC_RING_BYTES   (4u << 20)   /* per capture thread */
+#define DC_MAX_RINGS    MAX_WORKERS
+#define DC_MAX_IFS      64
+#define DC_NOTES        3            /* stage/reason notes kept per packet */
+#define DC_WRAP         0xFFFFFFFFu  /* dc_rec_t.rec_len: rest of the ring unused */
+#define DC_IDLE_NS      5000000
+#define DC_FILES        4            /* defaults of -P <prefix> */
+#define DC_FILE_MB      16
+
+#define PCAPNG_SHB      0x0A0D0D0Au
+#define PCAPNG_IDB      0x00000001u
+#define PCAPNG_EPB      0x00000006u
+#define PCAPNG_MAGIC    0x1A2B3C4Du
+#define OPT_ENDOFOPT    0
+#define OPT_COMMENT     1
+#define OPT_IF_NAME     2
+#define LINKTYPE_RAW    101          /* DLT_RAW differs between platforms */
+
+typedef struct {
+    uint32_t rec_len;            /* header + packet, 8-byte aligned */
+    uint32_t caplen, origlen;
+    uint16_t if_id;
+    uint8_t notes, dropped;      /* dropped: bit i = note i is a drop */
+    int64_t ts_sec;
+    int64_t ts_usec;
+    const char *stage[DC_NOTES];
+    const char *reason[DC_NOTES];
+} dc_rec_t;
+
+typedef struct {
+    uint64_t head __attribute__((aligned(CACHE_LINE)));   /* producer: bytes queued */
+    uint64_t tail_cache;
+    uint64_t queued, lost;
+    uint64_t tail __attribute__((aligned(CACHE_LINE)));   /* writer: bytes consumed */
+    u_char data[DC_RING_BYTES];
+} dc_ring_t;
+
+static struct { char name[32]; uint16_t linktype; uint32_t snaplen; } ifs[DC_MAX_IFS];
+static int if_count;
+
+static char prefix[200];
+static int files = DC_FILES;
+static size_t file_bytes = (size_t)DC_FILE_MB << 20;
+static bool configured, enabled;
+
+static dc_ring_t *rings[DC_MAX_RINGS];
+static int ring_count;
+static __thread dc_ring_t *my_ring;
+static __thread bool ring_unavailable;
+
+/* packet being filtered on this thread and its notes */
+static __thread const struct pcap_pkthdr *cur_h;
+static __thread const u_char *cur_bytes;
+static __thread int cur_if;
+static __thread dc_rec_t cur;
+
+static pthread_t writer;
+static volatile int writer_stop;
+
+/* current file (writer only) */
+static int file_fd = -1, file_idx = -1;
+static u_char *file_map;
+static size_t file_used;
+static uint64_t written, written_bytes, files_opened, oversize, write_errors, no_ring_lost;
+
+static inline size_t pad4(size_t n) { return (n + 3) & ~(size_t)3; }
+
+static dc_ring_t *ring_get(void) {
+    if (my_ring || ring_unavailable) return my_ring;
+    int slot = __atomic_fetch_add(&ring_count, 1, __ATOMIC_RELAXED);
+    dc_ring_t *r = slot < DC_MAX_RINGS ? aligned_alloc(CACHE_LINE, sizeof(dc_ring_t)) : NULL;
+    if (!r) { ring_unavailable = true; return NULL; }
+    memset(r, 0, offsetof(dc_ring_t, data));
+    __atomic_store_n(&rings[slot], r, __ATOMIC_RELEASE);
+    return my_ring = r;
+}
+
+/* Copy the current packet and its notes into this thread's ring */
+static void enqueue(void) {
+    dc_ring_t *r = ring_get();
+    if (!r) { __atomic_fetch_add(&no_ring_lost, 1, __ATOMIC_RELAXED); return; }
+    uint32_t caplen = cur_h->caplen;
+    size_t need = (sizeof(dc_rec_t) + caplen + 7) & ~(size_t)7;
+    uint64_t head = r->head;
+    size_t pos = head % DC_RING_BYTES, contig = DC_RING_BYTES - pos;
+    size_t total = need <= contig ? need : contig + need;
+    if (DC_RING_BYTES - (head - r->tail_cache) < total) {
+        r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (DC_RING_BYTES - (head - r->tail_cache) < total) { WORKER_COUNTER_ADD(&r->lost, 1); return; }
+    }
+    if (need > contig) {
+        uint32_t wrap = DC_WRAP;
+        memcpy(r->data + pos, &wrap, sizeof(wrap));
+        pos = 0;
+    }
+    cur.rec_len = (uint32_t)need;
+    cur.caplen = caplen;
+    cur.origlen = cur_h->len;
+    cur.if_id = (uint16_t)cur_if;
+    cur.ts_sec = cur_h->ts.tv_sec;
+    cur.ts_usec = cur_h->ts.tv_usec;
+    memcpy(r->data + pos, &cur, sizeof(cur));
+    memcpy(r->data + pos + sizeof(cur), cur_bytes, caplen);
+    WORKER_COUNTER_ADD(&r->queued, 1);
+    __atomic_store_n(&r->head, head + total, __ATOMIC_RELEASE);
+}
+
+/* ---- writer ---- */
+
+static u_char *put32(u_char *p, uint32_t v) { memcpy(p, &v, 4); return p + 4; }
+static u_char *put16(u_char *p, uint16_t v) { memcpy(p, &v, 2); return p + 2; }
+
+static u_char *put_opt(u_char *p, uint16_t code, const char *s, size_t n) {
+    p = put16(p, code);
+    p = put16(p, (uint16_t)n);
+    memcpy(p, s, n);
+    memset(p + n, 0, pad4(n) - n);
+    return p + pad4(n);
+}
+
+static void file_close(void) {
+    if (file_fd < 0) return;
+    munmap(file_map, file_bytes);
+    if (ftruncate(file_fd, (off_t)file_used) != 0) ++write_errors;
+    close(file_fd);
+    file_fd = -1;
+    file_map = NULL;
+}
+
+/* Next file of the ring, with SHB + IDBs; false if it cannot be set up */
+static bool file_next(void) {
+    file_close();
+    file_idx = (file_idx + 1) % files;
+    char name[256];
+    snprintf(name, sizeof(name), "%s-%d.pcapng", prefix, file_idx);
+    int fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "[dropcap] open %s failed: %s\n", name, strerror(errno));
+        return false;
+    }
+    int err = posix_fallocate(fd, 0, (off_t)file_bytes);
+    void *map = err ? MAP_FAILED : mmap(NULL, file_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "[dropcap] cannot preallocate/map %s: %s\n", name, strerror(err ? err : errno));
+        close(fd);
+        return false;
+    }
+    file_fd = fd;
+    file_map = map;
+    ++files_opened;
+
+    u_char *p = file_map;
+    p = put32(p, PCAPNG_SHB);
+    p = put32(p, 28);
+    p = put32(p, PCAPNG_MAGIC);
+    p = put16(p, 1);
+    p = put16(p, 0);
+    int64_t section_len = -1;
+    memcpy(p, &section_len, 8);
+    p += 8;
+    p = put32(p, 28);
+    for (int i = 0; i < if_count; ++i) {
+        size_t n = strlen(ifs[i].name);
+        uint32_t len = (uint32_t)(20 + 4 + pad4(n) + 4);
+        p = put32(p, PCAPNG_IDB);
+        p = put32(p, len);
+        p = put16(p, ifs[i].linktype);
+        p = put16(p, 0);
+        p = put32(p, ifs[i].snaplen);
+        p = put_opt(p, OPT_IF_NAME, ifs[i].name, n);
+        p = put32(p, OPT_ENDOFOPT);
+        p = put32(p, len);
+    }
+    file_used = (size_t)(p - file_map);
+    return true;
+}
+
+/* One Enhanced Packet Block; false if the writer has no file */
+static bool write_epb(const dc_rec_t *rec, const u_char *pkt) {
+    char comment[DC_NOTES][96];
+    size_t clen[DC_NOTES], len = 32 + pad4(rec->caplen) + 4;
+    for (int i = 0; i < rec->notes; ++i) {
+        int n = snprintf(comment[i], sizeof(comment[i]), "%s stage=%s reason=%s",
+                         (rec->dropped >> i & 1) ? "drop" : "flag", rec->stage[i], rec->reason[i]);
+        clen[i] = n < 0 ? 0 : (size_t)n < sizeof(comment[i]) ? (size_t)n : sizeof(comment[i]) - 1;
+        len += 4 + pad4(clen[i]);
+    }
+    size_t headers = 28 + (size_t)if_count * (24 + 4 + 32);
+    if (len + headers > file_bytes) { ++oversize; return true; }
+    if (file_fd < 0 || file_used + len > file_bytes)
+        if (!file_next()) return false;
+
+    u_char *p = file_map + file_used;
+    uint64_t ts = (uint64_t)rec->ts_sec * 1000000u + (uint64_t)rec->ts_usec;
+    p = put32(p, PCAPNG_EPB);
+    p = put32(p, (uint32_t)len);
+    p = put32(p, rec->if_id);
+    p = put32(p, (uint32_t)(ts >> 32));
+    p = put32(p, (uint32_t)ts);
+    p = put32(p, rec->caplen);
+    p = put32(p, rec->origlen);
+    memcpy(p, pkt, rec->caplen);
+    memset(p + rec->caplen, 0, pad4(rec->caplen) - rec->caplen);
+    p += pad4(rec->caplen);
+    for (int i = 0; i < rec->notes; ++i) p = put_opt(p, OPT_COMMENT, comment[i], clen[i]);
+    p = put32(p, OPT_ENDOFOPT);
+    p = put32(p, (uint32_t)len);
+    file_used += len;
+    ++written;
+    written_bytes += rec->caplen;
+    return true;
+}
+
+static uint64_t drain(void) {
+    uint64_t n = 0;
+    int count = __atomic_load_n(&ring_count, __ATOMIC_RELAXED);
+    if (count > DC_MAX_RINGS) count = DC_MAX_RINGS;
+    for (int i = 0; i < count; ++i) {
+        dc_ring_t *r = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+        if (!r) continue;
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE), tail = r->tail;
+        while (tail != head) {
+            size_t pos = tail % DC_RING_BYTES;
+            dc_rec_t rec;
+            memcpy(&rec.rec_len, r->data + pos, sizeof(rec.rec_len));
+            if (rec.rec_len == DC_WRAP) { tail += DC_RING_BYTES - pos; continue; }
+            memcpy(&rec, r->data + pos, sizeof(rec));
+            if (!write_epb(&rec, r->data + pos + sizeof(rec))) ++write_errors;
+            tail += rec.rec_len;
+            ++n;
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+    return n;
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    while (!writer_stop) {
+        if (drain() == 0) {
+            struct timespec ts = { 0, DC_IDLE_NS };
+            nanosleep(&ts, NULL);
+        }
+    }
+    drain();
+    file_close();
+    return NULL;
+}
+
+/* ---- API ---- */
+
+void dropcap_set_output(const char *p, int n, int mb) {
+    if (!p || !*p) { configured = false; return; }
+    snprintf(prefix, sizeof(prefix), "%s", p);
+    files = n > 0 ? n : DC_FILES;
+    file_bytes = (size_t)(mb > 0 ? mb : DC_FILE_MB) << 20;
+    configured = true;
+}
+
+int dropcap_parse_output(const char *s, const char **pfx, int *n, int *mb) {
+    static char buf[200];
+    snprintf(buf, sizeof(buf), "%s", s);
+    char *colon = strchr(buf, ':');
+    *n = DC_FILES;
+    *mb = DC_FILE_MB;
+    if (colon) {
+        *colon = '\0';
+        char *end;
+        *n = (int)strtol(colon + 1, &end, 10);
+        if (*end == ':') *mb = (int)strtol(end + 1, &end, 10);
+        if (*end || *n <= 0 || *mb <= 0) return -1;
+    }
+    if (!buf[0]) return -1;
+    *pfx = buf;
+    return 0;
+}
+
+int dropcap_add_interface(const char *name, int dlt, int snaplen) {
+    if (!configured || if_count == DC_MAX_IFS) return -1;
+    snprintf(ifs[if_count].name, sizeof(ifs[0].name), "%s", name ? name : "unknown");
+    ifs[if_count].linktype = (uint16_t)(dlt == DLT_RAW ? LINKTYPE_RAW : dlt);
+    ifs[if_count].snaplen = (uint32_t)snaplen;
+    return if_count++;
+}
+
+void dropcap_init(void) {
+    if (!configured || enabled) return;
+    writer_stop = 0;
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+        fprintf(stderr, "[dropcap] no writer thread, packet capture disabled\n");
+        return;
+    }
+    enabled = true;
+    printf("[dropcap] Dropped packets → %s-{0..%d}.pcapng (%zu MiB each)\n", prefix, files - 1, file_bytes >> 20);
+}
+
+void dropcap_shutdown(void) {
+    if (!enabled) return;
+    enabled = false;
+    writer_stop = 1;
+    pthread_join(writer, NULL);
+}
+
+void dropcap_set_packet(const struct pcap_pkthdr *h, const u_char *bytes, int if_id) {
+    if (!enabled) return;
+    if (cur_h && cur.notes) enqueue();
+    cur_h = h;
+    cur_bytes = bytes;
+    cur_if = if_id;
+    cur.notes = 0;
+    cur.dropped = 0;
+}
+
+void dropcap_note(const struct pcap_pkthdr *h, const char *stage, const char *reason, bool dropped) {
+    if (!enabled || h != cur_h || cur_if < 0 || cur.notes == DC_NOTES) return;
+    cur.stage[cur.notes] = stage;
+    cur.reason[cur.notes] = reason ? reason : "unknown";
+    if (dropped) cur.dropped |= (uint8_t)(1u << cur.notes);
+    ++cur.notes;
+}
+
+void dropcap_report(void) {
+    if (!configured) return;
+    uint64_t queued = 0, lost = __atomic_load_n(&no_ring_lost, __ATOMIC_RELAXED);
+    int n = __atomic_load_n(&ring_count, __ATOMIC_RELAXED);
+    for (int i = 0; i < n && i < DC_MAX_RINGS; ++i) {
+        dc_ring_t *r = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+        if (!r) continue;
+        queued += WORKER_COUNTER_READ(&r->queued);
+        lost += WORKER_COUNTER_READ(&r->lost);
+    }
+    printf("\n📊 [DROP CAPTURE STATISTICS] (%s-*.pcapng, %d x %zu MiB)\n", prefix, files, file_bytes >> 20);
+    printf("   Packets: %" PRIu64 " queued, %" PRIu64 " written (%" PRIu64 " bytes), %" PRIu64 " lost to full rings\n",
+           queued, written, written_bytes, lost);
+    printf("   Files: %" PRIu64 " opened (%" PRIu64 " ring wrap(s)), %" PRIu64 " packets too big for a file, %" PRIu64 " write errors\n",
+           files_opened, files_opened > (uint64_t)files ? files_opened - (uint64_t)files : 0, oversize, write_errors);
+}
@@ -0,0 +1,39 @@
+#ifndef DROPCAP_H
+#define DROPCAP_H
+
+/*
+ * dropcap.h
+ * Optional pcapng capture of dropped and flagged packets: full packet
+ * bytes, each annotated with its stage and reason in an opt_comment,
+ * written by a background thread into a fixed ring of preallocated,
+ * memory-mapped files (<prefix>-0.pcapng ... <prefix>-<n-1>.pcapng).
+ */
+
+#include <pcap.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Enable capture into files x file_mb MiB named after prefix (default off) */
+void dropcap_set_output(const char *prefix, int files, int file_mb);
+/* "<prefix>[:<files>[:<MiB>]]"; 0 ok, -1 malformed */
+int dropcap_parse_output(const char *s, const char **prefix, int *files, int *file_mb);
+
+/* Interfaces become the pcapng IDBs; register every handle before capture
+ * starts. Returns the interface id for dropcap_set_packet, -1 if off. */
+int dropcap_add_interface(const char *name, int dlt, int snaplen);
+
+/* Start / stop the writer (stop drains and truncates the open file) */
+void dropcap_init(void);
+void dropcap_shutdown(void);
+
+/* Packet the calling capture thread is filtering (NULL: none) */
+void dropcap_set_packet(const struct pcap_pkthdr *h, const u_char *bytes, int if_id);
+
+/* Queue the current packet, if h is it, with "<drop|flag> stage=<stage>
+ * reason=<reason>" as its comment; stage and reason must be static strings */
+void dropcap_note(const struct pcap_pkthdr *h, const char *stage, const char *reason, bool dropped);
+
+/* Report statistics */
+void dropcap_report(void);
+
+#endif /* DROPCAP_H */
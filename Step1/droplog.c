@@ -0,0 +1,418 @@
+/*
+ * droplog.c
+ * Asynchronous drop lines.
+ *
+ * Each capture thread gets a single-producer ring of DL_RING_SIZE events
+ * (allocated on its first drop, like worker_counters rows); the producer
+ * owns head, the writer owns tail, and the two sit on separate cache lines.
+ * A full ring drops the event and counts it: the capture thread never waits
+ * on the console. The writer thread drains every ring in turn, formats into
+ * one DL_BATCH_BYTES buffer (localtime_r once per second of packet time,
+ * table-driven hex) and writes it with a single fwrite + fflush per pass.
+ * Lines of one thread keep their order; lines of different threads may
+ * interleave out of timestamp order.
+ *
+ * Under a flood most lines are the same drop again, so commits are
+ * aggregated by (stage, reason, source, destination port) in a fixed table
+ * of DL_AGG_BUCKETS x DL_AGG_SLOTS entries shared by all threads (claimed
+ * with CAS, counted with atomic adds). The first agg_first_n drops of a key
+ * in each agg_interval seconds are logged; the rest only bump its count,
+ * and at the end of the interval the writer prints one summary line per
+ * key that had suppressed drops and frees keys that saw none. When a
+ * source's bucket is full the drop is counted under (stage, reason, *,
+ * port) instead, so a flood from random spoofed sources still collapses;
+ * only if that bucket is full too is the line logged unaggregated.
+ */
+
+#include "droplog.h"
+#include "dropcap.h"
+#include "worker.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#define DL_RING_SIZE   2048        /* events per thread, power of two (256 KiB) */
+#define DL_MAX_RINGS   MAX_WORKERS
+#define DL_BATCH_BYTES 65536
+#define DL_LINE_MAX    512
+#define DL_IDLE_NS     2000000     /* writer sleep when every ring is empty */
+#define DL_AGG_BUCKETS 1024        /* power of two; x DL_AGG_SLOTS keys (256 KiB) */
+#define DL_AGG_SLOTS   4
+#define DL_AGG_ANY_SRC 0x80        /* dl_agg_t.stage: src aggregated as "*" */
+
+typedef struct {
+    uint64_t head __attribute__((aligned(CACHE_LINE)));   /* producer: next slot to fill */
+    uint64_t tail_cache;                                  /* producer's last view of tail */
+    uint64_t lost;                                        /* ring full */
+    uint64_t suppressed, unaggregated;                    /* aggregation table */
+    uint64_t tail __attribute__((aligned(CACHE_LINE)));   /* writer: next slot to read */
+    droplog_event_t ev[DL_RING_SIZE];
+} dl_ring_t;
+
+/* one aggregation key; key 0 = free, fields valid once ready is set */
+typedef struct {
+    uint64_t key;
+    uint64_t count;              /* drops in the current interval */
+    int64_t first_us, last_us;   /* first suppressed / latest drop, packet time */
+    const char *reason;
+    uint32_t src_ip;
+    uint16_t dst_port;
+    uint8_t stage;               /* dl_stage_t | DL_AGG_ANY_SRC */
+    uint8_t ready;
+} __attribute__((aligned(64))) dl_agg_t;
+
+/* localtime_r result of the last second formatted */
+typedef struct { int64_t sec; char base[32]; } dl_tscache_t;
+
+static const char *stage_names[DL_STAGES] = {
+    "ANTISPOOF", "HOPCOUNT", "ACL", "DENYLIST", "RATE-LIMIT", "MALFORMED", "BAN"
+};
+
+static const char *stage_tags[DL_STAGES] = {
+    [DL_STAGE_ANTISPOOF]  = "🎭 [ANTISPOOF DROP]",
+    [DL_STAGE_HOPCOUNT]   = "👣 [HOPCOUNT DROP]",
+    [DL_STAGE_ACL]        = "🛡️  [ACL DROP]",
+    [DL_STAGE_DENYLIST]   = "🚫 [DENYLIST DROP]",
+    [DL_STAGE_RATE_LIMIT] = "⚡ [RATE-LIMIT DROP]",
+    [DL_STAGE_MALFORMED]  = "❌ [MALFORMED DROP]",
+    [DL_STAGE_BAN]        = "⛔ [BAN]",
+};
+
+static dl_ring_t *rings[DL_MAX_RINGS];
+static int ring_count;
+static __thread dl_ring_t *my_ring;
+static __thread bool ring_unavailable;          /* registry full or OOM */
+static __thread droplog_event_t sync_ev;        /* writer not running */
+static __thread dl_tscache_t sync_ts = { -1, "" };
+
+static bool running;
+static volatile int writer_stop;
+static pthread_t writer;
+
+static uint64_t sync_lines, no_ring_lost;       /* atomic */
+static uint64_t written, batches, max_batch;    /* writer only */
+
+static dl_agg_t agg[DL_AGG_BUCKETS * DL_AGG_SLOTS];
+static int agg_interval = 10;                   /* seconds, 0 = log every drop */
+static uint32_t agg_first_n = 5;
+static uint64_t summaries;                      /* writer only */
+
+static dl_ring_t *ring_get(void) {
+    if (my_ring || ring_unavailable) return my_ring;
+    int slot = __atomic_fetch_add(&ring_count, 1, __ATOMIC_RELAXED);
+    dl_ring_t *r = slot < DL_MAX_RINGS ? aligned_alloc(CACHE_LINE, sizeof(dl_ring_t)) : NULL;
+    if (!r) { ring_unavailable = true; return NULL; }
+    memset(r, 0, offsetof(dl_ring_t, ev));
+    __atomic_store_n(&rings[slot], r, __ATOMIC_RELEASE);
+    return my_ring = r;
+}
+
+static size_t format_ts(int64_t sec, int32_t usec, dl_tscache_t *c, char *out) {
+    if (sec != c->sec) {
+        struct tm tm;
+        time_t t = (time_t)sec;
+        localtime_r(&t, &tm);
+        strftime(c->base, sizeof(c->base), "%Y-%m-%dT%H:%M:%S", &tm);
+        c->sec = sec;
+    }
+    size_t n = strlen(c->base);
+    memcpy(out, c->base, n);
+    out[n++] = '.';
+    for (int i = 5, u = usec; i >= 0; --i, u /= 10) out[n + (size_t)i] = (char)('0' + u % 10);
+    return n + 6;
+}
+
+/* One line, newline included; out holds DL_LINE_MAX bytes */
+static size_t format_event(const droplog_event_t *e, dl_tscache_t *c, char *out) {
+    static const char hexd[] = "0123456789abcdef";
+    char ts[48], src[INET_ADDRSTRLEN] = "N/A", dst[INET_ADDRSTRLEN] = "N/A", detail[256];
+    ts[format_ts(e->ts_sec, e->ts_usec, c, ts)] = '\0';
+    if (!(e->flags & DL_F_NO_ADDR)) {
+        struct in_addr a;
+        a.s_addr = htonl(e->src_ip); inet_ntop(AF_INET, &a, src, sizeof(src));
+        a.s_addr = htonl(e->dst_ip); inet_ntop(AF_INET, &a, dst, sizeof(dst));
+    }
+    if (e->fmt) e->fmt(e, detail, sizeof(detail));
+    else snprintf(detail, sizeof(detail), "reason=%s", e->reason ? e->reason : "unknown");
+
+    int n = snprintf(out, DL_LINE_MAX, "%s %s | %s:%u → %s:%u | %s",
+                     stage_tags[e->stage], ts, src, (unsigned)e->src_port, dst, (unsigned)e->dst_port, detail);
+    size_t p = n < 0 ? 0 : (size_t)n < DL_LINE_MAX ? (size_t)n : DL_LINE_MAX - 1;
+    if (e->payload_len && p + sizeof(" | payload=") + 3 * DROPLOG_PAYLOAD < DL_LINE_MAX) {
+        memcpy(out + p, " | payload=", 11);
+        p += 11;
+        for (int i = 0; i < e->payload_len; ++i) {
+            if (i) out[p++] = ' ';
+            out[p++] = hexd[e->payload[i] >> 4];
+            out[p++] = hexd[e->payload[i] & 15];
+        }
+    }
+    if (p > DL_LINE_MAX - 2) p = DL_LINE_MAX - 2;
+    out[p++] = '\n';
+    return p;
+}
+
+/* Summary of a key's suppressed drops; out holds DL_LINE_MAX bytes */
+static size_t format_summary(const dl_agg_t *a, uint64_t suppressed, int secs, dl_tscache_t *c, char *out) {
+    char first[48], last[48], src[INET_ADDRSTRLEN] = "*";
+    first[format_ts(a->first_us / 1000000, (int32_t)(a->first_us % 1000000), c, first)] = '\0';
+    last[format_ts(a->last_us / 1000000, (int32_t)(a->last_us % 1000000), c, last)] = '\0';
+    if (!(a->stage & DL_AGG_ANY_SRC)) {
+        struct in_addr in;
+        in.s_addr = htonl(a->src_ip);
+        inet_ntop(AF_INET, &in, src, sizeof(src));
+    }
+    int n = snprintf(out, DL_LINE_MAX, "🔁 [%s DROP SUMMARY] %s .. %s | %s → *:%u | reason=%s | %" PRIu64 " more in %ds (first %u logged)\n",
+                     stage_names[a->stage & ~DL_AGG_ANY_SRC], first, last, src, (unsigned)a->dst_port,
+                     a->reason ? a->reason : "unknown", suppressed, secs, agg_first_n);
+    if (n < 0) return 0;
+    if ((size_t)n >= DL_LINE_MAX) { out[DL_LINE_MAX - 2] = '\n'; return DL_LINE_MAX - 1; }
+    return (size_t)n;
+}
+
+/* End of an aggregation interval: summarize suppressed drops, free idle keys */
+static size_t agg_flush(dl_tscache_t *c, char *buf, size_t used, int secs, uint64_t *lines) {
+    for (size_t i = 0; i < sizeof(agg) / sizeof(agg[0]); ++i) {
+        dl_agg_t *a = &agg[i];
+        if (!__atomic_load_n(&a->ready, __ATOMIC_ACQUIRE)) continue;
+        uint64_t n = __atomic_exchange_n(&a->count, 0, __ATOMIC_RELAXED);
+        if (n == 0) {
+            /* idle for a whole interval; a drop racing with this is miscounted at worst */
+            __atomic_store_n(&a->ready, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&a->key, 0, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (n <= agg_first_n) continue;
+        if (used + DL_LINE_MAX > DL_BATCH_BYTES) {
+            fwrite(buf, 1, used, stdout);
+            used = 0;
+            ++batches;
+        }
+        used += format_summary(a, n - agg_first_n, secs, c, buf + used);
+        ++summaries;
+        ++*lines;
+    }
+    return used;
+}
+
+/* One pass over all rings (and the aggregation table when due); returns
+ * the number of lines written */
+static uint64_t drain(dl_tscache_t *c, char *buf, bool flush_agg) {
+    static time_t window_start;
+    size_t used = 0;
+    uint64_t lines = 0;
+    int n = __atomic_load_n(&ring_count, __ATOMIC_RELAXED);
+    if (n > DL_MAX_RINGS) n = DL_MAX_RINGS;
+    for (int i = 0; i < n; ++i) {
+        dl_ring_t *r = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+        if (!r) continue;
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE), tail = r->tail;
+        for (; tail != head; ++tail) {
+            if (used + DL_LINE_MAX > DL_BATCH_BYTES) {
+                fwrite(buf, 1, used, stdout);
+                used = 0;
+                ++batches;
+            }
+            used += format_event(&r->ev[tail & (DL_RING_SIZE - 1)], c, buf + used);
+            ++lines;
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+    if (agg_interval > 0) {
+        time_t now = time(NULL);
+        if (!window_start) window_start = now;
+        if (flush_agg || now - window_start >= agg_interval) {
+            used = agg_flush(c, buf, used, (int)(now - window_start), &lines);
+            window_start = now;
+        }
+    }
+    if (used) {
+        fwrite(buf, 1, used, stdout);
+        ++batches;
+    }
+    if (lines) {
+        fflush(stdout);
+        __atomic_store_n(&written, written + lines, __ATOMIC_RELAXED);
+        if (lines > max_batch) max_batch = lines;
+    }
+    return lines;
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    static char buf[DL_BATCH_BYTES];
+    dl_tscache_t c = { -1, "" };
+    while (!writer_stop) {
+        if (drain(&c, buf, false) == 0) {
+            struct timespec ts = { 0, DL_IDLE_NS };
+            nanosleep(&ts, NULL);
+        }
+    }
+    drain(&c, buf, true);   /* whatever was committed before the stop */
+    return NULL;
+}
+
+void droplog_init(void) {
+    if (running) return;
+    writer_stop = 0;
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+        fprintf(stderr, "droplog: no writer thread, drop lines are printed inline\n");
+        return;
+    }
+    __atomic_store_n(&running, true, __ATOMIC_RELEASE);
+}
+
+void droplog_set_aggregation(int interval_sec, int first_n) {
+    agg_interval = interval_sec > 0 ? interval_sec : 0;
+    agg_first_n = first_n > 0 ? (uint32_t)first_n : 0;
+}
+
+int droplog_parse_aggregation(const char *s, int *interval_sec, int *first_n) {
+    if (strcmp(s, "off") == 0) { *interval_sec = 0; return 0; }
+    char *end;
+    long iv = strtol(s, &end, 10);
+    if (end == s || iv <= 0) return -1;
+    long n = *first_n;
+    if (*end == ':') {
+        const char *p = end + 1;
+        n = strtol(p, &end, 10);
+        if (end == p || n < 0) return -1;
+    }
+    if (*end) return -1;
+    *interval_sec = (int)iv;
+    *first_n = (int)n;
+    return 0;
+}
+
+static inline uint64_t agg_key(uint8_t stage, const char *reason, uint32_t src, uint16_t port) {
+    uint64_t x = (uint64_t)(uintptr_t)reason ^ ((uint64_t)src << 24 | (uint64_t)port << 8 | stage) * 0x9e3779b97f4a7c15ull;
+    x ^= x >> 31; x *= 0xbf58476d1ce4e5b9ull; x ^= x >> 29;
+    return x | 1;
+}
+
+/* Key's entry, claimed if absent; NULL if its bucket is full */
+static dl_agg_t *agg_get(uint8_t stage, const char *reason, uint32_t src, uint16_t port) {
+    uint64_t key = agg_key(stage, reason, src, port);
+    dl_agg_t *b = &agg[(key >> 1 & (DL_AGG_BUCKETS - 1)) * DL_AGG_SLOTS];
+    for (int i = 0; i < DL_AGG_SLOTS; ++i) {
+        uint64_t k = __atomic_load_n(&b[i].key, __ATOMIC_ACQUIRE);
+        if (k == key) return &b[i];
+        if (k == 0 && __atomic_compare_exchange_n(&b[i].key, &k, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            b[i].reason = reason;
+            b[i].src_ip = src;
+            b[i].dst_port = port;
+            b[i].stage = stage;
+            __atomic_store_n(&b[i].ready, 1, __ATOMIC_RELEASE);
+            return &b[i];
+        }
+        if (k == key) return &b[i];   /* lost the race to the same key */
+    }
+    return NULL;
+}
+
+/* true: log the event, false: counted towards its key's summary */
+static bool agg_admit(dl_ring_t *r, const droplog_event_t *e) {
+    dl_agg_t *a = agg_get(e->stage, e->reason, e->src_ip, e->dst_port);
+    if (!a) a = agg_get(e->stage | DL_AGG_ANY_SRC, e->reason, 0, e->dst_port);
+    if (!a) { WORKER_COUNTER_ADD(&r->unaggregated, 1); return true; }
+    uint64_t n = __atomic_add_fetch(&a->count, 1, __ATOMIC_RELAXED);
+    if (n <= agg_first_n) return true;
+    int64_t us = e->ts_sec * 1000000 + e->ts_usec;
+    if (n == agg_first_n + 1) __atomic_store_n(&a->first_us, us, __ATOMIC_RELAXED);
+    __atomic_store_n(&a->last_us, us, __ATOMIC_RELAXED);
+    WORKER_COUNTER_ADD(&r->suppressed, 1);
+    return false;
+}
+
+void droplog_shutdown(void) {
+    if (!running) return;
+    __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+    writer_stop = 1;
+    pthread_join(writer, NULL);
+}
+
+droplog_event_t *droplog_begin(dl_stage_t stage, const struct pcap_pkthdr *h, const pkt_meta_t *m,
+                               const char *reason, droplog_fmt_t fmt) {
+    droplog_event_t *e = &sync_ev;
+    dropcap_note(h, stage_names[stage], reason, true);
+    if (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        dl_ring_t *r = ring_get();
+        if (!r) { __atomic_fetch_add(&no_ring_lost, 1, __ATOMIC_RELAXED); return NULL; }
+        uint64_t head = r->head;
+        if (head - r->tail_cache >= DL_RING_SIZE) {
+            r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+            if (head - r->tail_cache >= DL_RING_SIZE) { WORKER_COUNTER_ADD(&r->lost, 1); return NULL; }
+        }
+        e = &r->ev[head & (DL_RING_SIZE - 1)];
+    }
+    e->ts_sec = h->ts.tv_sec;
+    e->ts_usec = (int32_t)h->ts.tv_usec;
+    e->stage = (uint8_t)stage;
+    e->reason = reason;
+    e->fmt = fmt;
+    e->ctx = NULL;
+    e->payload_len = 0;
+    if (m && m->is_ipv4) {
+        e->flags = 0;
+        e->src_ip = m->src_ip;
+        e->dst_ip = m->dst_ip;
+        e->src_port = m->src_port;
+        e->dst_port = m->dst_port;
+        e->proto = m->proto;
+    } else {
+        e->flags = DL_F_NO_ADDR;
+        e->src_ip = e->dst_ip = 0;
+        e->src_port = e->dst_port = 0;
+        e->proto = 0;
+    }
+    return e;
+}
+
+void droplog_payload(droplog_event_t *e, const u_char *data, size_t len) {
+    size_t n = len < DROPLOG_PAYLOAD ? len : DROPLOG_PAYLOAD;
+    memcpy(e->payload, data, n);
+    e->payload_len = (uint8_t)n;
+}
+
+void droplog_commit(droplog_event_t *e) {
+    if (e == &sync_ev) {
+        char line[DL_LINE_MAX];
+        size_t n = format_event(e, &sync_ts, line);
+        fwrite(line, 1, n, stdout);
+        __atomic_fetch_add(&sync_lines, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (agg_interval > 0 && !agg_admit(my_ring, e)) return;   /* slot reused by the next begin */
+    __atomic_store_n(&my_ring->head, my_ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void droplog_report(void) {
+    uint64_t logged = 0, lost = __atomic_load_n(&no_ring_lost, __ATOMIC_RELAXED), suppressed = 0, unagg = 0;
+    int n = __atomic_load_n(&ring_count, __ATOMIC_RELAXED), used = 0;
+    for (int i = 0; i < n && i < DL_MAX_RINGS; ++i) {
+        dl_ring_t *r = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+        if (!r) continue;
+        ++used;
+        logged += __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        lost += WORKER_COUNTER_READ(&r->lost);
+        suppressed += WORKER_COUNTER_READ(&r->suppressed);
+        unagg += WORKER_COUNTER_READ(&r->unaggregated);
+    }
+    uint64_t inline_lines = __atomic_load_n(&sync_lines, __ATOMIC_RELAXED);
+    if (logged + lost + inline_lines + suppressed == 0) return;
+
+    printf("\n📊 [DROP LOG STATISTICS]\n");
+    printf("   Drop lines: %" PRIu64 " queued on %d ring(s), %" PRIu64 " written inline, %" PRIu64 " lost to full rings\n",
+           logged, used, inline_lines, lost);
+    printf("   Writer: %" PRIu64 " lines in %" PRIu64 " batch write(s), up to %" PRIu64 " lines per pass\n",
+           __atomic_load_n(&written, __ATOMIC_RELAXED), batches, max_batch);
+    if (agg_interval > 0)
+        printf("   Aggregation (first %u per key every %ds): %" PRIu64 " suppressed into %" PRIu64 " summary line(s), %" PRIu64 " logged unaggregated (table full)\n",
+               agg_first_n, agg_interval, suppressed, summaries, unagg);
+}
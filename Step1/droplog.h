@@ -0,0 +1,78 @@
+#ifndef DROPLOG_H
+#define DROPLOG_H
+
+/*
+ * droplog.h
+ * Drop lines off the capture threads: a stage reserves a small binary
+ * event in its thread's ring, fills in raw values and commits; the writer
+ * thread formats (timestamp, addresses, payload hex, stage detail) and
+ * writes them to stdout in batches.
+ */
+
+#include <pcap.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "packet.h"
+
+typedef enum {
+    DL_STAGE_ANTISPOOF = 0,
+    DL_STAGE_HOPCOUNT,
+    DL_STAGE_ACL,
+    DL_STAGE_DENYLIST,
+    DL_STAGE_RATE_LIMIT,
+    DL_STAGE_MALFORMED,
+    DL_STAGE_BAN,               /* ban issued / expired, not a drop */
+    DL_STAGES
+} dl_stage_t;
+
+#define DROPLOG_PAYLOAD 24          /* payload bytes kept for the hex column */
+#define DL_F_NO_ADDR    0x01        /* no IP header: addresses print as N/A */
+
+struct droplog_event;
+
+/* Stage detail between the endpoints and the payload, e.g.
+ * "proto=TCP | reason=deny_ip"; runs on the writer thread, so it may only
+ * use the event and data that lives until exit. Returns the length. */
+typedef int (*droplog_fmt_t)(const struct droplog_event *e, char *out, size_t len);
+
+typedef struct droplog_event {
+    int64_t ts_sec;
+    int32_t ts_usec;
+    uint32_t src_ip, dst_ip;        /* host byte order */
+    uint16_t src_port, dst_port;
+    uint8_t proto, stage, flags, payload_len;
+    const char *reason;             /* static string */
+    droplog_fmt_t fmt;              /* NULL: "reason=<reason>" */
+    const void *ctx;                /* stage data that outlives the event (policy, rule) */
+    double d[2];                    /* stage-specific raw values */
+    uint32_t u[4];
+    u_char payload[DROPLOG_PAYLOAD];
+} __attribute__((aligned(64))) droplog_event_t;
+
+/* Start the writer thread. Until then (and after shutdown) events are
+ * formatted and printed synchronously by the calling thread. */
+void droplog_init(void);
+/* Log the first first_n drops per (stage, reason, source, destination port)
+ * every interval_sec seconds, then one summary line per key and interval
+ * (default 10 s, 5); interval_sec 0 logs every drop */
+void droplog_set_aggregation(int interval_sec, int first_n);
+/* "off", "<seconds>" or "<seconds>:<first_n>"; 0 ok, -1 malformed */
+int droplog_parse_aggregation(const char *s, int *interval_sec, int *first_n);
+
+/* Drain every ring and stop the writer */
+void droplog_shutdown(void);
+
+/* Reserve an event with header/meta fields filled in (m may be NULL: the
+ * caller fills the addresses). NULL if the thread's ring is full; the event
+ * is then counted as lost and the caller just skips logging. */
+droplog_event_t *droplog_begin(dl_stage_t stage, const struct pcap_pkthdr *h, const pkt_meta_t *m,
+                               const char *reason, droplog_fmt_t fmt);
+/* Keep the first DROPLOG_PAYLOAD bytes of data for the payload column */
+void droplog_payload(droplog_event_t *e, const u_char *data, size_t len);
+/* Publish the event to the writer */
+void droplog_commit(droplog_event_t *e);
+
+/* Report statistics */
+void droplog_report(void);
+
+#endif /* DROPLOG_H */
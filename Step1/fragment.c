@@ -0,0 +1,252 @@
+/*
+ * fragment.c
+ * Bounded-memory tracker for fragmented IPv4 datagrams.
+ *
+ * Datagrams are keyed by (src, dst, id, proto) in a static table of
+ * FRAG_BUCKETS x FRAG_BUCKET_SLOTS 64-byte entries (1 MiB), so a fragment
+ * flood cannot grow it. An entry keeps the ports/flags of the first
+ * fragment and the byte ranges received so far, merged as they arrive;
+ * payload is never copied - the receiver still does the reassembly.
+ *
+ * Checked per fragment:
+ *   overlap   range intersects bytes already received (teardrop, TCP header
+ *             rewrites); an exact repeat of a received range is a duplicate
+ *   oversize  reassembles past 65535 bytes (ping of death), or past / in
+ *             conflict with the end set by the last fragment
+ *   too_many  more than FRAG_MAX_FRAGS fragments, or more holes than
+ *             FRAG_MAX_RANGES ranges can describe
+ * A datagram keeps the bits it tripped, so all its later fragments carry
+ * them too. Entries are freed when the datagram is complete and clean,
+ * expire FRAG_TIMEOUT_SEC (packet time) after creation, and a full bucket
+ * evicts its oldest entry.
+ *
+ * Each bucket has a spinlock; the critical section touches one bucket.
+ */
+
+#include "fragment.h"
+#include "worker.h"
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+
+#define FRAG_BUCKETS       4096      /* power of two */
+#define FRAG_BUCKET_SLOTS  4
+#define FRAG_MAX_RANGES    8
+#define FRAG_MAX_FRAGS     64        /* 64K datagram in 1K fragments */
+#define FRAG_TIMEOUT_SEC   30        /* Linux ipfrag_time default */
+#define FRAG_MAX_DATAGRAM  65535
+
+#define FE_HAVE_FIRST 0x01
+#define FE_HAVE_LAST  0x02
+
+typedef struct {
+    uint32_t src, dst;           /* host byte order */
+    uint32_t created;            /* packet time, seconds */
+    uint16_t id;
+    uint16_t sport, dport;       /* from the first fragment */
+    uint16_t end;                /* payload length, once the last fragment is seen */
+    uint8_t proto;
+    uint8_t used;
+    uint8_t state;               /* FE_* */
+    uint8_t bad;                 /* PKT_FRAG_ANOMALY bits seen so far */
+    uint8_t nfrags;              /* saturates */
+    uint8_t nranges;
+    uint8_t tcp_flags;
+    struct { uint16_t lo, hi; } r[FRAG_MAX_RANGES];   /* [lo, hi), sorted, disjoint */
+} __attribute__((aligned(64))) frag_entry_t;
+
+_Static_assert(sizeof(frag_entry_t) == 64, "frag_entry_t must stay one cache line");
+
+static frag_entry_t table[FRAG_BUCKETS][FRAG_BUCKET_SLOTS];
+static uint8_t bucket_lock[FRAG_BUCKETS];
+
+/* per-thread counters */
+static struct {
+    uint64_t fragments;
+    uint64_t created, completed, expired, evicted;
+    uint64_t attributed, unattributed;
+    uint64_t overlap, oversize, too_many, duplicate;
+} __attribute__((aligned(CACHE_LINE))) frag_stats[MAX_WORKERS];
+
+static inline uint32_t frag_hash(uint32_t src, uint32_t dst, uint16_t id, uint8_t proto) {
+    uint32_t x = src * 0x9e3779b9u ^ dst ^ ((uint32_t)id << 8 | proto) * 0x85ebca6bu;
+    x ^= x >> 16; x *= 0x7feb352d; x ^= x >> 15; x *= 0x846ca68b; x ^= x >> 16;
+    return x & (FRAG_BUCKETS - 1);
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static inline void lock_bucket(uint32_t b) {
+    while (__atomic_test_and_set(&bucket_lock[b], __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(&bucket_lock[b], __ATOMIC_RELAXED)) cpu_relax();
+}
+
+static inline void unlock_bucket(uint32_t b) {
+    __atomic_clear(&bucket_lock[b], __ATOMIC_RELEASE);
+}
+
+static inline bool entry_expired(const frag_entry_t *e, uint32_t now) {
+    return (int32_t)(now - e->created) > FRAG_TIMEOUT_SEC;
+}
+
+/* Find the datagram's entry or claim one: free, else expired, else oldest */
+static frag_entry_t *find_or_claim(uint32_t b, uint32_t src, uint32_t dst, uint16_t id, uint8_t proto,
+                                   uint32_t now, int w) {
+    frag_entry_t *victim = NULL;
+    for (int i = 0; i < FRAG_BUCKET_SLOTS; ++i) {
+        frag_entry_t *e = &table[b][i];
+        if (e->used && e->src == src && e->dst == dst && e->id == id && e->proto == proto) {
+            if (!entry_expired(e, now)) return e;
+            victim = e;   /* stale incarnation of the same id: start over */
+            break;
+        }
+        if (!victim || (victim->used && (!e->used || (int32_t)(e->created - victim->created) < 0))) victim = e;
+    }
+    if (victim->used) {
+        if (entry_expired(victim, now)) WORKER_COUNTER_ADD(&frag_stats[w].expired, 1);
+        else WORKER_COUNTER_ADD(&frag_stats[w].evicted, 1);
+    }
+    memset(victim, 0, sizeof(*victim));
+    victim->src = src;
+    victim->dst = dst;
+    victim->id = id;
+    victim->proto = proto;
+    victim->created = now;
+    victim->used = 1;
+    WORKER_COUNTER_ADD(&frag_stats[w].created, 1);
+    return victim;
+}
+
+/* Record [lo, hi): 0, PKT_FRAG_OVERLAP or PKT_FRAG_TOO_MANY (range list full);
+ * *dup is set for an exact repeat of a received range */
+static uint8_t add_range(frag_entry_t *e, uint16_t lo, uint16_t hi, bool *dup) {
+    for (int j = 0; j < e->nranges; ++j) {
+        if (e->r[j].lo == lo && e->r[j].hi == hi) { *dup = true; return 0; }
+        if (e->r[j].lo < hi && e->r[j].hi > lo) return PKT_FRAG_OVERLAP;
+    }
+    int i = 0;
+    while (i < e->nranges && e->r[i].hi < lo) ++i;
+    if (i < e->nranges && e->r[i].hi == lo) {
+        e->r[i].hi = hi;
+        if (i + 1 < e->nranges && e->r[i + 1].lo == hi) {   /* filled a hole */
+            e->r[i].hi = e->r[i + 1].hi;
+            memmove(&e->r[i + 1], &e->r[i + 2], (size_t)(e->nranges - i - 2) * sizeof(e->r[0]));
+            e->nranges--;
+        }
+        return 0;
+    }
+    if (i < e->nranges && e->r[i].lo == hi) { e->r[i].lo = lo; return 0; }
+    if (e->nranges == FRAG_MAX_RANGES) return PKT_FRAG_TOO_MANY;
+    memmove(&e->r[i + 1], &e->r[i], (size_t)(e->nranges - i) * sizeof(e->r[0]));
+    e->r[i].lo = lo;
+    e->r[i].hi = hi;
+    e->nranges++;
+    return 0;
+}
+
+void frag_init(void) {
+    memset(table, 0, sizeof(table));
+    memset(bucket_lock, 0, sizeof(bucket_lock));
+    memset(frag_stats, 0, sizeof(frag_stats));
+}
+
+void frag_track(const struct pcap_pkthdr *header, pkt_meta_t *m) {
+    if (!m->frag || !m->ip) return;
+    const struct ip *ip = m->ip;
+    size_t total = ntohs(ip->ip_len);
+    if (m->ip_hdr_len < 20 || total <= m->ip_hdr_len) return;   /* left to is_malformed */
+
+    int w = worker_id();
+    WORKER_COUNTER_ADD(&frag_stats[w].fragments, 1);
+    uint16_t off = ntohs(ip->ip_off);
+    uint32_t lo = (uint32_t)(off & IP_OFFMASK) * 8;
+    uint32_t hi = lo + (uint32_t)(total - m->ip_hdr_len);
+    bool last = (off & IP_MF) == 0;
+    uint32_t now = (uint32_t)header->ts.tv_sec;
+
+    uint32_t b = frag_hash(m->src_ip, m->dst_ip, ntohs(ip->ip_id), m->proto);
+    lock_bucket(b);
+    frag_entry_t *e = find_or_claim(b, m->src_ip, m->dst_ip, ntohs(ip->ip_id), m->proto, now, w);
+
+    uint8_t bits = 0;
+    bool dup = false;
+    if (e->nfrags < UINT8_MAX) e->nfrags++;
+    if (e->nfrags > FRAG_MAX_FRAGS) bits |= PKT_FRAG_TOO_MANY;
+    if (hi + m->ip_hdr_len > FRAG_MAX_DATAGRAM || ((e->state & FE_HAVE_LAST) && hi > e->end)) {
+        bits |= PKT_FRAG_OVERSIZE;
+    } else {
+        bits |= add_range(e, (uint16_t)lo, (uint16_t)hi, &dup);
+        if (last && !(bits & PKT_FRAG_OVERLAP)) {
+            /* a second, different end, or bytes already received past this one */
+            if ((e->state & FE_HAVE_LAST) ? hi != e->end : e->r[e->nranges - 1].hi > hi) bits |= PKT_FRAG_OVERSIZE;
+            else { e->state |= FE_HAVE_LAST; e->end = (uint16_t)hi; }
+        }
+    }
+
+    if ((m->frag & PKT_FRAG_FIRST) && !(e->state & FE_HAVE_FIRST) && !(bits & PKT_FRAG_ANOMALY)) {
+        e->sport = m->src_port;
+        e->dport = m->dst_port;
+        e->tcp_flags = m->tcp_flags;
+        e->state |= FE_HAVE_FIRST;
+    } else if (m->frag & PKT_FRAG_LATER) {
+        if (e->state & FE_HAVE_FIRST) {
+            m->src_port = e->sport;
+            m->dst_port = e->dport;
+            m->tcp_flags = e->tcp_flags;
+            m->frag |= PKT_FRAG_ATTRIBUTED;
+            WORKER_COUNTER_ADD(&frag_stats[w].attributed, 1);
+        } else {
+            WORKER_COUNTER_ADD(&frag_stats[w].unattributed, 1);
+        }
+    }
+
+    bits &= (uint8_t)~e->bad;   /* count each anomaly once per datagram */
+    e->bad |= bits;
+    m->frag |= e->bad;
+    bool complete = !e->bad && (e->state & FE_HAVE_LAST) && e->nranges == 1
+                    && e->r[0].lo == 0 && e->r[0].hi == e->end;
+    if (complete) e->used = 0;
+    unlock_bucket(b);
+
+    if (complete) WORKER_COUNTER_ADD(&frag_stats[w].completed, 1);
+    if (dup) WORKER_COUNTER_ADD(&frag_stats[w].duplicate, 1);
+    if (bits & PKT_FRAG_OVERLAP) WORKER_COUNTER_ADD(&frag_stats[w].overlap, 1);
+    if (bits & PKT_FRAG_OVERSIZE) WORKER_COUNTER_ADD(&frag_stats[w].oversize, 1);
+    if (bits & PKT_FRAG_TOO_MANY) WORKER_COUNTER_ADD(&frag_stats[w].too_many, 1);
+}
+
+void frag_report(void) {
+    uint64_t s[11] = {0};
+    for (int w = 0; w < worker_count(); ++w) {
+        s[0]  += WORKER_COUNTER_READ(&frag_stats[w].fragments);
+        s[1]  += WORKER_COUNTER_READ(&frag_stats[w].created);
+        s[2]  += WORKER_COUNTER_READ(&frag_stats[w].completed);
+        s[3]  += WORKER_COUNTER_READ(&frag_stats[w].expired);
+        s[4]  += WORKER_COUNTER_READ(&frag_stats[w].evicted);
+        s[5]  += WORKER_COUNTER_READ(&frag_stats[w].attributed);
+        s[6]  += WORKER_COUNTER_READ(&frag_stats[w].unattributed);
+        s[7]  += WORKER_COUNTER_READ(&frag_stats[w].overlap);
+        s[8]  += WORKER_COUNTER_READ(&frag_stats[w].oversize);
+        s[9]  += WORKER_COUNTER_READ(&frag_stats[w].too_many);
+        s[10] += WORKER_COUNTER_READ(&frag_stats[w].duplicate);
+    }
+    int live = 0;
+    for (int b = 0; b < FRAG_BUCKETS; ++b)
+        for (int i = 0; i < FRAG_BUCKET_SLOTS; ++i) live += table[b][i].used;
+
+    printf("\n📊 [FRAGMENT STATISTICS]\n");
+    printf("   Fragments: %" PRIu64 " in %" PRIu64 " datagrams (%" PRIu64 " completed, %" PRIu64 " expired after %ds, %" PRIu64 " evicted)\n",
+           s[0], s[1], s[2], s[3], FRAG_TIMEOUT_SEC, s[4]);
+    printf("   Later fragments attributed to first-fragment ports: %" PRIu64 ", first fragment not seen: %" PRIu64 "\n",
+           s[5], s[6]);
+    printf("   Datagrams flagged: overlap %" PRIu64 ", oversize %" PRIu64 ", too_many %" PRIu64 " (duplicate fragments: %" PRIu64 ")\n",
+           s[7], s[8], s[9], s[10]);
+    printf("   Table: %d/%d entries in use (%zu KiB fixed)\n",
+           live, FRAG_BUCKETS * FRAG_BUCKET_SLOTS, sizeof(table) / 1024);
+}
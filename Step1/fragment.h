@@ -0,0 +1,20 @@
+#ifndef FRAGMENT_H
+#define FRAGMENT_H
+
+#include <pcap.h>
+#include <stdbool.h>
+#include "packet.h"
+
+/* Fixed-size table of in-flight fragmented IPv4 datagrams */
+void frag_init(void);
+
+/* Track one packet (no-op unless m->frag is set). Fills the ports/flags of
+ * non-first fragments from their datagram's first fragment and ORs
+ * PKT_FRAG_ATTRIBUTED / the PKT_FRAG_ANOMALY bits into m->frag. Nothing is
+ * dropped here; is_malformed acts on the anomaly bits. */
+void frag_track(const struct pcap_pkthdr *header, pkt_meta_t *m);
+
+/* Report statistics */
+void frag_report(void);
+
+#endif /* FRAGMENT_H */
@@ -0,0 +1,244 @@
+/*
+ * hopcount.c
+ * Hop-count filtering: a spoofed packet carries the TTL of the attacker's
+ * path, not the forged source's.
+ *
+ * The hop count is inferred from the TTL as (smallest common initial TTL
+ * >= TTL) - TTL, initial TTLs being 32, 64, 128 and 255. Each source /24
+ * keeps the hop count its traffic usually shows in one 64-bit word of a
+ * fixed 512 KiB table (8-slot, cache-line buckets; least confident entry
+ * evicted), updated lock-free with CAS like the rate-limit table:
+ *   bits 32-56  /24 prefix | HCF_KEY_USED
+ *   bits 16-31  last update, packet seconds mod 2^16
+ *   bits  8-15  confidence (majority vote: +1 agree, -1 disagree)
+ *   bits  0-7   hop count
+ * Only completed handshakes teach the table: a SYN that passed the whole
+ * filter chain (rate limiter included) leaves its (src, sport, dst, dport)
+ * and hop count in a direct-mapped table, and the first bare ACK of that
+ * tuple within HCF_HANDSHAKE_SECS showing the same hop count is one sample.
+ * A blind spoofer can still send both halves from a forged source, so this
+ * does not make poisoning impossible; it bounds it to the SYNs the rate
+ * limiter lets through, HCF_MIN_CONF of them per /24 before it has any
+ * effect. Every packet from a prefix with confidence >= HCF_MIN_CONF is
+ * checked, allowing HCF_TOLERANCE hops of jitter. A mismatch is counted (flag), marks
+ * m->spoof_suspect for the rate limiter (penalize) or drops (drop).
+ */
+
+#include "hopcount.h"
+#include "worker.h"
+#include "droplog.h"
+#include "dropcap.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+
+#define HCF_BUCKETS      8192      /* power of two; x HCF_BUCKET_SLOTS prefixes */
+#define HCF_BUCKET_SLOTS 8
+#define HCF_KEY_USED     (1u << 24)
+#define HCF_TOLERANCE    1         /* hops of jitter accepted */
+#define HCF_MIN_CONF     8         /* net agreeing samples before enforcing */
+#define HCF_CONF_MAX     32        /* caps how long a route change takes to relearn */
+#define HCF_HS_SLOTS     65536     /* pending handshakes, power of two (512 KiB) */
+#define HCF_HANDSHAKE_SECS 3
+
+typedef struct { uint64_t slot[HCF_BUCKET_SLOTS]; } __attribute__((aligned(64))) hcf_bucket_t;
+
+static hcf_bucket_t table[HCF_BUCKETS];
+/* accepted SYNs: tuple hash tag (32) | packet seconds (16) | hops (8) */
+static uint64_t handshakes[HCF_HS_SLOTS];
+static hcf_mode_t hcf_mode = HCF_MODE_PENALIZE;
+
+/* per-thread counters */
+static struct {
+    uint64_t unknown;        /* source /24 not in the table */
+    uint64_t learning;       /* in the table, not confident yet */
+    uint64_t checked, mismatch, dropped;
+    uint64_t inserted, evicted, relearned;
+    uint64_t syn_recorded, handshakes_learned;
+} __attribute__((aligned(CACHE_LINE))) hcf_stats[MAX_WORKERS];
+
+static inline uint8_t infer_hops(uint8_t ttl) {
+    if (ttl <= 32) return (uint8_t)(32 - ttl);
+    if (ttl <= 64) return (uint8_t)(64 - ttl);
+    if (ttl <= 128) return (uint8_t)(128 - ttl);
+    return (uint8_t)(255 - ttl);
+}
+
+static inline uint64_t pack(uint32_t key, uint16_t seen, uint8_t conf, uint8_t hops) {
+    return (uint64_t)key << 32 | (uint64_t)seen << 16 | (uint64_t)conf << 8 | hops;
+}
+
+static inline hcf_bucket_t *bucket_of(uint32_t key) {
+    uint32_t x = key * 0x9e3779b9u;
+    x ^= x >> 16; x *= 0x7feb352d; x ^= x >> 15;
+    return &table[x & (HCF_BUCKETS - 1)];
+}
+
+static inline uint64_t tuple_hash(const pkt_meta_t *m) {
+    uint64_t x = (uint64_t)m->src_ip << 32 | m->dst_ip;
+    x ^= (uint64_t)m->src_port << 16 | m->dst_port;
+    x ^= x >> 33; x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ull;
+    return x ^ (x >> 33);
+}
+
+/* Bare ACK completing a handshake recorded by hopcount_syn_accepted, with
+ * the SYN's hop count: consumes the entry, so a connection teaches once */
+static bool handshake_done(const pkt_meta_t *m, uint8_t hops, uint16_t now) {
+    uint64_t h = tuple_hash(m);
+    uint64_t *slot = &handshakes[h & (HCF_HS_SLOTS - 1)];
+    uint64_t v = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    if (!v || (uint32_t)(v >> 32) != (uint32_t)(h >> 32)) return false;
+    if ((uint16_t)(now - (uint16_t)(v >> 16)) > HCF_HANDSHAKE_SECS || (uint8_t)v != hops) return false;
+    return __atomic_compare_exchange_n(slot, &v, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/* One learning sample; a lost CAS race just drops this sample */
+static void learn(uint64_t *slot, uint64_t v, uint8_t hops, bool match, uint16_t now, int w) {
+    uint8_t lh = (uint8_t)v, conf = (uint8_t)(v >> 8);
+    if (match) {
+        if (conf < HCF_CONF_MAX) conf++;
+    } else if (conf > 1) {
+        conf--;
+    } else {
+        lh = hops;   /* outvoted: the prefix moved (route change) */
+        conf = 1;
+        WORKER_COUNTER_ADD(&hcf_stats[w].relearned, 1);
+    }
+    uint64_t nv = pack((uint32_t)(v >> 32), now, conf, lh);
+    if (nv != v) __atomic_compare_exchange_n(slot, &v, nv, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/* First sample of a prefix: free slot, else the least confident (oldest on ties) */
+static void insert(hcf_bucket_t *b, uint32_t key, uint8_t hops, uint16_t now, int w) {
+    uint64_t *victim = NULL, vv = 0;
+    for (int i = 0; i < HCF_BUCKET_SLOTS; ++i) {
+        uint64_t v = __atomic_load_n(&b->slot[i], __ATOMIC_RELAXED);
+        if (v == 0) { victim = &b->slot[i]; vv = 0; break; }
+        uint8_t c = (uint8_t)(v >> 8), vc = (uint8_t)(vv >> 8);
+        uint16_t age = (uint16_t)(now - (uint16_t)(v >> 16)), vage = (uint16_t)(now - (uint16_t)(vv >> 16));
+        if (!victim || c < vc || (c == vc && age > vage)) { victim = &b->slot[i]; vv = v; }
+    }
+    if (!__atomic_compare_exchange_n(victim, &vv, pack(key, now, 1, hops), false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+    WORKER_COUNTER_ADD(&hcf_stats[w].inserted, 1);
+    if (vv) WORKER_COUNTER_ADD(&hcf_stats[w].evicted, 1);
+}
+
+/* drop line detail, formatted by the droplog writer: u[] ttl, hops, learned, conf */
+static int fmt_drop(const droplog_event_t *e, char *out, size_t len) {
+    return snprintf(out, len, "ttl=%u hops=%u learned=%u conf=%u | reason=%s",
+                    e->u[0], e->u[1], e->u[2], e->u[3], e->reason);
+}
+
+static void log_drop(const struct pcap_pkthdr *h, const pkt_meta_t *m, uint8_t hops, uint8_t learned, uint8_t conf) {
+    droplog_event_t *e = droplog_begin(DL_STAGE_HOPCOUNT, h, m, "hop_mismatch", fmt_drop);
+    if (!e) return;
+    e->u[0] = m->ip->ip_ttl;
+    e->u[1] = hops;
+    e->u[2] = learned;
+    e->u[3] = conf;
+    droplog_commit(e);
+}
+
+void hopcount_init(void) {
+    memset(table, 0, sizeof(table));
+    memset(handshakes, 0, sizeof(handshakes));
+    memset(hcf_stats, 0, sizeof(hcf_stats));
+}
+
+void hopcount_set_mode(hcf_mode_t mode) {
+    hcf_mode = mode;
+}
+
+int hopcount_parse_mode(const char *s) {
+    static const char *names[] = { "off", "flag", "penalize", "drop" };
+    for (int i = 0; i < 4; ++i) if (strcasecmp(s, names[i]) == 0) return i;
+    return -1;
+}
+
+bool hopcount_check(const struct pcap_pkthdr *header, pkt_meta_t *m) {
+    if (hcf_mode == HCF_MODE_OFF || !m->is_ipv4) return true;
+    int w = worker_id();
+    uint8_t hops = infer_hops(m->ip->ip_ttl);
+    uint32_t key = (m->src_ip >> 8) | HCF_KEY_USED;
+    uint16_t now = (uint16_t)header->ts.tv_sec;
+    bool teach = m->proto == IPPROTO_TCP
+                 && (m->tcp_flags & (PKT_TCP_SYN | PKT_TCP_RST | PKT_TCP_ACK)) == PKT_TCP_ACK
+                 && handshake_done(m, hops, now);
+    if (teach) WORKER_COUNTER_ADD(&hcf_stats[w].handshakes_learned, 1);
+
+    hcf_bucket_t *b = bucket_of(key);
+    uint64_t *slot = NULL, v = 0;
+    for (int i = 0; i < HCF_BUCKET_SLOTS; ++i) {
+        v = __atomic_load_n(&b->slot[i], __ATOMIC_RELAXED);
+        if ((uint32_t)(v >> 32) == key) { slot = &b->slot[i]; break; }
+    }
+    if (!slot) {
+        WORKER_COUNTER_ADD(&hcf_stats[w].unknown, 1);
+        if (teach) insert(b, key, hops, now, w);
+        return true;
+    }
+
+    uint8_t learned = (uint8_t)v, conf = (uint8_t)(v >> 8);
+    int diff = (int)hops - (int)learned;
+    bool match = diff >= -HCF_TOLERANCE && diff <= HCF_TOLERANCE;
+    if (teach) learn(slot, v, hops, match, now, w);
+    if (conf < HCF_MIN_CONF) { WORKER_COUNTER_ADD(&hcf_stats[w].learning, 1); return true; }
+
+    WORKER_COUNTER_ADD(&hcf_stats[w].checked, 1);
+    if (match) return true;
+    WORKER_COUNTER_ADD(&hcf_stats[w].mismatch, 1);
+    if (hcf_mode >= HCF_MODE_PENALIZE) m->spoof_suspect = 1;
+    if (hcf_mode != HCF_MODE_DROP) {
+        dropcap_note(header, "HOPCOUNT", "hop_mismatch", false);
+        return true;
+    }
+    WORKER_COUNTER_ADD(&hcf_stats[w].dropped, 1);
+    log_drop(header, m, hops, learned, conf);
+    return false;
+}
+
+void hopcount_syn_accepted(const struct pcap_pkthdr *header, const pkt_meta_t *m) {
+    if (hcf_mode == HCF_MODE_OFF || !m->is_ipv4 || m->proto != IPPROTO_TCP) return;
+    if ((m->tcp_flags & (PKT_TCP_SYN | PKT_TCP_ACK)) != PKT_TCP_SYN) return;
+    uint64_t h = tuple_hash(m);
+    uint16_t now = (uint16_t)header->ts.tv_sec;
+    __atomic_store_n(&handshakes[h & (HCF_HS_SLOTS - 1)],
+                     (h >> 32) << 32 | (uint64_t)now << 16 | infer_hops(m->ip->ip_ttl), __ATOMIC_RELAXED);
+    WORKER_COUNTER_ADD(&hcf_stats[worker_id()].syn_recorded, 1);
+}
+
+void hopcount_report(void) {
+    static const char *names[] = { "off", "flag", "penalize", "drop" };
+    uint64_t s[10] = {0};
+    for (int w = 0; w < worker_count(); ++w) {
+        s[0] += WORKER_COUNTER_READ(&hcf_stats[w].unknown);
+        s[1] += WORKER_COUNTER_READ(&hcf_stats[w].learning);
+        s[2] += WORKER_COUNTER_READ(&hcf_stats[w].checked);
+        s[3] += WORKER_COUNTER_READ(&hcf_stats[w].mismatch);
+        s[4] += WORKER_COUNTER_READ(&hcf_stats[w].dropped);
+        s[5] += WORKER_COUNTER_READ(&hcf_stats[w].inserted);
+        s[6] += WORKER_COUNTER_READ(&hcf_stats[w].evicted);
+        s[7] += WORKER_COUNTER_READ(&hcf_stats[w].relearned);
+        s[8] += WORKER_COUNTER_READ(&hcf_stats[w].syn_recorded);
+        s[9] += WORKER_COUNTER_READ(&hcf_stats[w].handshakes_learned);
+    }
+    int used = 0, confident = 0;
+    for (int b = 0; b < HCF_BUCKETS; ++b)
+        for (int i = 0; i < HCF_BUCKET_SLOTS; ++i) {
+            uint64_t v = table[b].slot[i];
+            used += v != 0;
+            confident += v != 0 && (uint8_t)(v >> 8) >= HCF_MIN_CONF;
+        }
+
+    printf("\n📊 [HOPCOUNT STATISTICS] (mode=%s)\n", names[hcf_mode]);
+    printf("   Packets checked against a learned /24: %" PRIu64 ", TTL mismatch: %" PRIu64 " (dropped %" PRIu64 ")\n",
+           s[2], s[3], s[4]);
+    printf("   Not checked: %" PRIu64 " from unknown /24s, %" PRIu64 " from /24s still learning\n", s[0], s[1]);
+    printf("   Table: %d/%d /24s (%d confident), %" PRIu64 " inserted, %" PRIu64 " evicted, %" PRIu64 " relearned\n",
+           used, HCF_BUCKETS * HCF_BUCKET_SLOTS, confident, s[5], s[6], s[7]);
+    printf("   Learning: %" PRIu64 " accepted SYNs recorded, %" PRIu64 " completed handshakes learned from\n", s[8], s[9]);
+}
@@ -0,0 +1,30 @@
+#ifndef HOPCOUNT_H
+#define HOPCOUNT_H
+
+#include <pcap.h>
+#include <stdbool.h>
+#include "packet.h"
+
+/* What a TTL that does not fit the source /24's learned hop count does */
+typedef enum {
+    HCF_MODE_OFF      = 0,
+    HCF_MODE_FLAG     = 1,   /* learn and count only */
+    HCF_MODE_PENALIZE = 2,   /* + mark m->spoof_suspect: the rate limiter charges more (default) */
+    HCF_MODE_DROP     = 3    /* + drop it once the prefix is learned */
+} hcf_mode_t;
+
+void hopcount_init(void);
+void hopcount_set_mode(hcf_mode_t mode);
+/* "off", "flag", "penalize" or "drop"; -1 if unknown */
+int hopcount_parse_mode(const char *s);
+
+/* Return true == ALLOW; learns from the ACK completing a handshake whose
+ * SYN was accepted, checks all */
+bool hopcount_check(const struct pcap_pkthdr *header, pkt_meta_t *m);
+/* A packet passed the whole chain: if it is a SYN, its handshake may teach */
+void hopcount_syn_accepted(const struct pcap_pkthdr *header, const pkt_meta_t *m);
+
+/* Report statistics */
+void hopcount_report(void);
+
+#endif /* HOPCOUNT_H */
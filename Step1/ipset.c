@@ -0,0 +1,341 @@
+/*
+ * ipset.c
+ * IPv4 prefix / port sets: text loading, binary image write and read-only mmap.
+ *
+ * The image layout is exactly the in-memory lookup layout, so mapping it
+ * needs no per-entry work: validate header + checksum, point the view at
+ * the sections, done. Pages are MAP_SHARED, so several capture processes
+ * on one host share a single copy of the denylist.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "ipset.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#define SECTION_ALIGN 64
+
+struct ipset_builder {
+    uint64_t *keys;      /* ((32 - len) << 32) | net  -> sorts longest prefix first */
+    size_t key_count, key_cap;
+    uint8_t *port_bitmap;
+};
+
+/* Helper: trim newline and spaces (in-place) */
+static char *trim(char *s) {
+    while (*s && isspace((unsigned char)*s)) s++;
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) --end;
+    *end = '\0';
+    return s;
+}
+
+static inline uint32_t prefix_mask(int len) {
+    return len == 0 ? 0 : (uint32_t)(0xFFFFFFFFu << (32 - len));
+}
+
+ipset_builder_t *ipset_builder_new(void) {
+    ipset_builder_t *b = calloc(1, sizeof(*b));
+    if (!b) return NULL;
+    b->port_bitmap = calloc(1, IPSET_PORT_BITMAP_BYTES);
+    if (!b->port_bitmap) { free(b); return NULL; }
+    return b;
+}
+
+int ipset_builder_add_net(ipset_builder_t *b, uint32_t net_host, int prefix_len) {
+    if (prefix_len < 0 || prefix_len > 32) return -1;
+    if (b->key_count == b->key_cap) {
+        size_t cap = b->key_cap ? b->key_cap * 2 : 1024;
+        uint64_t *k = realloc(b->keys, cap * sizeof(*k));
+        if (!k) return -1;
+        b->keys = k;
+        b->key_cap = cap;
+    }
+    uint32_t net = net_host & prefix_mask(prefix_len);
+    b->keys[b->key_count++] = ((uint64_t)(32 - prefix_len) << 32) | net;
+    return 0;
+}
+
+int ipset_builder_add_port(ipset_builder_t *b, uint16_t port) {
+    b->port_bitmap[port >> 3] |= (uint8_t)(1u << (port & 7));
+    return 0;
+}
+
+int ipset_builder_add_ip_file(ipset_builder_t *b, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char line[128];
+    int added = 0, lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        ++lineno;
+        char *s = trim(line);
+        if (*s == '\0' || *s == '#') continue;
+        int len = 32;
+        char *slash = strchr(s, '/');
+        if (slash) {
+            *slash = '\0';
+            char *end = NULL;
+            long l = strtol(slash + 1, &end, 10);
+            if (end == slash + 1 || *end != '\0' || l < 0 || l > 32) {
+                fprintf(stderr, "[ipset] %s:%d: bad prefix length, skipped\n", path, lineno);
+                continue;
+            }
+            len = (int)l;
+        }
+        struct in_addr a;
+        if (inet_pton(AF_INET, s, &a) != 1) {
+            fprintf(stderr, "[ipset] %s:%d: bad IPv4 address '%s', skipped\n", path, lineno, s);
+            continue;
+        }
+        if (ipset_builder_add_net(b, ntohl(a.s_addr), len) == 0) added++;
+    }
+    fclose(f);
+    return added;
+}
+
+int ipset_builder_add_port_file(ipset_builder_t *b, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char line[64];
+    int added = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char *s = trim(line);
+        if (*s == '\0' || *s == '#') continue;
+        int port = atoi(s);
+        if (port > 0 && port <= 65535) {
+            ipset_builder_add_port(b, (uint16_t)port);
+            added++;
+        }
+    }
+    fclose(f);
+    return added;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* fill lens[] from len_index[] (longest first) */
+static void index_lengths(ipset_t *set) {
+    set->len_count = 0;
+    for (int len = 32; len >= 0; --len)
+        if (set->len_index[len].count) set->lens[set->len_count++] = (uint8_t)len;
+}
+
+/* Heap layout mirrors the image: nets | ports | bitmap in one block */
+int ipset_builder_finish(ipset_builder_t *b, ipset_t *set) {
+    memset(set, 0, sizeof(*set));
+    if (b->key_count) qsort(b->keys, b->key_count, sizeof(uint64_t), cmp_u64);
+
+    size_t uniq = 0;
+    for (size_t i = 0; i < b->key_count; ++i)
+        if (uniq == 0 || b->keys[i] != b->keys[uniq - 1]) b->keys[uniq++] = b->keys[i];
+
+    uint32_t port_count = 0;
+    for (uint32_t p = 0; p < 65536; ++p)
+        if (b->port_bitmap[p >> 3] & (1u << (p & 7))) port_count++;
+
+    size_t nets_bytes = uniq * sizeof(uint32_t);
+    size_t ports_off = (nets_bytes + SECTION_ALIGN - 1) & ~(size_t)(SECTION_ALIGN - 1);
+    size_t bitmap_off = (ports_off + port_count * sizeof(uint16_t) + SECTION_ALIGN - 1) & ~(size_t)(SECTION_ALIGN - 1);
+    uint8_t *heap = aligned_alloc(SECTION_ALIGN, bitmap_off + IPSET_PORT_BITMAP_BYTES);
+    if (!heap) {
+        free(b->keys); free(b->port_bitmap); free(b);
+        return -1;
+    }
+
+    uint32_t *nets = (uint32_t *)heap;
+    for (size_t i = 0; i < uniq; ++i) {
+        int len = 32 - (int)(b->keys[i] >> 32);
+        nets[i] = (uint32_t)b->keys[i];
+        if (set->len_index[len].count == 0) set->len_index[len].first = (uint32_t)i;
+        set->len_index[len].count++;
+    }
+    uint16_t *ports = (uint16_t *)(heap + ports_off);
+    uint32_t np = 0;
+    for (uint32_t p = 0; p < 65536; ++p)
+        if (b->port_bitmap[p >> 3] & (1u << (p & 7))) ports[np++] = (uint16_t)p;
+    memcpy(heap + bitmap_off, b->port_bitmap, IPSET_PORT_BITMAP_BYTES);
+
+    set->heap = heap;
+    set->nets = nets;
+    set->net_count = (uint32_t)uniq;
+    set->ports = ports;
+    set->port_count = port_count;
+    set->port_bitmap = heap + bitmap_off;
+    index_lengths(set);
+
+    free(b->keys);
+    free(b->port_bitmap);
+    free(b);
+    return 0;
+}
+
+/* FNV-1a 64 over the whole file, treating the checksum field as zero */
+static uint64_t image_checksum(const uint8_t *base, size_t len) {
+    const size_t skip = offsetof(ipset_image_header_t, checksum);
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; ++i) {
+        uint8_t c = (i >= skip && i < skip + sizeof(uint64_t)) ? 0 : base[i];
+        h ^= c;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+int ipset_image_write(const ipset_t *set, const char *path) {
+    ipset_image_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    size_t hdr_size = (sizeof(hdr) + SECTION_ALIGN - 1) & ~(size_t)(SECTION_ALIGN - 1);
+    hdr.magic = IPSET_IMAGE_MAGIC;
+    hdr.version = IPSET_IMAGE_VERSION;
+    hdr.header_size = (uint16_t)sizeof(hdr);
+    hdr.net_count = set->net_count;
+    hdr.port_count = set->port_count;
+    memcpy(hdr.len_index, set->len_index, sizeof(hdr.len_index));
+    hdr.nets_off = hdr_size;
+    hdr.ports_off = (hdr.nets_off + (uint64_t)set->net_count * 4 + SECTION_ALIGN - 1) & ~(uint64_t)(SECTION_ALIGN - 1);
+    hdr.bitmap_off = (hdr.ports_off + (uint64_t)set->port_count * 2 + SECTION_ALIGN - 1) & ~(uint64_t)(SECTION_ALIGN - 1);
+    hdr.file_size = hdr.bitmap_off + IPSET_PORT_BITMAP_BYTES;
+
+    uint8_t *img = calloc(1, hdr.file_size);
+    if (!img) return -1;
+    memcpy(img, &hdr, sizeof(hdr));
+    if (set->net_count) memcpy(img + hdr.nets_off, set->nets, (size_t)set->net_count * 4);
+    if (set->port_count) memcpy(img + hdr.ports_off, set->ports, (size_t)set->port_count * 2);
+    memcpy(img + hdr.bitmap_off, set->port_bitmap, IPSET_PORT_BITMAP_BYTES);
+    hdr.checksum = image_checksum(img, hdr.file_size);
+    memcpy(img + offsetof(ipset_image_header_t, checksum), &hdr.checksum, sizeof(hdr.checksum));
+
+    /* write to tmp + rename so a running capture never maps a half-written image */
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int rc = -1;
+    FILE *f = fopen(tmp, "wb");
+    if (f) {
+        if (fwrite(img, 1, hdr.file_size, f) == hdr.file_size && fflush(f) == 0 && fsync(fileno(f)) == 0)
+            rc = 0;
+        if (fclose(f) != 0) rc = -1;
+        if (rc == 0 && rename(tmp, path) != 0) rc = -1;
+        if (rc != 0) unlink(tmp);
+    }
+    free(img);
+    return rc;
+}
+
+int ipset_image_map(ipset_t *set, const char *path, char *err, size_t errlen) {
+    memset(set, 0, sizeof(*set));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { snprintf(err, errlen, "open: %s", strerror(errno)); return -1; }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ipset_image_header_t)) {
+        snprintf(err, errlen, "file too small");
+        close(fd);
+        return -1;
+    }
+    size_t len = (size_t)st.st_size;
+    void *base = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) { snprintf(err, errlen, "mmap: %s", strerror(errno)); return -1; }
+
+    const ipset_image_header_t *hdr = base;
+    const char *why = NULL;
+    if (hdr->magic != IPSET_IMAGE_MAGIC) why = "bad magic";
+    else if (hdr->version != IPSET_IMAGE_VERSION) why = "unsupported version";
+    else if (hdr->header_size != sizeof(*hdr) || hdr->file_size != len) why = "size mismatch";
+    else if (hdr->nets_off % SECTION_ALIGN || hdr->ports_off % SECTION_ALIGN || hdr->bitmap_off % SECTION_ALIGN ||
+             hdr->nets_off < sizeof(*hdr) ||
+             hdr->nets_off + (uint64_t)hdr->net_count * 4 > hdr->ports_off ||
+             hdr->ports_off + (uint64_t)hdr->port_count * 2 > hdr->bitmap_off ||
+             hdr->bitmap_off + IPSET_PORT_BITMAP_BYTES > len) why = "bad section layout";
+    else {
+        uint64_t total = 0;
+        for (int l = 0; l <= 32 && !why; ++l) {
+            const ipset_range_t *r = &hdr->len_index[l];
+            if ((uint64_t)r->first + r->count > hdr->net_count) why = "bad prefix index";
+            total += r->count;
+        }
+        if (!why && total != hdr->net_count) why = "bad prefix index";
+    }
+    if (!why && image_checksum(base, len) != hdr->checksum) why = "checksum mismatch";
+    if (why) {
+        snprintf(err, errlen, "%s", why);
+        munmap(base, len);
+        return -1;
+    }
+
+    const uint8_t *b = base;
+    set->map_base = base;
+    set->map_len = len;
+    set->nets = (const uint32_t *)(b + hdr->nets_off);
+    set->net_count = hdr->net_count;
+    memcpy(set->len_index, hdr->len_index, sizeof(set->len_index));
+    set->ports = (const uint16_t *)(b + hdr->ports_off);
+    set->port_count = hdr->port_count;
+    set->port_bitmap = b + hdr->bitmap_off;
+    index_lengths(set);
+    return 0;
+}
+
+void ipset_free(ipset_t *set) {
+    if (set->map_base) munmap(set->map_base, set->map_len);
+    free(set->heap);
+    memset(set, 0, sizeof(*set));
+}
+
+static int bsearch_u32(const uint32_t *a, uint32_t n, uint32_t key) {
+    uint32_t lo = 0, hi = n;
+    while (lo < hi) {
+        uint32_t mid = lo + ((hi - lo) >> 1);
+        if (a[mid] < key) lo = mid + 1; else hi = mid;
+    }
+    return (lo < n && a[lo] == key) ? (int)lo : -1;
+}
+
+int ipset_match_ip(const ipset_t *set, uint32_t ip_host) {
+    for (int i = 0; i < set->len_count; ++i) {
+        int len = set->lens[i];
+        const ipset_range_t *r = &set->len_index[len];
+        int hit = bsearch_u32(set->nets + r->first, r->count, ip_host & prefix_mask(len));
+        if (hit >= 0) return (int)r->first + hit;
+    }
+    return -1;
+}
+
+int ipset_match_port(const ipset_t *set, uint16_t port) {
+    if (!set->port_bitmap || !(set->port_bitmap[port >> 3] & (1u << (port & 7)))) return -1;
+    uint32_t lo = 0, hi = set->port_count;
+    while (lo < hi) {
+        uint32_t mid = lo + ((hi - lo) >> 1);
+        if (set->ports[mid] < port) lo = mid + 1; else hi = mid;
+    }
+    return (lo < set->port_count && set->ports[lo] == port) ? (int)lo : -1;
+}
+
+int ipset_entry_prefix_len(const ipset_t *set, uint32_t idx) {
+    for (int i = 0; i < set->len_count; ++i) {
+        const ipset_range_t *r = &set->len_index[set->lens[i]];
+        if (idx >= r->first && idx < r->first + r->count) return set->lens[i];
+    }
+    return -1;
+}
+
+void ipset_entry_to_str(const ipset_t *set, uint32_t idx, char *out, size_t outlen) {
+    char buf[INET_ADDRSTRLEN];
+    struct in_addr a;
+    a.s_addr = htonl(set->nets[idx]);
+    inet_ntop(AF_INET, &a, buf, sizeof(buf));
+    int len = ipset_entry_prefix_len(set, idx);
+    if (len == 32) snprintf(out, outlen, "%s", buf);
+    else snprintf(out, outlen, "%s/%d", buf, len);
+}
@@ -0,0 +1,91 @@
+#ifndef IPSET_H
+#define IPSET_H
+
+/*
+ * ipset.h
+ * Sorted IPv4 prefix + port sets shared by the denylist and its offline compiler.
+ *
+ * A set can be built from text lists (IP.txt / Ports.txt style) or mapped
+ * read-only from a precompiled binary image (see denylist_compile.c). Both
+ * paths end up with the same read-only view, so lookups never care where
+ * the data came from.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define IPSET_IMAGE_MAGIC   0x4c44464eu   /* "NFDL" in little-endian */
+#define IPSET_IMAGE_VERSION 1
+#define IPSET_PORT_BITMAP_BYTES (65536 / 8)
+
+/* [first, first+count) slice of the nets[] array for one prefix length */
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+} ipset_range_t;
+
+/* On-disk header. All integers are host byte order; a foreign-endian image
+ * fails the magic check. Sections are 64-byte aligned. */
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint64_t file_size;
+    uint32_t net_count;                /* prefixes of all lengths */
+    uint32_t port_count;
+    ipset_range_t len_index[33];       /* [prefix_len] -> slice of nets[] */
+    uint64_t nets_off;                 /* uint32_t[net_count], host order */
+    uint64_t ports_off;                /* uint16_t[port_count], sorted */
+    uint64_t bitmap_off;               /* IPSET_PORT_BITMAP_BYTES */
+    uint64_t checksum;                 /* FNV-1a 64 of the file, this field as zero */
+} ipset_image_header_t;
+
+/* Read-only lookup view. nets[] is grouped by prefix length (longest first)
+ * and sorted within each group, so a lookup is one binary search per
+ * populated length. */
+typedef struct {
+    const uint32_t *nets;
+    uint32_t net_count;
+    ipset_range_t len_index[33];
+    uint8_t lens[33];                  /* populated lengths, longest first */
+    int len_count;
+
+    const uint16_t *ports;
+    uint32_t port_count;
+    const uint8_t *port_bitmap;
+
+    /* ownership: either a heap build or a read-only mapping */
+    void *heap;
+    void *map_base;
+    size_t map_len;
+} ipset_t;
+
+/* Text loaders. Lines are "a.b.c.d", "a.b.c.d/len" or a port number; blank
+ * lines and '#' comments are skipped. Return entries accepted, -1 if the
+ * file could not be opened. */
+typedef struct ipset_builder ipset_builder_t;
+
+ipset_builder_t *ipset_builder_new(void);
+int  ipset_builder_add_ip_file(ipset_builder_t *b, const char *path);
+int  ipset_builder_add_port_file(ipset_builder_t *b, const char *path);
+int  ipset_builder_add_net(ipset_builder_t *b, uint32_t net_host, int prefix_len);
+int  ipset_builder_add_port(ipset_builder_t *b, uint16_t port);
+/* sort, dedupe and hand the result to set; frees the builder */
+int  ipset_builder_finish(ipset_builder_t *b, ipset_t *set);
+
+/* Binary image: write a set out, or map one read-only (0 on success). */
+int  ipset_image_write(const ipset_t *set, const char *path);
+int  ipset_image_map(ipset_t *set, const char *path, char *err, size_t errlen);
+
+void ipset_free(ipset_t *set);
+
+/* Lookups return the matching entry index (stable for a given set), or -1. */
+int  ipset_match_ip(const ipset_t *set, uint32_t ip_host);
+int  ipset_match_port(const ipset_t *set, uint16_t port);
+
+/* Entry accessors for reporting */
+int  ipset_entry_prefix_len(const ipset_t *set, uint32_t idx);
+void ipset_entry_to_str(const ipset_t *set, uint32_t idx, char *out, size_t outlen);
+
+#endif /* IPSET_H */
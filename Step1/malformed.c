@@ -1,12 +1,30 @@
 /*
  * malformed.c
- * Performs RFC-sanity checks and prints malformed packet drops to stdout.
+ * Performs RFC-sanity checks and logs malformed packet drops (droplog.c).
  *
- * - Includes <stddef.h> for offsetof
- * - Uses bool consistently and matches malformed.h prototype
+ * One pass over the headers computes an anomaly bitmask (one bit per
+ * mf_reasons[] entry) instead of returning at the first failed check, so a
+ * packet reports every problem it has. Checks within a layer are plain
+ * flag arithmetic; branches only guard what can be read safely (an IP
+ * header that is truncated or has a bad IHL stops the scan there).
+ *
+ * The packet is dropped if bits & drop_mask (malformed_set_drop_mask,
+ * default MF_DEFAULT_DROP: every reason but tcp_opt_value, tcp_opt_dup,
+ * tcp_opt_syn_only and icmp_type_deprecated); flagged packets outside the
+ * mask are counted and passed. Clean packets cost one test of the mask;
+ * per-reason counters are per thread and only touched for flagged packets.
+ *
+ * IPv4 header, TCP, UDP and ICMP checksums all go through csum_verify
+ * (checksum.h, in place), which accounts bytes per protocol and times one
+ * verification in MF_CS_SAMPLE so the report shows what each one costs.
  */
 
 #include "malformed.h"
+#include "checksum.h"
+#include "tcpopt.h"
+#include "worker.h"
+#include "droplog.h"
+#include "dropcap.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,248 +32,402 @@
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
+#include <netinet/ip_icmp.h>
 #include <net/ethernet.h>
 #include <stdint.h>
 #include <time.h>
 #include <errno.h>
-#include <stddef.h>   /* offsetof */
+#include <stddef.h>
 #include <stdbool.h>
+#include <inttypes.h>
 
-/* Drop counter */
-static int malformed_drops = 0;
-
-/* timestamp formatting */
-static void timestamp_to_str(const struct pcap_pkthdr *h, char *out, size_t outlen) {
-    struct tm tm;
-    time_t tsec = h->ts.tv_sec;
-    localtime_r(&tsec, &tm);
-    char base[64];
-    strftime(base, sizeof(base), "%Y-%m-%dT%H:%M:%S", &tm);
-    snprintf(out, outlen, "%s.%06ld", base, (long)h->ts.tv_usec);
-}
+#define MF_BIT(r)        (1u << (r))
+#define MF_IF(cond, r)   ((uint32_t)(!!(cond)) << (r))
+
+/* layer a reason is found at: picks the payload dump and proto label */
+typedef enum { MF_LAYER_ETH, MF_LAYER_IP, MF_LAYER_L4 } mf_layer_t;
+
+static const struct {
+    const char *name;          /* reason= on the drop line, -M list entry */
+    const char *proto;
+    mf_layer_t layer;
+} mf_reasons[MF_REASONS] = {
+    [MF_ETH_SHORT]         = { "too_short",            "ETH",  MF_LAYER_ETH },
+    [MF_IP_TRUNC_HDR]      = { "truncated_ip_hdr",     "IP",   MF_LAYER_IP },
+    [MF_IP_BAD_IHL]        = { "invalid_ihl",          "IP",   MF_LAYER_IP },
+    [MF_IP_TRUNC_TOTAL]    = { "truncated_total",      "IP",   MF_LAYER_IP },
+    [MF_IP_BAD_CSUM]       = { "bad_checksum",         "IP",   MF_LAYER_IP },
+    [MF_IP_FRAG_ANOMALY]   = { "frag_anomaly",         "IP",   MF_LAYER_IP },
+    [MF_FRAG_OVERLAP]      = { "frag_overlap",         "IP",   MF_LAYER_IP },
+    [MF_FRAG_OVERSIZE]     = { "frag_oversize",        "IP",   MF_LAYER_IP },
+    [MF_FRAG_TOO_MANY]     = { "frag_too_many",        "IP",   MF_LAYER_IP },
+    [MF_TCP_TRUNC]         = { "tcp_truncated",        "TCP",  MF_LAYER_L4 },
+    [MF_TCP_BAD_OFF]       = { "tcp_off_invalid",      "TCP",  MF_LAYER_L4 },
+    [MF_TCP_SYN_FIN]       = { "syn_fin",              "TCP",  MF_LAYER_L4 },
+    [MF_TCP_BAD_CSUM]      = { "tcp_cksum_bad",        "TCP",  MF_LAYER_L4 },
+    [MF_TCP_OPT_TRUNC]     = { "tcp_opt_trunc",        "TCP",  MF_LAYER_L4 },
+    [MF_TCP_OPT_BAD_LEN]   = { "tcp_opt_len",          "TCP",  MF_LAYER_L4 },
+    [MF_TCP_OPT_BAD_VALUE] = { "tcp_opt_value",        "TCP",  MF_LAYER_L4 },
+    [MF_TCP_OPT_DUP]       = { "tcp_opt_dup",          "TCP",  MF_LAYER_L4 },
+    [MF_TCP_OPT_SYN_ONLY]  = { "tcp_opt_syn_only",     "TCP",  MF_LAYER_L4 },
+    [MF_UDP_TRUNC]         = { "udp_truncated",        "UDP",  MF_LAYER_L4 },
+    [MF_UDP_BAD_LEN]       = { "udp_len_invalid",      "UDP",  MF_LAYER_L4 },
+    [MF_UDP_BAD_CSUM]      = { "udp_cksum_bad",        "UDP",  MF_LAYER_L4 },
+    [MF_ICMP_TRUNC]        = { "icmp_truncated",       "ICMP", MF_LAYER_L4 },
+    [MF_ICMP_BAD_TYPE]     = { "icmp_type_invalid",    "ICMP", MF_LAYER_L4 },
+    [MF_ICMP_DEPRECATED]   = { "icmp_type_deprecated", "ICMP", MF_LAYER_L4 },
+    [MF_ICMP_BAD_LEN]      = { "icmp_len_invalid",     "ICMP", MF_LAYER_L4 },
+    [MF_ICMP_BAD_CSUM]     = { "icmp_cksum_bad",       "ICMP", MF_LAYER_L4 },
+};
+
+_Static_assert(MF_TCP_OPT_SYN_ONLY - MF_TCP_OPT_TRUNC + 1 == TOPT_ANOMALIES, "tcp_opt_* reasons mirror TOPT_A_*");
+
+static uint32_t drop_mask = MF_DEFAULT_DROP;
+
+/* ICMP types by length rule (RFC 792, 950, 1256, 8335); 0 = unassigned.
+ * Types deprecated by RFC 6918 (source quench, information request, ...)
+ * get their own reason, which is counted but not dropped by default */
+#define ICMP_K_QUERY   1    /* >= 8 bytes */
+#define ICMP_K_ERROR   2    /* >= 8 + offending IP header + 64 bits */
+#define ICMP_K_TSTAMP  3    /* exactly 20 bytes */
+#define ICMP_K_DEPR    4    /* any length, any code */
+#define ICMP_ERROR_MIN (8 + 20 + 8)
+
+static const struct {
+    uint8_t kind;
+    uint32_t codes;            /* bit c set: code c is defined */
+} icmp_types[] = {
+    [ICMP_ECHOREPLY]      = { ICMP_K_QUERY,  0x1 },
+    [ICMP_DEST_UNREACH]   = { ICMP_K_ERROR,  0xffff },
+    [ICMP_SOURCE_QUENCH]  = { ICMP_K_DEPR,   0 },
+    [ICMP_REDIRECT]       = { ICMP_K_ERROR,  0xf },
+    [6]                   = { ICMP_K_DEPR,   0 },         /* alternate host address */
+    [ICMP_ECHO]           = { ICMP_K_QUERY,  0x1 },
+    [9]                   = { ICMP_K_QUERY,  0x10001 },   /* router advertisement: 0, 16 */
+    [10]                  = { ICMP_K_QUERY,  0x1 },       /* router solicitation */
+    [ICMP_TIME_EXCEEDED]  = { ICMP_K_ERROR,  0x3 },
+    [ICMP_PARAMETERPROB]  = { ICMP_K_ERROR,  0x7 },
+    [ICMP_TIMESTAMP]      = { ICMP_K_TSTAMP, 0x1 },
+    [ICMP_TIMESTAMPREPLY] = { ICMP_K_TSTAMP, 0x1 },
+    [ICMP_INFO_REQUEST]   = { ICMP_K_DEPR,   0 },
+    [ICMP_INFO_REPLY]     = { ICMP_K_DEPR,   0 },
+    [ICMP_ADDRESS]        = { ICMP_K_DEPR,   0 },
+    [ICMP_ADDRESSREPLY]   = { ICMP_K_DEPR,   0 },
+    [30 ... 39]           = { ICMP_K_DEPR,   0 },         /* traceroute .. SKIP */
+    [42]                  = { ICMP_K_QUERY,  0x1 },       /* extended echo request */
+    [43]                  = { ICMP_K_QUERY,  0x1f },      /* extended echo reply */
+};
+#define ICMP_TYPES (sizeof(icmp_types) / sizeof(icmp_types[0]))
+
+/* checksum work per protocol */
+typedef enum { MF_CS_IP, MF_CS_TCP, MF_CS_UDP, MF_CS_ICMP, MF_CS_PROTOS } mf_cs_t;
+static const char *const mf_cs_names[MF_CS_PROTOS] = { "IPv4 header", "TCP", "UDP", "ICMP" };
+#define MF_CS_SAMPLE 64        /* time 1 verification in 64 (two clock reads) */
+
+static uint64_t clock_overhead_ns;   /* cost of the two reads, measured at init */
+
+typedef struct {
+    uint64_t count, bytes;                  /* every verification */
+    uint64_t timed, timed_ns;               /* the sampled ones */
+} mf_cs_cost_t;
+
+/* per-thread counters */
+static struct {
+    uint64_t dropped, passed;          /* flagged packets by verdict */
+    uint64_t csum_offload, csum_valid; /* L4 checksum passes skipped on the capture path's word */
+    uint64_t udp_no_csum;              /* UDP checksum 0: sender computed none */
+    mf_cs_cost_t cs[MF_CS_PROTOS];
+    uint64_t reason[MF_REASONS];
+} __attribute__((aligned(CACHE_LINE))) mf_stats[MAX_WORKERS];
 
-/* hex prefix */
-static void hex_prefix_to_str(const u_char *data, size_t len, size_t prefix, char *out, size_t outlen) {
-    size_t up = (len < prefix) ? len : prefix;
+/* what the scan found where, for the drop line */
+typedef struct {
+    const struct ip *ip;
+    const u_char *l4;
+    size_t ip_cap, l4_cap;
+    uint16_t sport, dport;
+} mf_view_t;
+
+/* reason names joined with '+', lowest bit first */
+static void reasons_to_str(uint32_t bits, char *out, size_t outlen) {
     size_t p = 0;
-    for (size_t i = 0; i < up && p + 3 < outlen; ++i) {
-        int w = snprintf(out + p, outlen - p, "%02x", data[i]);
-        p += (w > 0) ? w : 0;
-        if (i + 1 < up && p + 2 < outlen) out[p++] = ' ';
+    out[0] = '\0';
+    for (int r = 0; r < MF_REASONS && p + 1 < outlen; ++r) {
+        if (!(bits & MF_BIT(r))) continue;
+        int w = snprintf(out + p, outlen - p, "%s%s", p ? "+" : "", mf_reasons[r].name);
+        p += (w > 0) ? (size_t)w : 0;
     }
-    out[p] = '\0';
 }
 
-/* print malformed drop */
-static void print_malformed(const struct pcap_pkthdr *header, const char *src_ip, const char *dst_ip,
-                            uint16_t src_port, uint16_t dst_port, const char *proto_str, const char *reason,
-                            const u_char *payload, size_t payload_len) {
-    malformed_drops++;  /* Increment counter */
-    char tsbuf[64];
-    timestamp_to_str(header, tsbuf, sizeof(tsbuf));
-    char hexbuf[256];
-    hex_prefix_to_str(payload, payload_len, 24, hexbuf, sizeof(hexbuf));
-
-    printf("❌ [MALFORMED DROP] %s | %s:%u → %s:%u | proto=%s | reason=%s | payload=%s\n",
-           tsbuf, src_ip, (unsigned)src_port, dst_ip, (unsigned)dst_port, proto_str, reason, hexbuf);
+/* drop line detail, formatted by the droplog writer: u[0] reason bits */
+static int fmt_malformed(const droplog_event_t *e, char *out, size_t len) {
+    char why[256];
+    reasons_to_str(e->u[0], why, sizeof(why));
+    return snprintf(out, len, "proto=%s | reason=%s", mf_reasons[__builtin_ctz(e->u[0])].proto, why);
 }
 
-/* checksum calc (RFC 1071) */
-static uint16_t checksum_calc(const uint8_t *data, size_t len) {
-    uint32_t sum = 0;
-    const uint16_t *ptr = (const uint16_t *)data;
-    while (len > 1) {
-        sum += ntohs(*ptr++);
-        len -= 2;
-    }
-    if (len == 1) {
-        uint8_t last = *((const uint8_t *)ptr);
-        sum += (uint32_t)last << 8;
+/* log malformed drop: endpoints, proto and payload of the first reason's layer */
+static void log_malformed(const struct pcap_pkthdr *header, const u_char *packet, const mf_view_t *v, uint32_t bits) {
+    const int first = __builtin_ctz(bits);
+    droplog_event_t *e = droplog_begin(DL_STAGE_MALFORMED, header, NULL, mf_reasons[first].name, fmt_malformed);
+    if (!e) return;
+    if (v->ip) {
+        e->flags = 0;
+        e->src_ip = ntohl(v->ip->ip_src.s_addr);
+        e->dst_ip = ntohl(v->ip->ip_dst.s_addr);
+        e->proto = v->ip->ip_p;
     }
-    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
-    return (uint16_t)(~sum & 0xffff);
+    e->src_port = v->sport;
+    e->dst_port = v->dport;
+    e->u[0] = bits;
+    const u_char *payload = packet;
+    size_t payload_len = header->caplen;
+    if (mf_reasons[first].layer == MF_LAYER_IP && v->ip) { payload = (const u_char *)v->ip; payload_len = v->ip_cap; }
+    if (mf_reasons[first].layer == MF_LAYER_L4 && v->l4) { payload = v->l4; payload_len = v->l4_cap; }
+    droplog_payload(e, payload, payload_len);
+    droplog_commit(e);
+}
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
 }
 
-/* ip checksum verify (best-effort) */
-static bool ip_checksum_ok(const struct ip *ip_hdr) {
+/* In-place verify (checksum field included, sums to 0xffff) with cost accounting */
+static bool csum_verify(int w, mf_cs_t p, uint64_t seed, const void *buf, size_t len) {
+    mf_cs_cost_t *c = &mf_stats[w].cs[p];
+    uint64_t n = c->count;
+    WORKER_COUNTER_ADD(&c->count, 1);
+    WORKER_COUNTER_ADD(&c->bytes, len);
+    if (n % MF_CS_SAMPLE) return csum_fold(csum_partial(buf, len, seed)) == 0xffff;
+    uint64_t t0 = mono_ns();
+    bool ok = csum_fold(csum_partial(buf, len, seed)) == 0xffff;
+    uint64_t dt = mono_ns() - t0;
+    WORKER_COUNTER_ADD(&c->timed_ns, dt > clock_overhead_ns ? dt - clock_overhead_ns : 0);
+    WORKER_COUNTER_ADD(&c->timed, 1);
+    return ok;
+}
+
+/* ip checksum verify */
+static bool ip_checksum_ok(const struct ip *ip_hdr, int w) {
     size_t ihl_bytes = (size_t)ip_hdr->ip_hl * 4;
     if (ihl_bytes < 20) return false;
-    uint8_t *buf = malloc(ihl_bytes);
-    if (!buf) return true; /* conservatively treat as OK if memory fails */
-    memcpy(buf, ip_hdr, ihl_bytes);
-    buf[10] = 0; buf[11] = 0;
-    uint16_t cs = checksum_calc(buf, ihl_bytes);
-    free(buf);
-    uint16_t orig = ntohs(ip_hdr->ip_sum);
-    return cs == orig;
+    return csum_verify(w, MF_CS_IP, 0, ip_hdr, ihl_bytes);
+}
+
+/* L4 length from the IP header, not caplen, so Ethernet padding of short
+ * frames is not summed; 0 if the capture is truncated (can't be checked) */
+static size_t l4_payload_len(const struct ip *ip_hdr, size_t l4_cap) {
+    size_t ihl_bytes = (size_t)ip_hdr->ip_hl * 4;
+    size_t total_len = ntohs(ip_hdr->ip_len);
+    if (total_len <= ihl_bytes || total_len - ihl_bytes > l4_cap) return 0;
+    return total_len - ihl_bytes;
 }
 
 /* basic tcp checksum check (best-effort, returns true if matches or cannot compute) */
-static bool tcp_checksum_ok(const struct ip *ip_hdr, const u_char *l4ptr, size_t l4_len) {
-    if (l4_len < sizeof(struct tcphdr)) return true;
-    uint16_t tcp_len = (uint16_t)l4_len;
-    size_t buf_len = 12 + tcp_len;
-    uint8_t *buf = malloc(buf_len);
-    if (!buf) return true;
-    /* pseudo header */
-    memcpy(buf + 0, &ip_hdr->ip_src.s_addr, 4);
-    memcpy(buf + 4, &ip_hdr->ip_dst.s_addr, 4);
-    buf[8] = 0;
-    buf[9] = ip_hdr->ip_p;
-    uint16_t tcp_len_be = htons(tcp_len);
-    memcpy(buf + 10, &tcp_len_be, 2);
-    memcpy(buf + 12, l4ptr, tcp_len);
-
-    /* compute offset of checksum field inside the TCP header within the constructed buffer */
-    size_t tcp_ckoff = 12 + offsetof(struct tcphdr, th_sum);
-    if (tcp_ckoff + 1 >= buf_len) { free(buf); return true; }
-    buf[tcp_ckoff] = 0; buf[tcp_ckoff+1] = 0;
-
-    uint16_t cs = checksum_calc(buf, buf_len);
-    const struct tcphdr *tcp = (const struct tcphdr *)l4ptr;
-    uint16_t orig = ntohs(tcp->th_sum);
-    free(buf);
-    return cs == orig;
+static bool tcp_checksum_ok(const struct ip *ip_hdr, const u_char *l4ptr, size_t l4_len, int w) {
+    size_t tcp_len = l4_payload_len(ip_hdr, l4_len);
+    if (tcp_len < sizeof(struct tcphdr)) return true;
+    uint64_t pseudo = csum_pseudo_v4(ip_hdr->ip_src.s_addr, ip_hdr->ip_dst.s_addr, IPPROTO_TCP, (uint16_t)tcp_len);
+    return csum_verify(w, MF_CS_TCP, pseudo, l4ptr, tcp_len);
 }
 
-/* fragmentation anomaly check */
-static bool fragmentation_anomaly(const struct ip *ip_hdr, const struct pcap_pkthdr *header, const u_char *packet) {
-    uint16_t ip_off = ntohs(ip_hdr->ip_off);
-    uint16_t frag_offset = ip_off & IP_OFFMASK;
-    uint16_t more_frags = ip_off & IP_MF;
-    if (frag_offset == 0 && !more_frags) return false;
-    size_t ip_hdr_len = (size_t)ip_hdr->ip_hl * 4;
-    size_t l4_offset = sizeof(struct ether_header) + ip_hdr_len;
-    if (header->caplen <= l4_offset) {
-        return true;
+/* TCP header checks on l4_len >= 20 captured bytes */
+static uint32_t scan_tcp(const struct ip *ip, const u_char *l4, size_t l4_len, bool whole, pkt_csum_t cs, int w) {
+    const struct tcphdr *tcp = (const struct tcphdr *)l4;
+    size_t th_off = (size_t)tcp->th_off * 4;
+    uint8_t flags = l4[13];
+    uint32_t bits = MF_IF(th_off < 20 || l4_len < th_off, MF_TCP_BAD_OFF)
+                  | MF_IF((flags & 0x03) == 0x03, MF_TCP_SYN_FIN);
+    if (th_off > 20 && l4_len >= th_off) {
+        tcp_opts_t o;
+        bits |= (uint32_t)tcp_options_parse(l4, th_off, &o) << MF_TCP_OPT_TRUNC;
     }
-    return false;
+    /* a first fragment holds only part of the segment: nothing to verify */
+    if (!whole) return bits;
+    if (cs == PKT_CSUM_NOT_READY) WORKER_COUNTER_ADD(&mf_stats[w].csum_offload, 1);
+    else if (cs == PKT_CSUM_VALID) WORKER_COUNTER_ADD(&mf_stats[w].csum_valid, 1);
+    else bits |= MF_IF(!tcp_checksum_ok(ip, l4, l4_len, w), MF_TCP_BAD_CSUM);
+    return bits;
 }
 
-/* initialize (no-op but kept for symmetry) */
-void malformed_init(void) {
-    /* nothing to init */
+/* UDP header checks on l4_len >= 8 captured bytes. The checksum covers
+ * uh_ulen bytes; 0 means the sender computed none (RFC 768), and a
+ * computed 0 is sent as 0xffff, which the in-place sum accepts as is. */
+static uint32_t scan_udp(const struct ip *ip, const u_char *l4, size_t l4_len, bool whole, pkt_csum_t cs, int w) {
+    const struct udphdr *udp = (const struct udphdr *)l4;
+    size_t udplen = ntohs(udp->uh_ulen), iplen = l4_payload_len(ip, l4_len);
+    /* l4_len includes link-layer padding: the IP payload length is the bound */
+    uint32_t bits = MF_IF(udplen < sizeof(struct udphdr) || (whole && (l4_len < udplen || (iplen && udplen > iplen))),
+                          MF_UDP_BAD_LEN);
+    if (!whole || bits || udplen > iplen) return bits;
+    if (udp->uh_sum == 0) WORKER_COUNTER_ADD(&mf_stats[w].udp_no_csum, 1);
+    else if (cs == PKT_CSUM_NOT_READY) WORKER_COUNTER_ADD(&mf_stats[w].csum_offload, 1);
+    else if (cs == PKT_CSUM_VALID) WORKER_COUNTER_ADD(&mf_stats[w].csum_valid, 1);
+    else {
+        uint64_t pseudo = csum_pseudo_v4(ip->ip_src.s_addr, ip->ip_dst.s_addr, IPPROTO_UDP, (uint16_t)udplen);
+        bits |= MF_IF(!csum_verify(w, MF_CS_UDP, pseudo, l4, udplen), MF_UDP_BAD_CSUM);
+    }
+    return bits;
 }
 
-/* main malformed test: returns true == malformed (drop), false == ok */
-bool is_malformed(const struct pcap_pkthdr *header, const u_char *packet) {
-    if (header->caplen < sizeof(struct ether_header)) {
-        print_malformed(header, "N/A", "N/A", 0, 0, "ETH", "too_short", packet, header->caplen);
-        return true;
-    }
+/* ICMP checks on l4_len >= 8 captured bytes: defined type/code, length
+ * fitting the type, checksum over the whole message (no pseudo header).
+ * Length and checksum need the unfragmented message. */
+static uint32_t scan_icmp(const struct ip *ip, const u_char *l4, size_t l4_len, bool whole, int w) {
+    uint8_t type = l4[0], code = l4[1];
+    uint8_t kind = type < ICMP_TYPES ? icmp_types[type].kind : 0;
+    uint32_t bits = kind == ICMP_K_DEPR ? MF_BIT(MF_ICMP_DEPRECATED)
+                  : MF_IF(!kind || code > 31 || !(icmp_types[type].codes & (1u << code)), MF_ICMP_BAD_TYPE);
+    if (!whole) return bits;
+    size_t len = ntohs(ip->ip_len) - (size_t)ip->ip_hl * 4;
+    bits |= MF_IF((kind == ICMP_K_ERROR && len < ICMP_ERROR_MIN) || (kind == ICMP_K_TSTAMP && len != 20),
+                  MF_ICMP_BAD_LEN);
+    size_t icmp_len = l4_payload_len(ip, l4_len);
+    if (icmp_len) bits |= MF_IF(!csum_verify(w, MF_CS_ICMP, 0, l4, icmp_len), MF_ICMP_BAD_CSUM);
+    return bits;
+}
 
+/* One pass, all checks: returns the anomaly bitmask and fills v */
+static uint32_t scan(const struct pcap_pkthdr *h, const u_char *packet, const pkt_meta_t *m, mf_view_t *v, int w) {
+    memset(v, 0, sizeof(*v));
+    size_t cap = h->caplen;
+    if (cap < sizeof(struct ether_header)) return MF_BIT(MF_ETH_SHORT);
     const struct ether_header *eth = (const struct ether_header *)packet;
-    uint16_t ethertype = ntohs(eth->ether_type);
-    if (ethertype != ETHERTYPE_IP) return false;
+    if (ntohs(eth->ether_type) != ETHERTYPE_IP) return 0;
 
-    if (header->caplen < sizeof(struct ether_header) + sizeof(struct ip)) {
-        print_malformed(header, "N/A", "N/A", 0, 0, "IP", "truncated_ip_hdr", packet + sizeof(struct ether_header), header->caplen - sizeof(struct ether_header));
-        return true;
-    }
+    v->ip_cap = cap - sizeof(struct ether_header);
+    if (v->ip_cap < sizeof(struct ip)) return MF_BIT(MF_IP_TRUNC_HDR);
+    const struct ip *ip = (const struct ip *)(packet + sizeof(struct ether_header));
+    v->ip = ip;
 
-    const struct ip *ip_hdr = (const struct ip *)(packet + sizeof(struct ether_header));
-    size_t ihl_bytes = (size_t)ip_hdr->ip_hl * 4;
-    if (ihl_bytes < 20) {
-        char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &ip_hdr->ip_src, src, sizeof(src));
-        inet_ntop(AF_INET, &ip_hdr->ip_dst, dst, sizeof(dst));
-        print_malformed(header, src, dst, 0, 0, "IP", "invalid_ihl", packet + sizeof(struct ether_header), header->caplen - sizeof(struct ether_header));
-        return true;
-    }
+    size_t ihl = (size_t)ip->ip_hl * 4, total = ntohs(ip->ip_len);
+    uint32_t bits = MF_IF(ihl < 20, MF_IP_BAD_IHL)
+                  | MF_IF(total < ihl || v->ip_cap < ihl, MF_IP_TRUNC_TOTAL);
+    if (bits) return bits;   /* header unusable: nothing past it can be located */
 
-    uint16_t total_len = ntohs(ip_hdr->ip_len);
-    size_t wire_ip_bytes = header->caplen - sizeof(struct ether_header);
-    if (total_len < ihl_bytes || wire_ip_bytes < ihl_bytes) {
-        char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &ip_hdr->ip_src, src, sizeof(src));
-        inet_ntop(AF_INET, &ip_hdr->ip_dst, dst, sizeof(dst));
-        print_malformed(header, src, dst, 0, 0, "IP", "truncated_total", packet + sizeof(struct ether_header), wire_ip_bytes);
-        return true;
+    uint16_t off = ntohs(ip->ip_off);
+    bool fragment = (off & (IP_OFFMASK | IP_MF)) != 0;
+    bool first = (off & IP_OFFMASK) == 0;
+    bits |= MF_IF(!ip_checksum_ok(ip, w), MF_IP_BAD_CSUM)
+          | MF_IF(fragment && v->ip_cap <= ihl, MF_IP_FRAG_ANOMALY);
+    if (m && (m->frag & PKT_FRAG_ANOMALY)) {
+        bits |= MF_IF(m->frag & PKT_FRAG_OVERLAP, MF_FRAG_OVERLAP)
+              | MF_IF(m->frag & PKT_FRAG_OVERSIZE, MF_FRAG_OVERSIZE)
+              | MF_IF(m->frag & PKT_FRAG_TOO_MANY, MF_FRAG_TOO_MANY);
     }
 
-    if (!ip_checksum_ok(ip_hdr)) {
-        char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &ip_hdr->ip_src, src, sizeof(src));
-        inet_ntop(AF_INET, &ip_hdr->ip_dst, dst, sizeof(dst));
-        print_malformed(header, src, dst, 0, 0, "IP", "bad_checksum", packet + sizeof(struct ether_header), ihl_bytes);
-        return true;
+    /* L4 header only exists in the first fragment; later ones show the
+     * ports frag_track attributed to them */
+    if (!first && m && (m->frag & PKT_FRAG_ATTRIBUTED)) { v->sport = m->src_port; v->dport = m->dst_port; }
+    if (!first || v->ip_cap <= ihl) return bits;
+    v->l4 = (const u_char *)ip + ihl;
+    v->l4_cap = v->ip_cap - ihl;
+    pkt_csum_t cs = m ? (pkt_csum_t)m->csum : PKT_CSUM_UNKNOWN;
+
+    if (ip->ip_p == IPPROTO_TCP) {
+        if (v->l4_cap < sizeof(struct tcphdr)) return bits | MF_BIT(MF_TCP_TRUNC);
+        const struct tcphdr *tcp = (const struct tcphdr *)v->l4;
+        v->sport = ntohs(tcp->th_sport);
+        v->dport = ntohs(tcp->th_dport);
+        bits |= scan_tcp(ip, v->l4, v->l4_cap, !fragment, cs, w);
+    } else if (ip->ip_p == IPPROTO_UDP) {
+        if (v->l4_cap < sizeof(struct udphdr)) return bits | MF_BIT(MF_UDP_TRUNC);
+        const struct udphdr *udp = (const struct udphdr *)v->l4;
+        v->sport = ntohs(udp->uh_sport);
+        v->dport = ntohs(udp->uh_dport);
+        bits |= scan_udp(ip, v->l4, v->l4_cap, !fragment, cs, w);
+    } else if (ip->ip_p == IPPROTO_ICMP) {
+        if (v->l4_cap < ICMP_MINLEN) return bits | MF_BIT(MF_ICMP_TRUNC);
+        bits |= scan_icmp(ip, v->l4, v->l4_cap, !fragment, w);
     }
+    return bits;
+}
 
-    if (fragmentation_anomaly(ip_hdr, header, packet)) {
-        char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &ip_hdr->ip_src, src, sizeof(src));
-        inet_ntop(AF_INET, &ip_hdr->ip_dst, dst, sizeof(dst));
-        print_malformed(header, src, dst, 0, 0, "IP", "frag_anomaly", packet + sizeof(struct ether_header), header->caplen - sizeof(struct ether_header));
-        return true;
+/* initialize: pick the checksum kernel for this CPU */
+void malformed_init(void) {
+    checksum_init();
+    memset(mf_stats, 0, sizeof(mf_stats));
+    clock_overhead_ns = UINT64_MAX;
+    for (int i = 0; i < 64; ++i) {
+        uint64_t t0 = mono_ns(), dt = mono_ns() - t0;
+        if (dt < clock_overhead_ns) clock_overhead_ns = dt;
     }
+}
 
-    /* L4 examine */
-    size_t l4_offset = sizeof(struct ether_header) + ihl_bytes;
-    size_t l4_len = (header->caplen > l4_offset) ? (header->caplen - l4_offset) : 0;
-    const u_char *l4ptr = packet + l4_offset;
-    uint16_t src_port = 0, dst_port = 0;
-    if (ip_hdr->ip_p == IPPROTO_TCP) {
-        if (l4_len < sizeof(struct tcphdr)) {
-            char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &ip_hdr->ip_src, src, sizeof(src));
-            inet_ntop(AF_INET, &ip_hdr->ip_dst, dst, sizeof(dst));
-            print_malformed(header, src, dst, 0, 0, "TCP", "tcp_truncated", l4ptr, l4_len);
-            return true;
-        }
-        const struct tcphdr *tcp = (const struct tcphdr *)l4ptr;
-        src_port = ntohs(tcp->th_sport);
-        dst_port = ntohs(tcp->th_dport);
-        unsigned int th_off = (unsigned int)tcp->th_off * 4;
-        if (th_off < 20 || l4_len < th_off) {
-            char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &ip_hdr->ip_src, src, sizeof(src));
-            inet_ntop(AF_INET, &ip_hdr->ip_dst, dst, sizeof(dst));
-            print_malformed(header, src, dst, src_port, dst_port, "TCP", "tcp_off_invalid", l4ptr, l4_len);
-            return true;
-        }
-        /* flags sanity: SYN+FIN */
-        uint8_t flags = *((uint8_t *)tcp + 13);
-        if ((flags & 0x01) && (flags & 0x02)) {
-            char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &ip_hdr->ip_src, src, sizeof(src));
-            inet_ntop(AF_INET, &ip_hdr->ip_dst, dst, sizeof(dst));
-            print_malformed(header, src, dst, src_port, dst_port, "TCP", "syn_fin", l4ptr, l4_len);
-            return true;
-        }
-        if (!tcp_checksum_ok(ip_hdr, l4ptr, l4_len)) {
-            char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &ip_hdr->ip_src, src, sizeof(src));
-            inet_ntop(AF_INET, &ip_hdr->ip_dst, dst, sizeof(dst));
-            print_malformed(header, src, dst, src_port, dst_port, "TCP", "tcp_cksum_bad", l4ptr, l4_len);
-            return true;
-        }
-    } else if (ip_hdr->ip_p == IPPROTO_UDP) {
-        if (l4_len < sizeof(struct udphdr)) {
-            char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &ip_hdr->ip_src, src, sizeof(src));
-            inet_ntop(AF_INET, &ip_hdr->ip_dst, dst, sizeof(dst));
-            print_malformed(header, src, dst, 0, 0, "UDP", "udp_truncated", l4ptr, l4_len);
-            return true;
-        }
-        const struct udphdr *udp = (const struct udphdr *)l4ptr;
-        src_port = ntohs(udp->uh_sport);
-        dst_port = ntohs(udp->uh_dport);
-        uint16_t udplen = ntohs(udp->uh_ulen);
-        if (udplen < sizeof(struct udphdr) || l4_len < udplen) {
-            char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &ip_hdr->ip_src, src, sizeof(src));
-            inet_ntop(AF_INET, &ip_hdr->ip_dst, dst, sizeof(dst));
-            print_malformed(header, src, dst, src_port, dst_port, "UDP", "udp_len_invalid", l4ptr, l4_len);
-            return true;
-        }
+void malformed_set_drop_mask(uint32_t mask) {
+    drop_mask = mask & ((1u << MF_REASONS) - 1);
+}
+
+int malformed_parse_reasons(const char *list, uint32_t *mask) {
+    *mask = 0;
+    if (strcmp(list, "all") == 0) { *mask = (1u << MF_REASONS) - 1; return 0; }
+    if (strcmp(list, "none") == 0) return 0;
+    char buf[512];
+    snprintf(buf, sizeof(buf), "%s", list);
+    for (char *save = NULL, *t = strtok_r(buf, ",", &save); t; t = strtok_r(NULL, ",", &save)) {
+        int r = 0;
+        while (r < MF_REASONS && strcmp(t, mf_reasons[r].name) != 0) ++r;
+        if (r == MF_REASONS) return -1;
+        *mask |= MF_BIT(r);
     }
+    return 0;
+}
+
+/* main malformed test: returns true == malformed (drop), false == ok */
+bool is_malformed(const struct pcap_pkthdr *header, const u_char *packet, const pkt_meta_t *m) {
+    int w = worker_id();
+    mf_view_t v;
+    uint32_t bits = scan(header, packet, m, &v, w);
+    if (!bits) return false;
 
-    return false; /* passed checks */
+    for (uint32_t b = bits; b; b &= b - 1) WORKER_COUNTER_ADD(&mf_stats[w].reason[__builtin_ctz(b)], 1);
+    if (!(bits & drop_mask)) {
+        WORKER_COUNTER_ADD(&mf_stats[w].passed, 1);
+        dropcap_note(header, "MALFORMED", mf_reasons[__builtin_ctz(bits)].name, false);
+        return false;
+    }
+    WORKER_COUNTER_ADD(&mf_stats[w].dropped, 1);
+    log_malformed(header, packet, &v, bits);
+    return true;
 }
 
 /* Report malformed statistics */
 void malformed_report(void) {
+    uint64_t dropped = 0, passed = 0, offload = 0, valid = 0, no_csum = 0, reason[MF_REASONS] = {0};
+    mf_cs_cost_t cs[MF_CS_PROTOS] = {{0}};
+    for (int w = 0; w < worker_count(); ++w) {
+        dropped += WORKER_COUNTER_READ(&mf_stats[w].dropped);
+        passed  += WORKER_COUNTER_READ(&mf_stats[w].passed);
+        offload += WORKER_COUNTER_READ(&mf_stats[w].csum_offload);
+        valid   += WORKER_COUNTER_READ(&mf_stats[w].csum_valid);
+        no_csum += WORKER_COUNTER_READ(&mf_stats[w].udp_no_csum);
+        for (int r = 0; r < MF_REASONS; ++r) reason[r] += WORKER_COUNTER_READ(&mf_stats[w].reason[r]);
+        for (int p = 0; p < MF_CS_PROTOS; ++p) {
+            const mf_cs_cost_t *c = &mf_stats[w].cs[p];
+            cs[p].count       += WORKER_COUNTER_READ(&c->count);
+            cs[p].bytes       += WORKER_COUNTER_READ(&c->bytes);
+            cs[p].timed       += WORKER_COUNTER_READ(&c->timed);
+            cs[p].timed_ns    += WORKER_COUNTER_READ(&c->timed_ns);
+        }
+    }
     printf("\n📊 [MALFORMED STATISTICS]\n");
-    printf("   Malformed packets detected: %d\n", malformed_drops);
+    printf("   Malformed packets detected: %" PRIu64 " (dropped %" PRIu64 ", passed by drop mask %" PRIu64 ")\n",
+           dropped + passed, dropped, passed);
+    for (int r = 0; r < MF_REASONS; ++r) {
+        if (!reason[r]) continue;
+        printf("   %-20s %" PRIu64 "%s\n", mf_reasons[r].name, reason[r], (drop_mask & MF_BIT(r)) ? "" : " (not dropped)");
+    }
+    printf("   L4 checksums not verified: %" PRIu64 " offload-pending (outgoing), %" PRIu64 " already valid, %" PRIu64 " UDP without checksum\n",
+           offload, valid, no_csum);
+    /* cost per protocol; ns figures are from the 1-in-MF_CS_SAMPLE timed verifications */
+    printf("   Checksum cost (%s kernel):\n", checksum_impl_name(checksum_get_impl()));
+    for (int p = 0; p < MF_CS_PROTOS; ++p) {
+        if (!cs[p].count) continue;
+        double ns = cs[p].timed ? (double)cs[p].timed_ns / (double)cs[p].timed : 0.0;
+        printf("     %-12s %10" PRIu64 " verified, %8.1f KiB, ~%.0f ns each, ~%.3f ms total\n",
+               mf_cs_names[p], cs[p].count, (double)cs[p].bytes / 1024.0, ns,
+               ns * (double)cs[p].count / 1e6);
+    }
 }
-
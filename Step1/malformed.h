@@ -3,17 +3,70 @@
 
 #include <pcap.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include "packet.h"
+
+/* Anomaly bits computed by is_malformed's single pass (bit = 1u << reason) */
+typedef enum {
+    MF_ETH_SHORT = 0,
+    MF_IP_TRUNC_HDR,
+    MF_IP_BAD_IHL,
+    MF_IP_TRUNC_TOTAL,
+    MF_IP_BAD_CSUM,
+    MF_IP_FRAG_ANOMALY,
+    MF_FRAG_OVERLAP,
+    MF_FRAG_OVERSIZE,
+    MF_FRAG_TOO_MANY,
+    MF_TCP_TRUNC,
+    MF_TCP_BAD_OFF,
+    MF_TCP_SYN_FIN,
+    MF_TCP_BAD_CSUM,
+    MF_TCP_OPT_TRUNC,          /* tcp_opt_* follow TOPT_A_* bit order */
+    MF_TCP_OPT_BAD_LEN,
+    MF_TCP_OPT_BAD_VALUE,
+    MF_TCP_OPT_DUP,
+    MF_TCP_OPT_SYN_ONLY,
+    MF_UDP_TRUNC,
+    MF_UDP_BAD_LEN,
+    MF_UDP_BAD_CSUM,
+    MF_ICMP_TRUNC,
+    MF_ICMP_BAD_TYPE,
+    MF_ICMP_DEPRECATED,
+    MF_ICMP_BAD_LEN,
+    MF_ICMP_BAD_CSUM,
+    MF_REASONS
+} mf_reason_t;
+
+/* Drop mask unless -M says otherwise: every reason except what stacks
+ * tolerate (repeated options, SYN options without SYN, option values they
+ * clamp such as wscale > 14) and ICMP types that are only deprecated */
+#define MF_DEFAULT_OPT_IN ((1u << MF_TCP_OPT_BAD_VALUE) | (1u << MF_TCP_OPT_DUP) | \
+                           (1u << MF_TCP_OPT_SYN_ONLY) | (1u << MF_ICMP_DEPRECATED))
+#define MF_DEFAULT_DROP   (((1u << MF_REASONS) - 1) & ~MF_DEFAULT_OPT_IN)
 
 /* existing API */
 void malformed_init(void);
-bool is_malformed(const struct pcap_pkthdr *h, const u_char *bytes);
+
+/* Reasons that drop (default MF_DEFAULT_DROP); other anomalies are counted and passed */
+void malformed_set_drop_mask(uint32_t mask);
+/* "all", "none" or a comma list of reason names (e.g. "syn_fin,tcp_cksum_bad");
+ * 0 on success, -1 on an unknown name */
+int malformed_parse_reasons(const char *list, uint32_t *mask);
+/* m (may be NULL) carries the capture path's checksum status: L4 checksums
+ * marked not-ready (TX offload) or already valid are not recomputed; its
+ * frag_track anomaly bits map to the frag_* reasons */
+bool is_malformed(const struct pcap_pkthdr *h, const u_char *bytes, const pkt_meta_t *m);
 
 /* report statistics */
 void malformed_report(void);
 
-/* new: log a malformed packet (thread-safe append to malformed.csv).
-   Implementation provided in malformed_log.c below. */
+/* malformed.csv logger (malformed_log.c): init starts the group-commit
+ * flusher, shutdown commits what is pending and publishes the segment */
+void malformed_log_init(void);
+void malformed_log_shutdown(void);
+/* log a malformed packet: buffered, written and fsynced in batches */
 void malformed_log_packet(const struct pcap_pkthdr *h, const u_char *bytes);
+void malformed_log_report(void);
 
 #endif /* MALFORMED_H */
 
@@ -1,7 +1,21 @@
 /* malformed_log.c
  *
- * Simple thread-safe appender for malformed packets.
+ * Group-commit appender for malformed packets.
  * Each line: timestamp (ISO), caplen, payload_hex (first N bytes)
+ *
+ * malformed_log_packet formats the line on the calling thread and copies it
+ * into the active buffer under a mutex; nothing else happens on the capture
+ * path (a full buffer drops the record and counts it). A flusher thread
+ * swaps the two buffers and writes + fsyncs the spare one outside the lock,
+ * at most every MLOG_COMMIT_MS, sooner once MLOG_COMMIT_RECORDS records are
+ * pending: one fsync covers every record of the batch.
+ *
+ * The open segment is malformed.csv.tmp. It is rotated once it would pass
+ * MLOG_SEGMENT_BYTES or is MLOG_SEGMENT_SECS old: fsynced, closed and
+ * renamed to malformed-<UTC start>.csv (the rename, followed by an fsync of
+ * the directory, is the atomic publish: a published segment is always
+ * complete). The last MLOG_KEEP segments of a run are kept. A segment left
+ * behind by a crash is published at the next start.
  */
 
 #define _POSIX_C_SOURCE 200809L
@@ -10,27 +24,49 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <time.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <pcap.h>
 
+#define MLOG_ACTIVE          "malformed.csv.tmp"
+#define MLOG_HEADER          "timestamp,caplen,payload_preview\n"
+#define MLOG_BUF_BYTES       (1u << 20)     /* per buffer, two buffers (~7500 records) */
+#define MLOG_COMMIT_MS       200
+#define MLOG_COMMIT_RECORDS  512
+#define MLOG_SEGMENT_BYTES   (16u << 20)
+#define MLOG_SEGMENT_SECS    3600
+#define MLOG_KEEP            8
+#define MLOG_PREVIEW         32
+
+typedef struct {
+    char *data;
+    size_t len;
+    uint32_t records;
+} mlog_buf_t;
+
 static pthread_mutex_t malformed_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t malformed_cond = PTHREAD_COND_INITIALIZER;
+static mlog_buf_t active, spare;
+static pthread_t flusher;
+static bool running, stopping;
 
-/* hex dump of up to N bytes into buf (buf must be at least 3*N+1) */
-static void hexdump_prefix(const u_char *bytes, size_t n, char *buf, size_t bufsz) {
-    size_t pos = 0;
-    for (size_t i = 0; i < n && pos + 3 < bufsz; ++i) {
-        int wrote = snprintf(buf + pos, bufsz - pos, "%02x ", bytes[i]);
-        if (wrote < 0) break;
-        pos += (size_t)wrote;
-    }
-    if (pos > 0 && pos < bufsz) buf[pos - 1] = '\0'; /* remove trailing space */
-    else if (pos < bufsz) buf[pos] = '\0';
-}
+/* open segment (flusher thread only) */
+static int seg_fd = -1;
+static size_t seg_bytes;
+static time_t seg_start;
+static char published[MLOG_KEEP][64];
+static int published_n;
+
+/* stats: dropped under the lock, the rest flusher only */
+static uint64_t dropped, written, commits, segments, write_errors;
 
 /* timestamp ISO */
 static void format_ts_iso(const struct pcap_pkthdr *h, char *out, size_t outlen) {
@@ -43,45 +79,187 @@ static void format_ts_iso(const struct pcap_pkthdr *h, char *out, size_t outlen)
              (unsigned)h->ts.tv_usec);
 }
 
+static int write_all(int fd, const char *p, size_t n) {
+    while (n) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+static void fsync_dir(void) {
+    int d = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (d >= 0) { fsync(d); close(d); }
+}
+
+/* Rename the (closed, fsynced) active segment to its final name */
+static void publish(time_t start) {
+    struct tm tm;
+    char base[32], name[64];
+    gmtime_r(&start, &tm);
+    strftime(base, sizeof(base), "%Y%m%dT%H%M%SZ", &tm);
+    snprintf(name, sizeof(name), "malformed-%s.csv", base);
+    for (int i = 1; access(name, F_OK) == 0 && i < 1000; ++i)
+        snprintf(name, sizeof(name), "malformed-%s-%d.csv", base, i);
+    if (rename(MLOG_ACTIVE, name) != 0) {
+        fprintf(stderr, "[malformed_log] rename to %s failed: %s\n", name, strerror(errno));
+        return;
+    }
+    fsync_dir();
+    ++segments;
+    if (published_n == MLOG_KEEP) {
+        unlink(published[0]);
+        memmove(published[0], published[1], sizeof(published[0]) * (MLOG_KEEP - 1));
+        --published_n;
+    }
+    snprintf(published[published_n++], sizeof(published[0]), "%s", name);
+}
+
+static void segment_close(void) {
+    if (seg_fd < 0) return;
+    fsync(seg_fd);
+    close(seg_fd);
+    seg_fd = -1;
+    publish(seg_start);
+}
+
+static bool segment_open(void) {
+    seg_fd = open(MLOG_ACTIVE, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (seg_fd < 0) {
+        fprintf(stderr, "[malformed_log] open %s failed: %s\n", MLOG_ACTIVE, strerror(errno));
+        return false;
+    }
+    seg_start = time(NULL);
+    seg_bytes = 0;
+    if (write_all(seg_fd, MLOG_HEADER, sizeof(MLOG_HEADER) - 1) == 0) seg_bytes = sizeof(MLOG_HEADER) - 1;
+    return true;
+}
+
+/* Write one batch, rotating first if it would overflow the segment; one fsync */
+static void commit(const mlog_buf_t *b) {
+    if (seg_fd >= 0 && seg_bytes + b->len > MLOG_SEGMENT_BYTES) segment_close();
+    if (seg_fd < 0 && !segment_open()) { write_errors += b->records; return; }
+    if (write_all(seg_fd, b->data, b->len) != 0) {
+        fprintf(stderr, "[malformed_log] write failed: %s\n", strerror(errno));
+        write_errors += b->records;
+        return;
+    }
+    fdatasync(seg_fd);
+    seg_bytes += b->len;
+    written += b->records;
+    ++commits;
+}
+
+static void *flusher_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&malformed_lock);
+    for (;;) {
+        if (!stopping && active.records < MLOG_COMMIT_RECORDS) {
+            struct timespec dl;
+            clock_gettime(CLOCK_REALTIME, &dl);
+            dl.tv_nsec += MLOG_COMMIT_MS * 1000000L;
+            if (dl.tv_nsec >= 1000000000L) { dl.tv_sec++; dl.tv_nsec -= 1000000000L; }
+            pthread_cond_timedwait(&malformed_cond, &malformed_lock, &dl);
+        }
+        bool last = stopping;
+        mlog_buf_t b = active;
+        active = spare;
+        active.len = 0;
+        active.records = 0;
+        pthread_mutex_unlock(&malformed_lock);
+
+        if (b.len) commit(&b);
+        if (seg_fd >= 0 && time(NULL) - seg_start >= MLOG_SEGMENT_SECS) segment_close();
+
+        pthread_mutex_lock(&malformed_lock);
+        spare = b;
+        if (last) break;
+    }
+    pthread_mutex_unlock(&malformed_lock);
+    segment_close();
+    return NULL;
+}
+
+void malformed_log_init(void) {
+    if (running) return;
+    /* a segment left by a crash holds everything that was fsynced: publish it */
+    struct stat st;
+    if (stat(MLOG_ACTIVE, &st) == 0) publish(st.st_mtime);
+    active.data = malloc(MLOG_BUF_BYTES);
+    spare.data = malloc(MLOG_BUF_BYTES);
+    if (!active.data || !spare.data) {
+        fprintf(stderr, "[malformed_log] out of memory, malformed.csv disabled\n");
+        free(active.data); free(spare.data);
+        active.data = spare.data = NULL;
+        return;
+    }
+    active.len = spare.len = 0;
+    active.records = spare.records = 0;
+    stopping = false;
+    if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+        fprintf(stderr, "[malformed_log] no flusher thread, malformed.csv disabled\n");
+        return;
+    }
+    running = true;
+}
+
+void malformed_log_shutdown(void) {
+    if (!running) return;
+    pthread_mutex_lock(&malformed_lock);
+    stopping = true;
+    pthread_cond_signal(&malformed_cond);
+    pthread_mutex_unlock(&malformed_lock);
+    pthread_join(flusher, NULL);
+    running = false;
+    free(active.data); free(spare.data);
+    active.data = spare.data = NULL;
+}
+
 /* Append one line describing the malformed packet.
    Fields: timestamp, caplen, first_payload_hex */
 void malformed_log_packet(const struct pcap_pkthdr *h, const u_char *bytes) {
+    static const char hexd[] = "0123456789abcdef";
     if (!h || !bytes) return;
 
+    char line[64 + 3 * MLOG_PREVIEW + 8];
     char ts[64];
     format_ts_iso(h, ts, sizeof(ts));
+    int n = snprintf(line, sizeof(line), "%s,%u,\"", ts, (unsigned)h->caplen);
+    if (n < 0) return;
+    size_t p = (size_t)n;
 
     /* keep small payload preview */
-    const size_t PREVIEW = 32;
-    char hexbuf[3 * (PREVIEW + 1)];
-    size_t to_copy = h->caplen < PREVIEW ? h->caplen : PREVIEW;
-    hexdump_prefix(bytes, to_copy, hexbuf, sizeof(hexbuf));
-
-    /* open, append, flush, fsync */
-    pthread_mutex_lock(&malformed_lock);
-
-    FILE *f = fopen("malformed.csv.tmp", "a");
-    if (!f) {
-        /* try to create new file with header */
-        f = fopen("malformed.csv.tmp", "w");
-        if (!f) {
-            fprintf(stderr, "[malformed_log] fopen failed: %s\n", strerror(errno));
-            pthread_mutex_unlock(&malformed_lock);
-            return;
-        }
-        fprintf(f, "timestamp,caplen,payload_preview\n");
+    size_t to_copy = h->caplen < MLOG_PREVIEW ? h->caplen : MLOG_PREVIEW;
+    for (size_t i = 0; i < to_copy; ++i) {
+        if (i) line[p++] = ' ';
+        line[p++] = hexd[bytes[i] >> 4];
+        line[p++] = hexd[bytes[i] & 15];
     }
+    line[p++] = '"';
+    line[p++] = '\n';
 
-    if (f) {
-        fprintf(f, "%s,%u,\"%s\"\n", ts, (unsigned)h->caplen, hexbuf);
-        fflush(f);
-        int fd = fileno(f);
-        if (fd >= 0) fsync(fd);
-        fclose(f);
+    pthread_mutex_lock(&malformed_lock);
+    if (!running || active.len + p > MLOG_BUF_BYTES) {
+        ++dropped;
+    } else {
+        memcpy(active.data + active.len, line, p);
+        active.len += p;
+        if (++active.records == MLOG_COMMIT_RECORDS) pthread_cond_signal(&malformed_cond);
     }
-    /* rename to final file (idempotent) */
-    rename("malformed.csv.tmp", "malformed.csv");
-
     pthread_mutex_unlock(&malformed_lock);
 }
 
+void malformed_log_report(void) {
+    if (written + dropped + write_errors == 0) return;
+    printf("\n📊 [MALFORMED LOG STATISTICS]\n");
+    printf("   Records: %" PRIu64 " written in %" PRIu64 " commit(s) (%.1f per fsync), %" PRIu64 " segment(s) published\n",
+           written, commits, commits ? (double)written / (double)commits : 0.0, segments);
+    if (dropped + write_errors)
+        printf("   Lost: %" PRIu64 " (buffer full or logger not running), %" PRIu64 " (write errors)\n",
+               dropped, write_errors);
+}
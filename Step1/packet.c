@@ -0,0 +1,78 @@
+/*
+ * packet.c
+ * One-time Ethernet/IPv4/L4 header parse shared by the filter stages.
+ */
+
+#include "packet.h"
+#include "checksum.h"
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <net/ethernet.h>
+
+#define PACKET_MAX_LOCAL 64
+
+static uint32_t local_addrs[PACKET_MAX_LOCAL];
+static size_t local_count = 0;
+
+void packet_set_local_addrs(const uint32_t *ips, size_t n) {
+    if (n > PACKET_MAX_LOCAL) n = PACKET_MAX_LOCAL;
+    memcpy(local_addrs, ips, n * sizeof(*ips));
+    local_count = n;
+}
+
+bool packet_is_local(uint32_t ip) {
+    for (size_t i = 0; i < local_count; ++i) if (local_addrs[i] == ip) return true;
+    return false;
+}
+
+/* Outgoing TCP/UDP with checksum offload carries the folded pseudo-header
+ * sum (not complemented) in its checksum field until the NIC finishes it.
+ * Costs one comparison, no pass over the payload. */
+static pkt_csum_t l4_csum_status(const struct ip *ip, uint16_t field, uint32_t src_host) {
+    if (local_count == 0 || !packet_is_local(src_host)) return PKT_CSUM_UNKNOWN;
+    size_t ihl = (size_t)ip->ip_hl * 4, total = ntohs(ip->ip_len);
+    if (total < ihl) return PKT_CSUM_UNKNOWN;
+    uint16_t pseudo = csum_fold(csum_pseudo_v4(ip->ip_src.s_addr, ip->ip_dst.s_addr, ip->ip_p, (uint16_t)(total - ihl)));
+    return field == pseudo ? PKT_CSUM_NOT_READY : PKT_CSUM_UNKNOWN;
+}
+
+bool packet_parse(const struct pcap_pkthdr *h, const u_char *bytes, pkt_meta_t *m) {
+    memset(m, 0, sizeof(*m));
+    if (h->caplen < sizeof(struct ether_header) + sizeof(struct ip)) return false;
+
+    const struct ether_header *eth = (const struct ether_header *)bytes;
+    if (ntohs(eth->ether_type) != ETHERTYPE_IP) return false;
+
+    const struct ip *ip = (const struct ip *)(bytes + sizeof(struct ether_header));
+    m->is_ipv4 = true;
+    m->ip = ip;
+    m->ip_hdr_len = (size_t)ip->ip_hl * 4;
+    m->src_ip = ntohl(ip->ip_src.s_addr);
+    m->dst_ip = ntohl(ip->ip_dst.s_addr);
+    m->proto = ip->ip_p;
+
+    uint16_t off = ntohs(ip->ip_off);
+    if (off & IP_OFFMASK) { m->frag = PKT_FRAG_LATER; return true; }
+    if (off & IP_MF) m->frag = PKT_FRAG_FIRST;
+
+    size_t l4_off = sizeof(struct ether_header) + m->ip_hdr_len;
+    if (m->ip_hdr_len < 20 || h->caplen <= l4_off) return true;
+    m->l4 = bytes + l4_off;
+    m->l4_len = h->caplen - l4_off;
+
+    if (m->proto == IPPROTO_TCP && m->l4_len >= sizeof(struct tcphdr)) {
+        const struct tcphdr *tcp = (const struct tcphdr *)m->l4;
+        m->src_port = ntohs(tcp->th_sport);
+        m->dst_port = ntohs(tcp->th_dport);
+        m->tcp_flags = m->l4[13];
+        m->csum = (uint8_t)l4_csum_status(ip, tcp->th_sum, m->src_ip);
+    } else if (m->proto == IPPROTO_UDP && m->l4_len >= sizeof(struct udphdr)) {
+        const struct udphdr *udp = (const struct udphdr *)m->l4;
+        m->src_port = ntohs(udp->uh_sport);
+        m->dst_port = ntohs(udp->uh_dport);
+        m->csum = (uint8_t)l4_csum_status(ip, udp->uh_sum, m->src_ip);
+    }
+    return true;
+}
@@ -0,0 +1,68 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <pcap.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/ip.h>
+
+/* What the capture path knows about the L4 checksum. TPACKET reports
+ * TP_STATUS_CSUMNOTREADY / TP_STATUS_CSUM_VALID, but libpcap does not pass
+ * them on, so packet_parse infers the first: a TCP/UDP packet from a local
+ * address whose checksum field holds exactly the folded pseudo-header sum
+ * was captured before the NIC filled it in (TX offload). VALID is for a
+ * backend that sees the kernel's RX verdict; the pcap path never sets it. */
+typedef enum {
+    PKT_CSUM_UNKNOWN   = 0,    /* verify in software */
+    PKT_CSUM_NOT_READY = 1,    /* partial, finalized by the NIC later */
+    PKT_CSUM_VALID     = 2     /* already verified by the kernel / NIC */
+} pkt_csum_t;
+
+/* Header fields parsed once per packet in pcap_callback and handed to the
+ * stages that work on the 5-tuple. */
+typedef struct {
+    bool is_ipv4;              /* false: nothing below is valid */
+    const struct ip *ip;
+    size_t ip_hdr_len;
+    const u_char *l4;          /* NULL if the IP header runs past caplen */
+    size_t l4_len;             /* captured L4 bytes */
+    uint32_t src_ip, dst_ip;   /* host byte order */
+    uint16_t src_port, dst_port;
+    uint8_t proto;
+    uint8_t tcp_flags;         /* 0 unless TCP */
+    uint8_t csum;              /* pkt_csum_t of the L4 checksum */
+    uint8_t frag;              /* PKT_FRAG_* bits, 0 if not a fragment */
+    uint8_t spoof_suspect;     /* TTL off its source /24's hop count (hopcount.c) */
+} pkt_meta_t;
+
+/* pkt_meta_t.frag: the position bits come from packet_parse, the rest from
+ * frag_track. A later fragment has no L4 header (l4 NULL, ports 0) until
+ * frag_track attributes it to its datagram's first fragment. */
+#define PKT_FRAG_FIRST      0x01   /* offset 0, MF set */
+#define PKT_FRAG_LATER      0x02   /* offset > 0 */
+#define PKT_FRAG_ATTRIBUTED 0x04   /* ports/flags copied from the first fragment */
+#define PKT_FRAG_OVERLAP    0x10
+#define PKT_FRAG_OVERSIZE   0x20
+#define PKT_FRAG_TOO_MANY   0x40
+#define PKT_FRAG_ANOMALY    (PKT_FRAG_OVERLAP | PKT_FRAG_OVERSIZE | PKT_FRAG_TOO_MANY)
+
+/* TCP flag bits as they appear in byte 13 of the header */
+#define PKT_TCP_FIN 0x01
+#define PKT_TCP_SYN 0x02
+#define PKT_TCP_RST 0x04
+#define PKT_TCP_PSH 0x08
+#define PKT_TCP_ACK 0x10
+#define PKT_TCP_URG 0x20
+#define PKT_TCP_ECE 0x40
+#define PKT_TCP_CWR 0x80
+
+/* Local IPv4 addresses (host byte order) for checksum-offload detection */
+void packet_set_local_addrs(const uint32_t *ips, size_t n);
+/* One of those addresses (host byte order) */
+bool packet_is_local(uint32_t ip);
+
+/* Fill m from an Ethernet frame; returns m->is_ipv4 */
+bool packet_parse(const struct pcap_pkthdr *h, const u_char *bytes, pkt_meta_t *m);
+
+#endif /* PACKET_H */
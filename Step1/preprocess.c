@@ -5,6 +5,7 @@
  */
 
 #include "preprocess.h"
+#include "tcpopt.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -55,6 +56,15 @@ typedef struct {
     /* Additional metrics */
     uint32_t unique_seq_numbers; /* Approximate uniqueness */
     uint32_t retransmissions;     /* Potential retransmission count */
+
+    /* TCP options: MSS/window scale/layout from the first SYN that carries
+     * them (stack fingerprint), timestamps from the latest packet */
+    uint16_t mss;                 /* 0 = not seen */
+    int16_t wscale;               /* -1 = not seen */
+    uint8_t sack_perm;
+    uint32_t ts_val, ts_ecr;
+    char opt_layout[TOPT_LAYOUT_MAX + 1];
+    uint32_t opt_anomalies;       /* packets with malformed/odd options */
 } interaction_t;
 
 #define MAX_INTERACTIONS 1024
@@ -101,6 +111,13 @@ static interaction_t *get_or_create_interaction(const char *src_ip, const char *
     /* Initialize additional metrics */
     ia->unique_seq_numbers = 0;
     ia->retransmissions = 0;
+
+    ia->mss = 0;
+    ia->wscale = -1;
+    ia->sack_perm = 0;
+    ia->ts_val = ia->ts_ecr = 0;
+    ia->opt_layout[0] = '\0';
+    ia->opt_anomalies = 0;
     
     ia->first_ts = *ts;
     ia->last_ts = *ts;
@@ -108,7 +125,8 @@ static interaction_t *get_or_create_interaction(const char *src_ip, const char *
 }
 
 static void update_interaction_with_packet(interaction_t *ia, int direction_src_to_dst, uint32_t pkt_wire_len,
-                                           const struct timeval *ts, const struct tcphdr *tcp) {
+                                           const struct timeval *ts, const struct tcphdr *tcp,
+                                           const tcp_opts_t *opts) {
     if (direction_src_to_dst) {
         ia->bytes_sent += pkt_wire_len;
         ia->pkts_sent += 1;
@@ -131,6 +149,18 @@ static void update_interaction_with_packet(interaction_t *ia, int direction_src_
         if (flags & 0x04) ia->rst_count++;  /* RST */
         if (flags & 0x08) ia->psh_count++;  /* PSH */
     }
+
+    /* TCP options, when the header has any */
+    if (opts) {
+        if (opts->anomalies) ia->opt_anomalies++;
+        if (opts->present & TOPT_HAVE_TS) { ia->ts_val = opts->ts_val; ia->ts_ecr = opts->ts_ecr; }
+        if ((*((const uint8_t *)tcp + 13) & 0x02) && ia->opt_layout[0] == '\0') {
+            if (opts->present & TOPT_HAVE_MSS) ia->mss = opts->mss;
+            if (opts->present & TOPT_HAVE_WSCALE) ia->wscale = opts->wscale;
+            ia->sack_perm = (opts->present & TOPT_HAVE_SACKOK) != 0;
+            memcpy(ia->opt_layout, opts->layout, sizeof(ia->opt_layout));
+        }
+    }
     
     if (timercmp(ts, &ia->first_ts, <)) ia->first_ts = *ts;
     if (timercmp(ts, &ia->last_ts, >)) ia->last_ts = *ts;
@@ -175,11 +205,17 @@ void process_packet(const struct pcap_pkthdr *header, const u_char *packet) {
 
     uint16_t src_port = 0, dst_port = 0;
     const struct tcphdr *tcp_hdr = NULL;
+    tcp_opts_t opts, *tcp_opts = NULL;
     
     if (proto == IPPROTO_TCP && l4_len >= sizeof(struct tcphdr)) {
         tcp_hdr = (const struct tcphdr *)l4;
         src_port = ntohs(tcp_hdr->th_sport);
         dst_port = ntohs(tcp_hdr->th_dport);
+        size_t th_off = (size_t)tcp_hdr->th_off * 4;
+        if (th_off > sizeof(struct tcphdr) && l4_len >= th_off) {
+            tcp_options_parse(l4, th_off, &opts);
+            tcp_opts = &opts;
+        }
     } else if (proto == IPPROTO_UDP && l4_len >= sizeof(struct udphdr)) {
         const struct udphdr *udp = (const struct udphdr *)l4;
         src_port = ntohs(udp->uh_sport);
@@ -209,9 +245,9 @@ void process_packet(const struct pcap_pkthdr *header, const u_char *packet) {
 
     if (!ia) {
         ia = get_or_create_interaction(src_ip, dst_ip, src_port, dst_port, proto, &header->ts);
-        if (ia) update_interaction_with_packet(ia, 1, header->len, &header->ts, tcp_hdr);
+        if (ia) update_interaction_with_packet(ia, 1, header->len, &header->ts, tcp_hdr, tcp_opts);
     } else {
-        update_interaction_with_packet(ia, direction_src_to_dst, header->len, &header->ts, tcp_hdr);
+        update_interaction_with_packet(ia, direction_src_to_dst, header->len, &header->ts, tcp_hdr, tcp_opts);
     }
 }
 
@@ -230,7 +266,8 @@ void report_and_reset(void) {
                    "syn_count,ack_count,fin_count,rst_count,psh_count,"
                    "syn_ack_ratio,syn_fin_ratio,"
                    "min_pkt_size,max_pkt_size,"
-                   "total_packets,total_bytes\n");
+                   "total_packets,total_bytes,"
+                   "mss,wscale,sack_perm,ts_val,ts_ecr,tcp_opt_layout,tcp_opt_anomalies\n");
     } else {
         fprintf(stderr, "Warning: couldn't open %s: %s\n", fname, strerror(errno));
     }
@@ -265,7 +302,8 @@ void report_and_reset(void) {
                        "%u,%u,%u,%u,%u,"
                        "%.3f,%.3f,"
                        "%u,%u,"
-                       "%u,%" PRIu64 "\n",
+                       "%u,%" PRIu64 ","
+                       "%u,%d,%u,%u,%u,%s,%u\n",
                     ia->src_ip, ia->dst_ip, ia->src_port, ia->dst_port,
                     proto_str(ia->proto),
                     ia->bytes_sent, ia->bytes_received, ia->pkts_sent, ia->pkts_received,
@@ -273,7 +311,8 @@ void report_and_reset(void) {
                     ia->syn_count, ia->ack_count, ia->fin_count, ia->rst_count, ia->psh_count,
                     syn_ack_ratio, syn_fin_ratio,
                     min_size, ia->max_pkt_size,
-                    total_pkts, total_bytes);
+                    total_pkts, total_bytes,
+                    ia->mss, ia->wscale, ia->sack_perm, ia->ts_val, ia->ts_ecr, ia->opt_layout, ia->opt_anomalies);
         }
     }
 
@@ -2,19 +2,89 @@
  * Adds direction mode: incoming/outgoing/both.
  * Detects local IPv4 addresses at init (getifaddrs).
  * Default mode: RL_MODE_BOTH
+ *
+ * Per-source state lives in a preallocated, cache-aligned open-addressing
+ * table: each 64-byte bucket holds RL_BUCKET_SLOTS entries and a source maps
+ * to exactly one bucket. When the bucket is full the new source takes over
+ * an idle entry (one whose bucket has refilled to its burst, so nothing is
+ * lost), else the least recently used one. The table never grows and never
+ * refuses a source, so spoofed-source floods can't make it fail open.
+ *
+ * The table is shared by all capture threads without a lock: each slot is a
+ * 64-bit key and a 64-bit state word, claimed and updated with CAS, so a
+ * source arriving on two interfaces still sees one limit. Counters are
+ * per-thread (worker.h).
+ *
+ * Policies (RateLimits.txt) pick what is limited: protocol, optional
+ * destination port / ICMP type range and TCP flag predicate, in packets/s or
+ * bytes/s. The built-in "syn" policy (TCP SYN without ACK, packets/s) comes
+ * first; a packet is charged to the first policy it matches only.
+ *
+ * Limits are hierarchical: per source IP, per source /24, per destination
+ * port and global, each with its own rate/burst per policy, all in the same
+ * table under policy- and level-tagged keys (global has a dedicated entry
+ * per policy). A packet is dropped if any enabled level is exhausted.
+ *
+ * Source-level backend (rate_limit_set_backend):
+ *   RL_BACKEND_TABLE   exact per-source state in the table above
+ *   RL_BACKEND_SKETCH  fixed 1 MiB Count-Min Sketch for unbounded
+ *                      spoofed-source sets: RL_SKETCH_DEPTH rows of
+ *                      RL_SKETCH_WIDTH cells, each cell holding the same
+ *                      time word as a table entry. A source's state is the
+ *                      minimum of its d cells; an admitted packet raises
+ *                      each cell to the new state (conservative update), so
+ *                      rate/burst mean exactly what they do in the table
+ *                      and no window rotation is needed.
+ *     Error bound: a source's usage is never underestimated (collisions only
+ *     push cells ahead). With w = 32768 and d = 4 it is overestimated by at
+ *     most e/w * N units (~8.3e-5 * N, N = units the policy admitted during
+ *     the last burst/rate seconds) with probability 1 - e^-d (~98.2%);
+ *     conservative update keeps the typical error far below that.
+ *     The prefix, port and global levels stay exact in the table.
+ *
+ * Adaptive per-port thresholds (on for "syn" by default, "adaptive" line in
+ * RateLimits.txt): each destination port learns a baseline of packets per
+ * 1 s window with an EWMA of mean and variance, and admits at most
+ * clamp(mean + k*sigma, floor, ceiling) per window once warmed up. Windows
+ * are learned from min(count, threshold), so a flood raises the baseline
+ * only slowly instead of teaching it the flood rate.
+ *
+ * Two algorithms with the same rate/burst meaning:
+ *   RL_ALGO_TOKEN_BUCKET  tokens refill at rate up to burst; stored as the
+ *                         time the bucket was empty so it fits one word
+ *   RL_ALGO_GCRA          one integer theoretical arrival time (TAT) per key:
+ *                         emission interval T = 1/rate, a packet costing n
+ *                         units conforms if max(TAT, now) + n*T - now <= burst*T
+ * Time is integer nanoseconds from the packet header (h->ts, default, so
+ * replayed pcaps behave like live traffic) or CLOCK_MONOTONIC_COARSE.
+ *
+ * Warm restarts (rate_limit_set_state_file): the table, global entries and
+ * sketch live in a MAP_SHARED state file instead of anonymous memory, so
+ * every update is already "saved" and survives a crash. Once per second of
+ * limiter time one capture thread stamps the header (the limiter clock and
+ * CLOCK_REALTIME sampled together, plus the packet second: a few stores);
+ * a checkpointer thread exports the active bans into the file every
+ * RL_CHECKPOINT_NS, so the ban lock and table scan stay off capture.
+ * rate_limit_init maps the file back and, if the policy layout, algorithm
+ * and clock are unchanged, shifts every time word by
+ *   (clock now - wall time elapsed since the checkpoint) - checkpoint clock
+ * so buckets resume exactly where they were, refilled for the downtime.
  */
 
 #include <time.h>
 #include "rate_limit.h"
+#include "ban.h"
+#include "worker.h"
+#include "droplog.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <ctype.h>
+#include <math.h>
 #include <arpa/inet.h>
 #include <netinet/ip.h>
-#include <netinet/tcp.h>
-#include <net/ethernet.h>
+#include <netinet/in.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <stddef.h>
@@ -22,13 +92,81 @@
 #include <ifaddrs.h>
 #include <net/if.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
 
-#define HASH_BUCKETS 4096
-#define MAX_ENTRIES  65536
+#define RL_TABLE_BUCKETS 65536          /* power of two; x RL_BUCKET_SLOTS keys */
+#define RL_BUCKET_SLOTS  4               /* 16-byte slots per 64-byte bucket */
 #define MAX_LOCAL_IPS 64
+#define RL_PREFIX_MASK   0xFFFFFF00u     /* source prefix level: /24 */
+#define RL_CONFIG_FILE   "RateLimits.txt"
+#define RL_MAX_POLICIES  16
+#define RL_FP_SHIFT      16              /* emission interval fixed point: ns << 16 */
+#define RL_MIN_BYTE_BURST 1514           /* bps burst floor: one Ethernet frame */
+#define RL_SKETCH_DEPTH  4               /* rows: failure probability e^-d */
+#define RL_SKETCH_WIDTH  32768           /* power of two; error e/w of admitted volume */
+#define RL_ADAPT_WINDOW_NS 1000000000ULL /* baseline sample period */
+#define RL_ADAPT_ALPHA   0.1             /* EWMA weight of the newest window */
+#define RL_ADAPT_WARMUP  10              /* windows learned before enforcing */
+#define RL_ADAPT_MAX_GAP 64              /* idle windows folded in after a gap */
+#define RL_LEVEL_ADAPTIVE RL_LEVELS      /* drop counter slot for adaptive drops */
+#define RL_ADAPT_REPORT_TOP 10
+#define RL_STATE_MAGIC   0x54534c52u     /* "RLST" in little-endian */
+#define RL_STATE_VERSION 1
+#define RL_STATE_ALIGN   4096            /* sections start on page boundaries */
+#define RL_CHECKPOINT_NS 1000000000ULL   /* header + bans checkpoint period */
+#define RL_SPOOF_PENALTY 4               /* cost multiplier for m->spoof_suspect packets */
 
-static double RATE_TOKENS_PER_SEC = 1;
-static double BURST_CAPACITY      = 2;
+static rl_algo_t rl_algo = RL_ALGO_TOKEN_BUCKET;
+static rl_clock_t rl_clock = RL_CLOCK_PACKET;
+static rl_backend_t rl_backend = RL_BACKEND_TABLE;
+static bool rl_quiet = false;
+
+/* per-level limits; rate 0 == level off. GCRA constants derived from rate/burst */
+typedef struct {
+    double rate, burst;      /* per second, in the policy's unit */
+    uint64_t emission_fp;    /* T per unit, ns << RL_FP_SHIFT */
+    uint64_t limit_ns;       /* burst * T */
+} rl_level_cfg_t;
+
+/* learned per-port baseline, one per destination port (or ICMP type) */
+typedef struct {
+    uint64_t window;         /* window number seen/admitted belong to */
+    uint32_t seen;           /* packets offered this window */
+    uint32_t admitted;       /* packets admitted this window */
+    uint32_t thresh;         /* current per-window limit */
+    uint32_t windows;        /* windows learned (warm-up) */
+    uint64_t drops;
+    float mean, var;         /* EWMA of per-window counts; written by the window closer */
+} rl_baseline_t;
+
+typedef struct {
+    bool on;
+    double k, floor, ceiling;    /* threshold = clamp(mean + k*sigma, floor, ceiling) per second */
+} rl_adapt_cfg_t;
+
+typedef struct {
+    char name[16];
+    char reason[24];         /* printed on drops, e.g. SYN_FLOOD */
+    int proto;               /* IPPROTO_* or -1 = any */
+    uint16_t port_lo, port_hi;   /* destination port, or ICMP type; 0-65535 = any */
+    uint8_t flags_set, flags_mask;   /* TCP: (flags & mask) == set */
+    bool bytes;              /* limit bytes/s (wire length) instead of packets/s */
+    rl_level_cfg_t levels[RL_LEVELS];
+    rl_adapt_cfg_t adapt;
+    rl_baseline_t *base;     /* [65536], allocated at init when adapt.on */
+} rl_policy_t;
+
+static rl_policy_t policies[RL_MAX_POLICIES] = {
+    [0] = { "syn", "SYN_FLOOD", IPPROTO_TCP, 0, 65535, PKT_TCP_SYN, PKT_TCP_SYN | PKT_TCP_ACK, false,
+            { [RL_LEVEL_SRC] = { 1, 2, 0, 0 } }, { true, 3.0, 20.0, 20000.0 }, NULL },
+};
+static int policy_count = 1;
+
+static const char *level_names[RL_LEVELS + 1] = { "src", "prefix24", "dport", "global", "adaptive" };
 
 /* direction mode, default BOTH */
 static rl_mode_t rl_mode = RL_MODE_BOTH;
@@ -37,51 +175,312 @@ static rl_mode_t rl_mode = RL_MODE_BOTH;
 static uint32_t local_ips[MAX_LOCAL_IPS];
 static int local_ip_count = 0;
 
-/* same rl_entry implementation as before */
-typedef struct rl_entry { uint32_t ip; double tokens; double last_ts; struct rl_entry *next; } rl_entry_t;
-static rl_entry_t *buckets[HASH_BUCKETS];
-static size_t entry_count = 0;
-static uint64_t rl_allowed = 0;
-static uint64_t rl_dropped = 0;
-
-static double now_seconds(void) {
-    struct timeval tv; gettimeofday(&tv, NULL);
-    return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
-}
-static inline uint32_t ip_hash(uint32_t ip) {
-    uint32_t x = ip; x ^= x >> 16; x *= 0x7feb352d; x ^= x >> 15; return x & (HASH_BUCKETS - 1);
-}
-static rl_entry_t *get_or_create_entry(uint32_t ip_net) {
-    uint32_t idx = ip_hash(ip_net);
-    for (rl_entry_t *cur = buckets[idx]; cur; cur = cur->next) if (cur->ip == ip_net) return cur;
-    if (entry_count >= MAX_ENTRIES) return NULL;
-    rl_entry_t *e = calloc(1, sizeof(rl_entry_t)); if (!e) return NULL;
-    e->ip = ip_net; e->tokens = BURST_CAPACITY; e->last_ts = now_seconds();
-    e->next = buckets[idx]; buckets[idx] = e; entry_count++; return e;
-}
-
-/* detect SYN without ACK and also return src/dst IPs (network order) */
-static int is_tcp_syn_and_ips(const struct pcap_pkthdr *h, const u_char *pkt,
-                              uint16_t *sp, uint16_t *dp, uint32_t *sip, uint32_t *dip)
-{
-    if (h->caplen < sizeof(struct ether_header)) return 0;
-    const struct ether_header *eth = (const struct ether_header *)pkt;
-    if (ntohs(eth->ether_type) != ETHERTYPE_IP) return 0;
-    if (h->caplen < sizeof(struct ether_header) + sizeof(struct ip)) return 0;
-    const struct ip *ip = (const struct ip *)(pkt + sizeof(struct ether_header));
-    if (ip->ip_p != IPPROTO_TCP) return 0;
-    size_t ihl = ip->ip_hl * 4; if (ihl < 20) return 0;
-    size_t off = sizeof(struct ether_header) + ihl;
-    if (h->caplen < off + sizeof(struct tcphdr)) return 0;
-    const struct tcphdr *tcp = (const struct tcphdr *)(pkt + off);
-    uint8_t flags = *((const uint8_t *)tcp + 13);
-    int syn = flags & 0x02; int ack = flags & 0x10;
-    if (!(syn && !ack)) return 0;
-    if (sp) *sp = ntohs(tcp->th_sport);
-    if (dp) *dp = ntohs(tcp->th_dport);
-    if (sip) *sip = ip->ip_src.s_addr;
-    if (dip) *dip = ip->ip_dst.s_addr;
-    return 1;
+/* one limited key: key == 0 marks a free slot, bits 32-39 hold level + 1 and
+ * bits 40-47 the policy. state is the algorithm's single time word
+ * (0 == full burst available); both are updated with CAS.
+ *   token bucket: state = time the bucket was empty, tokens = min(burst, (now - state) / T)
+ *   GCRA:         state = TAT */
+typedef struct { uint64_t key; uint64_t state; } rl_entry_t;
+typedef struct { rl_entry_t slot[RL_BUCKET_SLOTS]; } __attribute__((aligned(64))) rl_bucket_t;
+
+static rl_bucket_t *table = NULL;
+static rl_bucket_t *table_heap = NULL;   /* used when not persisting */
+static rl_entry_t global_store[RL_MAX_POLICIES] __attribute__((aligned(64)));
+static rl_entry_t *global_entries = global_store;   /* never evicted */
+
+/* sketch backend: [row][column] state words, 4 x 32768 x 8 B = 1 MiB,
+ * shared by all policies (the policy id is part of the hashed key) */
+static uint64_t sketch_store[RL_SKETCH_DEPTH][RL_SKETCH_WIDTH] __attribute__((aligned(64)));
+static uint64_t (*sketch)[RL_SKETCH_WIDTH] = sketch_store;
+
+/* State file: header, then table, global entries, sketch and bans sections.
+ * All integers host byte order; a foreign or stale file fails validation
+ * and is reinitialized (cold start). */
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint64_t file_size;
+    uint64_t layout_hash;     /* geometry, algorithm, clock and policy match keys */
+    uint64_t clock_ns;        /* limiter clock at the last checkpoint (0 = none yet) */
+    uint64_t wall_ns;         /* CLOCK_REALTIME at the same moment */
+    uint32_t pkt_sec;         /* packet timestamp second (ban clock), same moment */
+    uint32_t ban_count;
+    uint64_t table_off, global_off, sketch_off, bans_off;
+} rl_state_header_t;
+
+static char *state_path = NULL;
+static rl_state_header_t *state_hdr = NULL;   /* mapping base, NULL when not persisting */
+static size_t state_len = 0;
+static uint64_t state_next_ns = 0;            /* next clock stamp, limiter clock */
+static pthread_t checkpointer;
+static bool checkpointer_running, checkpointer_stop;
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t checkpoint_cond = PTHREAD_COND_INITIALIZER;
+
+#define TABLE_BYTES  ((size_t)RL_TABLE_BUCKETS * sizeof(rl_bucket_t))
+#define GLOBAL_BYTES sizeof(global_store)
+#define SKETCH_BYTES sizeof(sketch_store)
+#define BANS_BYTES   ((size_t)BAN_EXPORT_MAX * sizeof(ban_record_t))
+
+/* per-thread counters, summed by rate_limit_report */
+static struct {
+    uint64_t allowed, dropped;
+    uint64_t inserted;       /* free slots claimed */
+    uint64_t recycled;       /* idle entries reused */
+    uint64_t evicted;        /* active entries evicted (LRU) */
+    uint64_t cas_retries;
+    uint64_t penalized;      /* spoof-suspect packets charged RL_SPOOF_PENALTY */
+    uint64_t level_drops[RL_MAX_POLICIES][RL_LEVELS + 1];
+} __attribute__((aligned(CACHE_LINE))) rl_stats[MAX_WORKERS];
+
+/* integer nanoseconds, never 0 */
+static inline uint64_t now_ns(const struct pcap_pkthdr *h) {
+    uint64_t t;
+    if (rl_clock == RL_CLOCK_PACKET) {
+        t = (uint64_t)h->ts.tv_sec * 1000000000u + (uint64_t)h->ts.tv_usec * 1000u;
+    } else {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        t = (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+    }
+    return t ? t : 1;
+}
+
+/* Smallest usable burst: below the largest charge, a packet never fits */
+static inline double min_burst(const rl_policy_t *p) {
+    return p->bytes ? RL_MIN_BYTE_BURST : 1;
+}
+
+static void update_gcra_constants(rl_level_cfg_t *c) {
+    if (c->rate <= 0) { c->emission_fp = c->limit_ns = 0; return; }
+    double t_ns = 1e9 / c->rate;
+    c->emission_fp = (uint64_t)(t_ns * (double)(1u << RL_FP_SHIFT));
+    if (c->emission_fp == 0) c->emission_fp = 1;
+    c->limit_ns = (uint64_t)(c->burst * t_ns);
+}
+
+/* cost of n units in ns (n is 1, or a packet length for byte policies) */
+static inline uint64_t unit_cost(const rl_level_cfg_t *c, uint32_t n) {
+    return (n == 1) ? c->emission_fp >> RL_FP_SHIFT : ((uint64_t)n * c->emission_fp) >> RL_FP_SHIFT;
+}
+
+/* charge for a packet: unit_cost, or RL_SPOOF_PENALTY times it for a
+ * spoof suspect, capped at one full burst so it can still pass an idle
+ * limiter but leaves nothing behind (a GRO/jumbo packet longer than a bps
+ * burst included) */
+static inline uint64_t packet_cost(const rl_level_cfg_t *c, uint32_t n, bool suspect) {
+    uint64_t cost = unit_cost(c, n);
+    if (suspect) cost *= RL_SPOOF_PENALTY;
+    return c->limit_ns && cost > c->limit_ns ? c->limit_ns : cost;
+}
+
+/* TAT-equivalent of a state word: orders entries for LRU and tells idle ones */
+static inline uint64_t state_tat(const rl_level_cfg_t *c, uint64_t st) {
+    return rl_algo == RL_ALGO_GCRA ? st : st + c->limit_ns;
+}
+
+static inline uint64_t make_key(int pol, int lvl, uint32_t v) {
+    return ((uint64_t)pol << 40) | ((uint64_t)(lvl + 1) << 32) | v;
+}
+
+static inline const rl_level_cfg_t *key_level(uint64_t key) {
+    return &policies[(key >> 40) & 0xff].levels[((key >> 32) & 0xff) - 1];
+}
+
+/* entry has fully recovered: evicting it loses nothing */
+static inline bool entry_idle(uint64_t key, uint64_t st, uint64_t now) {
+    return state_tat(key_level(key), st) <= now;
+}
+
+static inline uint32_t key_hash(uint64_t key) {
+    uint32_t x = (uint32_t)key ^ (uint32_t)(key >> 32) * 0x9e3779b9u;
+    x ^= x >> 16; x *= 0x7feb352d; x ^= x >> 15; x *= 0x846ca68b; x ^= x >> 16;
+    return x & (RL_TABLE_BUCKETS - 1);
+}
+
+/* Find the key's slot, or claim one lock-free: free, else idle, else LRU.
+ * Claiming swaps the key with CAS and then clears the state. A thread still
+ * finishing an update for the previous owner can leak that one update into
+ * the new owner; this needs a full bucket and errs by a single packet.
+ * Two threads inserting the same new key into a full bucket can read
+ * different LRU orders and claim different victims. Lookups always take
+ * the lowest copy, and after a claim the whole bucket is scanned again:
+ * a lower copy makes the new one free itself, a higher one is freed. The
+ * thread that claims second always sees the first copy, so once both
+ * claims are done the key has one slot; the packet charged to the freed
+ * copy is lost, as in the stale-update race above. */
+static rl_entry_t *get_or_create_entry(uint64_t key, uint64_t now, int w) {
+    rl_bucket_t *b = &table[key_hash(key)];
+    for (;;) {
+        rl_entry_t *victim = NULL;
+        uint64_t vkey = 0, vst = 0;
+        for (int i = 0; i < RL_BUCKET_SLOTS; ++i) {
+            rl_entry_t *e = &b->slot[i];
+            uint64_t k = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+            if (k == key) return e;
+            if (victim && vkey == 0) continue;   /* already have a free slot */
+            uint64_t st = __atomic_load_n(&e->state, __ATOMIC_RELAXED);
+            if (!victim || k == 0 || state_tat(key_level(k), st) < state_tat(key_level(vkey), vst)) {
+                victim = e; vkey = k; vst = st;
+            }
+        }
+        uint64_t expect = vkey;
+        if (!__atomic_compare_exchange_n(&victim->key, &expect, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            WORKER_COUNTER_ADD(&rl_stats[w].cas_retries, 1);
+            continue;   /* lost the race; the winner may have been our own key */
+        }
+        __atomic_store_n(&victim->state, 0, __ATOMIC_RELEASE);
+        rl_entry_t *keep = victim;
+        for (int i = 0; i < RL_BUCKET_SLOTS; ++i) {
+            rl_entry_t *e = &b->slot[i];
+            if (e == victim || __atomic_load_n(&e->key, __ATOMIC_ACQUIRE) != key) continue;
+            rl_entry_t *dup = e < keep ? keep : e;
+            if (e < keep) keep = e;
+            uint64_t k = key;
+            __atomic_compare_exchange_n(&dup->key, &k, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+            WORKER_COUNTER_ADD(&rl_stats[w].cas_retries, 1);
+        }
+        if (keep != victim) return keep;
+        if (vkey == 0) WORKER_COUNTER_ADD(&rl_stats[w].inserted, 1);
+        else if (entry_idle(vkey, vst, now)) WORKER_COUNTER_ADD(&rl_stats[w].recycled, 1);
+        else WORKER_COUNTER_ADD(&rl_stats[w].evicted, 1);
+        return victim;
+    }
+}
+
+/* token bucket: take cost, z = max(z, now - burst*T) + cost */
+static inline bool tb_next(const rl_level_cfg_t *c, uint64_t z, uint64_t now, uint64_t cost,
+                           uint64_t *out, double *left) {
+    if (now > c->limit_ns && z < now - c->limit_ns) z = now - c->limit_ns;
+    if (now < z + cost) {
+        /* tokens left, in the policy's unit */
+        *left = now > z ? (double)(now - z) * (double)(1u << RL_FP_SHIFT) / (double)c->emission_fp : 0.0;
+        return false;
+    }
+    *out = z + cost;
+    return true;
+}
+
+/* GCRA: integer-only conformance test */
+static inline bool gcra_next(const rl_level_cfg_t *c, uint64_t tat, uint64_t now, uint64_t cost,
+                             uint64_t *out, double *left) {
+    if (tat < now) tat = now;
+    if (tat + cost - now > c->limit_ns) {
+        *left = (double)(tat + cost - now - c->limit_ns) / 1e9;   /* seconds until conforming */
+        return false;
+    }
+    *out = tat + cost;
+    return true;
+}
+
+static inline bool level_next(const rl_level_cfg_t *c, uint64_t st, uint64_t now, uint64_t cost,
+                              uint64_t *out, double *left) {
+    return (rl_algo == RL_ALGO_GCRA) ? gcra_next(c, st, now, cost, out, left)
+                                     : tb_next(c, st, now, cost, out, left);
+}
+
+/* one conformance decision, committed with CAS on the state word */
+static bool entry_conform(const rl_level_cfg_t *c, rl_entry_t *e, uint64_t now, uint64_t cost,
+                          double *left, int w) {
+    uint64_t st = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE), next = 0;
+    for (;;) {
+        if (!level_next(c, st, now, cost, &next, left)) return false;
+        if (__atomic_compare_exchange_n(&e->state, &st, next, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return true;
+        WORKER_COUNTER_ADD(&rl_stats[w].cas_retries, 1);
+    }
+}
+
+/* ---- sketch backend ---- */
+
+static inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 33; x *= 0xff51afd7ed558ccdULL; x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ULL; x ^= x >> 33;
+    return x;
+}
+
+/* d column indices from one 64-bit hash (double hashing) */
+static inline void sketch_columns(uint64_t key, uint32_t col[RL_SKETCH_DEPTH]) {
+    uint64_t h = mix64(key);
+    uint32_t a = (uint32_t)h, b = (uint32_t)(h >> 32) | 1u;
+    for (int r = 0; r < RL_SKETCH_DEPTH; ++r) col[r] = (a + (uint32_t)r * b) & (RL_SKETCH_WIDTH - 1);
+}
+
+/* the source's state: the least advanced of its cells */
+static inline uint64_t sketch_state(const uint32_t col[RL_SKETCH_DEPTH]) {
+    uint64_t m = UINT64_MAX;
+    for (int r = 0; r < RL_SKETCH_DEPTH; ++r) {
+        uint64_t v = __atomic_load_n(&sketch[r][col[r]], __ATOMIC_RELAXED);
+        if (v < m) m = v;
+    }
+    return m;
+}
+
+/* conservative update: raise each cell to at least the new state */
+static void sketch_update(const uint32_t col[RL_SKETCH_DEPTH], uint64_t next) {
+    for (int r = 0; r < RL_SKETCH_DEPTH; ++r) {
+        uint64_t *c = &sketch[r][col[r]];
+        uint64_t v = __atomic_load_n(c, __ATOMIC_RELAXED);
+        while (v < next && !__atomic_compare_exchange_n(c, &v, next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+    }
+}
+
+/* ---- adaptive per-port baselines ---- */
+
+static void baseline_learn(rl_baseline_t *b, const rl_adapt_cfg_t *a, double x) {
+    if (b->windows == 0) { b->mean = (float)x; b->var = 0; }
+    else {
+        double diff = x - b->mean, incr = RL_ADAPT_ALPHA * diff;
+        b->mean = (float)(b->mean + incr);
+        b->var = (float)((1.0 - RL_ADAPT_ALPHA) * (b->var + diff * incr));
+    }
+    b->windows++;
+    double t = b->mean + a->k * sqrt(b->var);
+    if (t < a->floor) t = a->floor;
+    if (t > a->ceiling) t = a->ceiling;
+    __atomic_store_n(&b->thresh, (uint32_t)t, __ATOMIC_RELAXED);
+}
+
+/* Close the port's window if time moved on (one thread wins the CAS and
+ * folds the finished window, plus idle windows after a gap, into the EWMA) */
+static void baseline_roll(rl_baseline_t *b, const rl_adapt_cfg_t *a, uint64_t now) {
+    uint64_t win = now / RL_ADAPT_WINDOW_NS;
+    uint64_t cur = __atomic_load_n(&b->window, __ATOMIC_ACQUIRE);
+    if (win <= cur) return;
+    if (!__atomic_compare_exchange_n(&b->window, &cur, win, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return;
+    uint32_t seen = __atomic_exchange_n(&b->seen, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->admitted, 0, __ATOMIC_RELAXED);
+    if (cur == 0) return;   /* first packet on this port: nothing finished yet */
+    uint32_t th = __atomic_load_n(&b->thresh, __ATOMIC_RELAXED);
+    bool warm = b->windows >= RL_ADAPT_WARMUP;
+    baseline_learn(b, a, (warm && seen > th) ? th : seen);
+    uint64_t gap = win - cur - 1;
+    if (gap > RL_ADAPT_MAX_GAP) gap = RL_ADAPT_MAX_GAP;
+    for (uint64_t g = 0; g < gap; ++g) baseline_learn(b, a, 0);
+}
+
+/* per-window admission against the learned threshold (no charge yet) */
+static inline bool baseline_ok(rl_baseline_t *b, uint64_t now, const rl_adapt_cfg_t *a) {
+    baseline_roll(b, a, now);
+    __atomic_add_fetch(&b->seen, 1, __ATOMIC_RELAXED);
+    if (b->windows < RL_ADAPT_WARMUP) return true;
+    return __atomic_load_n(&b->admitted, __ATOMIC_RELAXED) < __atomic_load_n(&b->thresh, __ATOMIC_RELAXED);
+}
+
+/* first policy the packet matches, or -1; *port gets the dport / ICMP type */
+static int match_policy(const pkt_meta_t *m, uint16_t *port) {
+    uint16_t p = m->dst_port;
+    if (m->proto == IPPROTO_ICMP) p = (m->l4 && m->l4_len >= 1) ? m->l4[0] : 0;
+    *port = p;
+    for (int i = 0; i < policy_count; ++i) {
+        const rl_policy_t *pol = &policies[i];
+        if (pol->proto >= 0 && pol->proto != m->proto) continue;
+        if (p < pol->port_lo || p > pol->port_hi) continue;
+        if ((m->tcp_flags & pol->flags_mask) != pol->flags_set) continue;
+        return i;
+    }
+    return -1;
 }
 
 /* check whether ip_net (network-order) is one of local IPs */
@@ -108,56 +507,485 @@ static void populate_local_ips(void) {
     freeifaddrs(ifap);
 }
 
-/* timestamp helpers */
-static void ts_str(const struct pcap_pkthdr *h, char *out, size_t len) {
-    time_t t = h->ts.tv_sec; struct tm *ti = localtime(&t); char base[64];
-    if (ti) strftime(base, sizeof(base), "%Y-%m-%dT%H:%M:%S", ti); else snprintf(base, sizeof(base), "unknown");
-    snprintf(out, len, "%s.%06ld", base, (long)h->ts.tv_usec);
+/* drop line detail, formatted by the droplog writer: u[0] level, u[1] GCRA,
+ * d[0] what was left (tokens, retry seconds or adaptive threshold) */
+static int fmt_drop(const droplog_event_t *e, char *out, size_t len) {
+    const rl_policy_t *pol = e->ctx;
+    if (e->u[0] == RL_LEVEL_ADAPTIVE)
+        return snprintf(out, len, "policy=%s level=adaptive threshold=%.0f/s | reason=%s",
+                        pol->name, e->d[0], pol->reason);
+    if (e->u[1])
+        return snprintf(out, len, "policy=%s level=%s retry_in=%.3fs | reason=%s",
+                        pol->name, level_names[e->u[0]], e->d[0], pol->reason);
+    return snprintf(out, len, "policy=%s level=%s tokens=%.2f/%.1f | reason=%s",
+                    pol->name, level_names[e->u[0]], e->d[0], e->d[1], pol->reason);
+}
+
+static int parse_proto(const char *s) {
+    if (strcmp(s, "tcp") == 0) return IPPROTO_TCP;
+    if (strcmp(s, "udp") == 0) return IPPROTO_UDP;
+    if (strcmp(s, "icmp") == 0) return IPPROTO_ICMP;
+    if (strcmp(s, "any") == 0) return -1;
+    char *end; long v = strtol(s, &end, 10);
+    return (*end == '\0' && v >= 0 && v <= 255) ? (int)v : -2;
+}
+
+/* TCP flags SET/MASK over FSRPAUEC, as in Rules.txt */
+static bool parse_flags(const char *s, uint8_t *set, uint8_t *mask) {
+    static const char letters[] = "FSRPAUEC";
+    uint8_t *cur = set;
+    *set = *mask = 0;
+    for (; *s; ++s) {
+        if (*s == '/') { if (cur == mask) return false; cur = mask; continue; }
+        const char *l = strchr(letters, toupper((unsigned char)*s));
+        if (!l) return false;
+        *cur |= (uint8_t)(1u << (l - letters));
+    }
+    if (cur != mask) *mask = *set;
+    return (*set & ~*mask) == 0;
+}
+
+/* "policy <name> <proto> <port|LO-HI|any> [SET/MASK] <pps|bps>" */
+static int parse_policy(char *p, rl_policy_t *out) {
+    char *tok[8]; int n = 0;
+    for (char *t = strtok(p, " \t\r\n"); t && n < 8; t = strtok(NULL, " \t\r\n")) tok[n++] = t;
+    if ((n != 5 && n != 6) || strcmp(tok[0], "policy") != 0) return -1;
+    memset(out, 0, sizeof(*out));
+    snprintf(out->name, sizeof(out->name), "%s", tok[1]);
+    size_t i = 0;
+    for (; out->name[i] && i + 7 < sizeof(out->reason); ++i) out->reason[i] = (char)toupper((unsigned char)out->name[i]);
+    snprintf(out->reason + i, sizeof(out->reason) - i, "_FLOOD");
+    if ((out->proto = parse_proto(tok[2])) == -2) return -1;
+    unsigned lo = 0, hi = 65535;
+    if (strcmp(tok[3], "any") != 0) {
+        int k = sscanf(tok[3], "%u-%u", &lo, &hi);
+        if (k == 1) hi = lo;
+        if (k < 1 || lo > hi || hi > 65535) return -1;
+    }
+    out->port_lo = (uint16_t)lo; out->port_hi = (uint16_t)hi;
+    if (n == 6 && !parse_flags(tok[4], &out->flags_set, &out->flags_mask)) return -1;
+    const char *unit = tok[n - 1];
+    if (strcmp(unit, "bps") == 0) out->bytes = true;
+    else if (strcmp(unit, "pps") != 0) return -1;
+    return 0;
+}
+
+/* RateLimits.txt: level lines "<src|prefix24|dport|global> <rate/s> <burst>"
+ * (rate 0 = off) and "adaptive <k> <floor> <ceiling>" / "adaptive off" apply
+ * to the policy declared above them, or to the built-in "syn" policy before
+ * any "policy" line */
+static void load_config(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return;
+    char line[256], name[32];
+    double rate, burst;
+    int lineno = 0, cur = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') continue;
+        if (strncmp(p, "policy", 6) == 0 && (p[6] == ' ' || p[6] == '\t')) {
+            rl_policy_t pol;
+            char copy[256];
+            snprintf(copy, sizeof(copy), "%s", p);
+            if (parse_policy(copy, &pol) < 0) {
+                fprintf(stderr, "[RATE-LIMIT] %s:%d: bad policy '%s'\n", path, lineno, strtok(p, "\r\n"));
+                cur = -1;
+                continue;
+            }
+            cur = -1;
+            for (int i = 0; i < policy_count; ++i) if (strcmp(policies[i].name, pol.name) == 0) cur = i;
+            if (cur == 0) continue;   /* "syn" is built in: only its levels can be set */
+            if (cur < 0 && policy_count == RL_MAX_POLICIES) {
+                fprintf(stderr, "[RATE-LIMIT] %s:%d: more than %d policies, ignored\n", path, lineno, RL_MAX_POLICIES);
+                continue;
+            }
+            if (cur < 0) cur = policy_count++;
+            policies[cur] = pol;
+            continue;
+        }
+        if (strncmp(p, "adaptive", 8) == 0 && (p[8] == ' ' || p[8] == '\t') && cur >= 0) {
+            double k, lo, hi;
+            char off[8];
+            if (sscanf(p + 8, "%lf %lf %lf", &k, &lo, &hi) == 3 && k >= 0 && lo >= 1 && hi >= lo) {
+                policies[cur].adapt = (rl_adapt_cfg_t){ true, k, lo, hi };
+                continue;
+            }
+            if (sscanf(p + 8, "%7s", off) == 1 && strcmp(off, "off") == 0) { policies[cur].adapt.on = false; continue; }
+        }
+        int l = -1;
+        if (sscanf(p, "%31s %lf %lf", name, &rate, &burst) == 3)
+            for (int i = 0; i < RL_LEVELS; ++i) if (strcmp(name, level_names[i]) == 0) l = i;
+        if (l < 0 || cur < 0) { fprintf(stderr, "[RATE-LIMIT] %s:%d: ignored '%s'\n", path, lineno, strtok(p, "\r\n")); continue; }
+        double floor = min_burst(&policies[cur]);
+        if (rate > 0 && burst < floor)
+            fprintf(stderr, "[RATE-LIMIT] %s:%d: burst %g below one full packet, using %g\n", path, lineno, burst, floor);
+        policies[cur].levels[l].rate = rate > 0 ? rate : 0;
+        policies[cur].levels[l].burst = burst >= floor ? burst : floor;
+    }
+    fclose(f);
+}
+
+/* ---- warm-restart state file ---- */
+
+static inline uint64_t state_align(uint64_t n) {
+    return (n + RL_STATE_ALIGN - 1) & ~(uint64_t)(RL_STATE_ALIGN - 1);
+}
+
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* limiter clock without a packet: live capture stamps packets with wall time */
+static uint64_t clock_now_ns(void) {
+    if (rl_clock == RL_CLOCK_PACKET) return realtime_ns();
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* FNV-1a 64 over everything that gives keys and time words their meaning */
+static uint64_t hash_bytes(uint64_t h, const void *p, size_t n) {
+    const uint8_t *b = p;
+    for (size_t i = 0; i < n; ++i) { h ^= b[i]; h *= 0x100000001b3ULL; }
+    return h;
+}
+
+static uint64_t layout_hash(void) {
+    uint32_t geo[] = { RL_TABLE_BUCKETS, RL_BUCKET_SLOTS, RL_MAX_POLICIES, RL_SKETCH_DEPTH, RL_SKETCH_WIDTH,
+                       BAN_EXPORT_MAX, (uint32_t)rl_algo, (uint32_t)rl_clock, (uint32_t)policy_count };
+    uint64_t h = hash_bytes(0xcbf29ce484222325ULL, geo, sizeof(geo));
+    for (int i = 0; i < policy_count; ++i) {
+        const rl_policy_t *pol = &policies[i];
+        int32_t match[] = { pol->proto, pol->port_lo, pol->port_hi, pol->flags_set, pol->flags_mask, pol->bytes };
+        h = hash_bytes(h, pol->name, strnlen(pol->name, sizeof(pol->name)));
+        h = hash_bytes(h, match, sizeof(match));
+    }
+    return h;
+}
+
+/* shift one time word; 0 (full burst) and anything shifted below 1 stay full */
+static inline uint64_t rebase(uint64_t st, int64_t delta) {
+    if (st == 0) return 0;
+    int64_t v = (int64_t)st + delta;
+    return v > 0 ? (uint64_t)v : 0;
+}
+
+/* header clock pair; the sections themselves are live */
+static void state_stamp(uint64_t now, uint32_t pkt_sec) {
+    state_hdr->pkt_sec = pkt_sec;
+    state_hdr->wall_ns = realtime_ns();
+    state_hdr->clock_ns = now;
 }
 
-/* hex snippet */
-static void hex_prefix(const u_char *d, size_t n, char *o, size_t L) {
-    size_t up = n < 24 ? n : 24, p = 0;
-    for (size_t i = 0; i < up && p + 3 < L; ++i) {
-        p += snprintf(o + p, L - p, "%02x", d[i]);
-        if (i + 1 < up && p + 2 < L) o[p++] = ' ';
+static void state_export_bans(void) {
+    ban_record_t *bans = (ban_record_t *)((char *)state_hdr + state_hdr->bans_off);
+    state_hdr->ban_count = (uint32_t)ban_export(bans, BAN_EXPORT_MAX);
+}
+
+/* one capture thread per RL_CHECKPOINT_NS of limiter time */
+static void state_tick(uint64_t now, const struct pcap_pkthdr *h) {
+    uint64_t due = __atomic_load_n(&state_next_ns, __ATOMIC_RELAXED);
+    if (now < due) return;
+    if (!__atomic_compare_exchange_n(&state_next_ns, &due, now + RL_CHECKPOINT_NS, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return;
+    state_stamp(now, (uint32_t)h->ts.tv_sec);
+}
+
+static void *checkpointer_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&checkpoint_lock);
+    while (!checkpointer_stop) {
+        struct timespec dl;
+        clock_gettime(CLOCK_REALTIME, &dl);
+        dl.tv_sec += RL_CHECKPOINT_NS / 1000000000ULL;
+        pthread_cond_timedwait(&checkpoint_cond, &checkpoint_lock, &dl);
+        if (!checkpointer_stop) state_export_bans();
+    }
+    pthread_mutex_unlock(&checkpoint_lock);
+    return NULL;
+}
+
+static void checkpointer_shutdown(void) {
+    if (!checkpointer_running) return;
+    pthread_mutex_lock(&checkpoint_lock);
+    checkpointer_stop = true;
+    pthread_cond_signal(&checkpoint_cond);
+    pthread_mutex_unlock(&checkpoint_lock);
+    pthread_join(checkpointer, NULL);
+    checkpointer_running = false;
+}
+
+static void state_close(void) {
+    checkpointer_shutdown();
+    if (!state_hdr) return;
+    munmap(state_hdr, state_len);
+    state_hdr = NULL;
+    table = NULL;
+    global_entries = global_store;
+    sketch = sketch_store;
+}
+
+/* Map (creating if needed) the state file and point the table, global
+ * entries and sketch into it. A valid checkpoint is restored with every time
+ * word rebased; anything else starts cold in the same file. */
+static bool state_open(void) {
+    uint64_t table_off = RL_STATE_ALIGN;
+    uint64_t global_off = table_off + state_align(TABLE_BYTES);
+    uint64_t sketch_off = global_off + state_align(GLOBAL_BYTES);
+    uint64_t bans_off = sketch_off + state_align(SKETCH_BYTES);
+    uint64_t size = bans_off + state_align(BANS_BYTES);
+
+    int fd = open(state_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "[RATE-LIMIT] state file %s: %s, not persisting\n", state_path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    bool fresh = fstat(fd, &st) != 0 || (uint64_t)st.st_size != size;
+    if (fresh && (ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)size) != 0)) {
+        fprintf(stderr, "[RATE-LIMIT] state file %s: %s, not persisting\n", state_path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "[RATE-LIMIT] state file %s: mmap: %s, not persisting\n", state_path, strerror(errno));
+        return false;
+    }
+
+    rl_state_header_t *hdr = base;
+    uint64_t lh = layout_hash();
+    const char *why = NULL;
+    if (fresh) why = "new file";
+    else if (hdr->magic != RL_STATE_MAGIC || hdr->version != RL_STATE_VERSION || hdr->header_size != sizeof(*hdr) ||
+             hdr->file_size != size || hdr->table_off != table_off || hdr->global_off != global_off ||
+             hdr->sketch_off != sketch_off || hdr->bans_off != bans_off) why = "unrecognized format";
+    else if (hdr->layout_hash != lh) why = "policies, algorithm or clock changed";
+    else if (hdr->clock_ns == 0) why = "no checkpoint";
+
+    state_hdr = hdr;
+    state_len = size;
+    state_next_ns = 0;
+    table = (rl_bucket_t *)((char *)base + table_off);
+    global_entries = (rl_entry_t *)((char *)base + global_off);
+    sketch = (uint64_t (*)[RL_SKETCH_WIDTH])((char *)base + sketch_off);
+
+    uint64_t wall = realtime_ns(), now = clock_now_ns();
+    if (why) {
+        memset(base, 0, size);
+        *hdr = (rl_state_header_t){ .magic = RL_STATE_MAGIC, .version = RL_STATE_VERSION,
+                                    .header_size = sizeof(*hdr), .file_size = size, .layout_hash = lh,
+                                    .table_off = table_off, .global_off = global_off,
+                                    .sketch_off = sketch_off, .bans_off = bans_off };
+        fprintf(stderr, "[RATE-LIMIT] state file %s: %s, cold start\n", state_path, why);
+    } else {
+        /* buckets keep refilling while we are down: the new clock reading
+         * that corresponds to the checkpoint is now - elapsed wall time */
+        int64_t elapsed = wall > hdr->wall_ns ? (int64_t)(wall - hdr->wall_ns) : 0;
+        int64_t delta = (int64_t)now - elapsed - (int64_t)hdr->clock_ns;
+        uint64_t restored = 0;
+        for (uint32_t b = 0; b < RL_TABLE_BUCKETS; ++b)
+            for (int i = 0; i < RL_BUCKET_SLOTS; ++i) {
+                rl_entry_t *e = &table[b].slot[i];
+                if (!e->key) continue;
+                e->state = rebase(e->state, delta);
+                restored++;
+            }
+        for (int i = 0; i < RL_MAX_POLICIES; ++i) global_entries[i].state = rebase(global_entries[i].state, delta);
+        for (int r = 0; r < RL_SKETCH_DEPTH; ++r)
+            for (int c = 0; c < RL_SKETCH_WIDTH; ++c) sketch[r][c] = rebase(sketch[r][c], delta);
+        /* bans run on packet seconds: live capture stamps them with wall time */
+        int64_t shift = (int64_t)(hdr->wall_ns / 1000000000u) - (int64_t)hdr->pkt_sec;
+        uint32_t nb = hdr->ban_count < BAN_EXPORT_MAX ? hdr->ban_count : BAN_EXPORT_MAX;
+        int bans = ban_restore((const ban_record_t *)((char *)base + bans_off), (int)nb, shift,
+                               (uint32_t)(wall / 1000000000u));
+        fprintf(stderr, "[RATE-LIMIT] state file %s: restored %" PRIu64 " entries and %d bans, down %.1fs\n",
+                state_path, restored, bans, (double)elapsed / 1e9);
     }
-    o[p] = 0;
+    state_stamp(now, (uint32_t)(wall / 1000000000u));
+    state_export_bans();
+    checkpointer_stop = false;
+    checkpointer_running = pthread_create(&checkpointer, NULL, checkpointer_main, NULL) == 0;
+    if (!checkpointer_running)
+        fprintf(stderr, "[RATE-LIMIT] state file %s: no checkpoint thread, bans saved at exit only\n", state_path);
+    return true;
 }
 
 /* public API implementations */
 void rate_limit_init(void) {
-    memset(buckets, 0, sizeof(buckets));
-    entry_count = 0;
-    rl_allowed = rl_dropped = 0;
+    state_close();
+    memset(rl_stats, 0, sizeof(rl_stats));
+    for (int i = 0; i < RL_MAX_POLICIES; ++i) { free(policies[i].base); policies[i].base = NULL; }
+    policy_count = 1;
+    load_config(RL_CONFIG_FILE);
+    for (int i = 0; i < policy_count; ++i) {
+        for (int l = 0; l < RL_LEVELS; ++l) update_gcra_constants(&policies[i].levels[l]);
+        if (policies[i].adapt.on) {
+            policies[i].base = calloc(65536, sizeof(rl_baseline_t));
+            if (!policies[i].base) fprintf(stderr, "[RATE-LIMIT] no memory for %s baselines, adaptive off\n", policies[i].name);
+        }
+    }
+    if (!state_path || !state_open()) {
+        if (!table_heap) table_heap = aligned_alloc(sizeof(rl_bucket_t), TABLE_BYTES);
+        table = table_heap;
+        if (table) memset(table, 0, TABLE_BYTES);
+        memset(global_entries, 0, GLOBAL_BYTES);
+        memset(sketch, 0, SKETCH_BYTES);
+    }
     populate_local_ips();
     /* default rl_mode (BOTH) already set statically */
 }
 
 void rate_limit_set_params(double rate, double burst) {
-    if (rate > 0) RATE_TOKENS_PER_SEC = rate;
-    if (burst > 0) BURST_CAPACITY = burst;
+    rl_level_cfg_t *c = &policies[0].levels[RL_LEVEL_SRC];
+    if (rate > 0) c->rate = rate;
+    if (burst > 0) c->burst = burst >= min_burst(&policies[0]) ? burst : min_burst(&policies[0]);
+    update_gcra_constants(c);
+}
+
+void rate_limit_set_level(rl_level_t lvl, double rate, double burst) {
+    if (lvl < 0 || lvl >= RL_LEVELS) return;
+    rl_level_cfg_t *c = &policies[0].levels[lvl];
+    c->rate = rate > 0 ? rate : 0;
+    c->burst = burst >= min_burst(&policies[0]) ? burst : min_burst(&policies[0]);
+    update_gcra_constants(c);
+}
+
+/* per-key state means different things per algorithm: start clean */
+void rate_limit_set_algo(rl_algo_t a) {
+    if (a == rl_algo) return;
+    rl_algo = a;
+    if (table) memset(table, 0, RL_TABLE_BUCKETS * sizeof(rl_bucket_t));
+    memset(global_entries, 0, GLOBAL_BYTES);
+}
+
+void rate_limit_set_clock(rl_clock_t c) {
+    if (c == rl_clock) return;
+    rl_clock = c;
+    if (table) memset(table, 0, RL_TABLE_BUCKETS * sizeof(rl_bucket_t));
+    memset(global_entries, 0, GLOBAL_BYTES);
 }
 
 void rate_limit_set_mode(rl_mode_t m) {
     rl_mode = m;
 }
 
+void rate_limit_set_adaptive(bool on, double k, double floor_rate, double ceiling_rate) {
+    rl_adapt_cfg_t *a = &policies[0].adapt;
+    a->on = on;
+    if (k >= 0) a->k = k;
+    if (floor_rate >= 1) a->floor = floor_rate;
+    if (ceiling_rate >= a->floor) a->ceiling = ceiling_rate;
+    /* baselines exist iff adaptive is on (rate_limit_init allocates them) */
+    if (!on) {
+        free(policies[0].base);
+        policies[0].base = NULL;
+    } else if (!policies[0].base && table) {
+        policies[0].base = calloc(65536, sizeof(rl_baseline_t));
+        if (!policies[0].base) fprintf(stderr, "[RATE-LIMIT] no memory for %s baselines, adaptive off\n", policies[0].name);
+    }
+}
+
+void rate_limit_set_backend(rl_backend_t b) {
+    rl_backend = b;
+}
+
+void rate_limit_set_quiet(bool quiet) {
+    rl_quiet = quiet;
+}
+
+void rate_limit_set_state_file(const char *path) {
+    free(state_path);
+    state_path = path && *path ? strdup(path) : NULL;
+}
+
+void rate_limit_save_state(void) {
+    if (!state_hdr) return;
+    checkpointer_shutdown();
+    state_export_bans();
+    if (msync(state_hdr, state_len, MS_SYNC) != 0)
+        fprintf(stderr, "[RATE-LIMIT] state file %s: msync: %s\n", state_path, strerror(errno));
+    state_close();
+}
+
+/* learned ports, busiest baselines first */
+static void report_baselines(const rl_policy_t *pol, uint64_t drops) {
+    int top[RL_ADAPT_REPORT_TOP], n = 0, learned = 0;
+    for (int p = 0; p < 65536; ++p) {
+        const rl_baseline_t *b = &pol->base[p];
+        if (b->windows == 0) continue;
+        learned++;
+        if (n == RL_ADAPT_REPORT_TOP && b->mean <= pol->base[top[n - 1]].mean) continue;
+        int i = (n < RL_ADAPT_REPORT_TOP) ? n++ : n - 1;
+        for (; i > 0 && pol->base[top[i - 1]].mean < b->mean; --i) top[i] = top[i - 1];
+        top[i] = p;
+    }
+    fprintf(stderr, "[RATE-LIMIT]   adaptive k=%.1f floor=%.0f ceiling=%.0f/s: %d ports learned, dropped=%" PRIu64 "\n",
+            pol->adapt.k, pol->adapt.floor, pol->adapt.ceiling, learned, drops);
+    for (int i = 0; i < n; ++i) {
+        const rl_baseline_t *b = &pol->base[top[i]];
+        fprintf(stderr, "[RATE-LIMIT]     port %-5d mean=%.1f sigma=%.1f threshold=%u/s%s drops=%" PRIu64 "\n",
+                top[i], b->mean, sqrt(b->var), b->thresh, b->windows < RL_ADAPT_WARMUP ? " (warming up)" : "",
+                WORKER_COUNTER_READ(&b->drops));
+    }
+}
+
 void rate_limit_report(void) {
-    fprintf(stderr, "[RATE-LIMIT] entries=%zu allowed=%" PRIu64 " dropped=%" PRIu64 " local_ips=%d mode=%d\n",
-            entry_count, rl_allowed, rl_dropped, local_ip_count, (int)rl_mode);
+    uint64_t allowed = 0, dropped = 0, inserted = 0, recycled = 0, evicted = 0, retries = 0, penalized = 0;
+    static uint64_t level_drops[RL_MAX_POLICIES][RL_LEVELS + 1];
+    memset(level_drops, 0, sizeof(level_drops));
+    for (int w = 0; w < worker_count(); ++w) {
+        for (int i = 0; i < policy_count; ++i)
+            for (int l = 0; l <= RL_LEVELS; ++l) level_drops[i][l] += WORKER_COUNTER_READ(&rl_stats[w].level_drops[i][l]);
+        allowed  += WORKER_COUNTER_READ(&rl_stats[w].allowed);
+        dropped  += WORKER_COUNTER_READ(&rl_stats[w].dropped);
+        inserted += WORKER_COUNTER_READ(&rl_stats[w].inserted);
+        recycled += WORKER_COUNTER_READ(&rl_stats[w].recycled);
+        evicted  += WORKER_COUNTER_READ(&rl_stats[w].evicted);
+        retries  += WORKER_COUNTER_READ(&rl_stats[w].cas_retries);
+        penalized += WORKER_COUNTER_READ(&rl_stats[w].penalized);
+    }
+    fprintf(stderr, "[RATE-LIMIT] entries=%" PRIu64 "/%d allowed=%" PRIu64 " dropped=%" PRIu64 " local_ips=%d mode=%d\n",
+            inserted, RL_TABLE_BUCKETS * RL_BUCKET_SLOTS, allowed, dropped, local_ip_count, (int)rl_mode);
+    fprintf(stderr, "[RATE-LIMIT] idle entries recycled=%" PRIu64 " active entries evicted=%" PRIu64 " cas retries=%" PRIu64 "\n",
+            recycled, evicted, retries);
+    if (penalized)
+        fprintf(stderr, "[RATE-LIMIT] TTL spoof suspects charged x%d: %" PRIu64 "\n", RL_SPOOF_PENALTY, penalized);
+    fprintf(stderr, "[RATE-LIMIT] algo=%s clock=%s source backend=%s\n",
+            rl_algo == RL_ALGO_GCRA ? "gcra" : "token_bucket", rl_clock == RL_CLOCK_PACKET ? "packet" : "monotonic",
+            rl_backend == RL_BACKEND_SKETCH ? "count-min sketch (1 MiB)" : "exact table");
+    for (int i = 0; i < policy_count; ++i) {
+        const rl_policy_t *pol = &policies[i];
+        fprintf(stderr, "[RATE-LIMIT] policy %s: proto=%d ports=%u-%u flags=%02x/%02x unit=%s\n",
+                pol->name, pol->proto, pol->port_lo, pol->port_hi, pol->flags_set, pol->flags_mask,
+                pol->bytes ? "bytes/s" : "packets/s");
+        for (int l = 0; l < RL_LEVELS; ++l) {
+            if (pol->levels[l].rate <= 0) continue;
+            fprintf(stderr, "[RATE-LIMIT]   level %-8s rate=%.2f/s burst=%.1f dropped=%" PRIu64 "\n",
+                    level_names[l], pol->levels[l].rate, pol->levels[l].burst, level_drops[i][l]);
+        }
+        if (pol->base) report_baselines(pol, level_drops[i][RL_LEVEL_ADAPTIVE]);
+    }
 }
 
 /* main check: respects rl_mode */
-bool rate_limit_check(const struct pcap_pkthdr *h, const u_char *pkt) {
-    uint16_t sp=0, dp=0; uint32_t sip=0, dip=0;
-    if (!is_tcp_syn_and_ips(h, pkt, &sp, &dp, &sip, &dip)) { rl_allowed++; return true; }
+bool rate_limit_check(const struct pcap_pkthdr *h, const u_char *pkt, const pkt_meta_t *m) {
+    (void)pkt;   /* drop lines carry no payload */
+    int w = worker_id();
+    uint16_t port = 0;
+    int pi = m->is_ipv4 ? match_policy(m, &port) : -1;
+    if (pi < 0) { WORKER_COUNTER_ADD(&rl_stats[w].allowed, 1); return true; }
 
     /* determine direction: if dip is local => packet destined to us => incoming;
        if sip is local => packet originates from local => outgoing.
        Note: on promiscuous interfaces, you may see both directions for same host. */
-    bool pkt_incoming = is_local_ip(dip);
-    bool pkt_outgoing = is_local_ip(sip);
+    bool pkt_incoming = is_local_ip(htonl(m->dst_ip));
+    bool pkt_outgoing = is_local_ip(htonl(m->src_ip));
 
     /* decide if we should enforce rate-limit on this packet according to mode */
     bool enforce = false;
@@ -165,33 +993,79 @@ bool rate_limit_check(const struct pcap_pkthdr *h, const u_char *pkt) {
     else if (rl_mode == RL_MODE_INCOMING && pkt_incoming) enforce = true;
     else if (rl_mode == RL_MODE_OUTGOING && pkt_outgoing) enforce = true;
 
-    if (!enforce) { rl_allowed++; return true; }
+    if (!enforce) { WORKER_COUNTER_ADD(&rl_stats[w].allowed, 1); return true; }
 
-    /* use source IP as the key (same as before) */
-    rl_entry_t *e = get_or_create_entry(sip);
-    if (!e) { rl_allowed++; return true; }
+    if (!table) { WORKER_COUNTER_ADD(&rl_stats[w].allowed, 1); return true; }
+    uint64_t now = now_ns(h);
+    if (state_hdr) state_tick(now, h);
+    const rl_policy_t *pol = &policies[pi];
+    uint32_t units = pol->bytes ? h->len : 1;
+    if (m->spoof_suspect) WORKER_COUNTER_ADD(&rl_stats[w].penalized, 1);
 
-    double now = now_seconds();
-    double add = (now - e->last_ts) * RATE_TOKENS_PER_SEC;
-    if (add > 0) {
-        e->tokens += add;
-        if (e->tokens > BURST_CAPACITY) e->tokens = BURST_CAPACITY;
-        e->last_ts = now;
-    }
+    /* one pass over the policy's enabled levels: check all first so a packet
+     * dropped at one level is not charged to the others, then commit with
+     * CAS. A commit that loses a race and no longer conforms drops the
+     * packet; the levels already committed keep that one charge. */
+    uint64_t keys[RL_LEVELS] = {
+        [RL_LEVEL_SRC]    = make_key(pi, RL_LEVEL_SRC, m->src_ip),
+        [RL_LEVEL_PREFIX] = make_key(pi, RL_LEVEL_PREFIX, m->src_ip & RL_PREFIX_MASK),
+        [RL_LEVEL_DPORT]  = make_key(pi, RL_LEVEL_DPORT, port),
+    };
+    rl_entry_t *ents[RL_LEVELS];
+    uint64_t costs[RL_LEVELS];
+    double left = 0;
+    int drop_level = -1;
 
-    if (e->tokens >= 1.0) { e->tokens -= 1.0; rl_allowed++; return true; }
-
-    /* drop and print */
-    rl_dropped++;
-    char ts[64], src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN], hx[128];
-    ts_str(h, ts, sizeof(ts));
-    struct in_addr a; a.s_addr = sip; inet_ntop(AF_INET, &a, src, sizeof(src));
-    a.s_addr = dip; inet_ntop(AF_INET, &a, dst, sizeof(dst));
-    hex_prefix(pkt, h->caplen, hx, sizeof(hx));
+    /* sketch backend: the source level is estimated instead of looked up */
+    bool use_sketch = rl_backend == RL_BACKEND_SKETCH && pol->levels[RL_LEVEL_SRC].rate > 0;
+    uint32_t col[RL_SKETCH_DEPTH];
+    uint64_t sketch_next = 0;
+    if (use_sketch) {
+        const rl_level_cfg_t *c = &pol->levels[RL_LEVEL_SRC];
+        sketch_columns(keys[RL_LEVEL_SRC], col);
+        costs[RL_LEVEL_SRC] = packet_cost(c, units, m->spoof_suspect);
+        if (!level_next(c, sketch_state(col), now, costs[RL_LEVEL_SRC], &sketch_next, &left))
+            drop_level = RL_LEVEL_SRC;
+    }
 
-    printf("⚡ [RATE-LIMIT DROP] %s | %s:%u → %s:%u | tokens=%.2f/%.1f | reason=SYN_FLOOD\n",
-           ts, src, sp, dst, dp, e->tokens, BURST_CAPACITY);
+    for (int l = 0; l < RL_LEVELS && drop_level < 0; ++l) {
+        const rl_level_cfg_t *c = &pol->levels[l];
+        ents[l] = NULL;
+        if (c->rate <= 0 || (l == RL_LEVEL_SRC && use_sketch)) continue;
+        ents[l] = (l == RL_LEVEL_GLOBAL) ? &global_entries[pi] : get_or_create_entry(keys[l], now, w);
+        costs[l] = packet_cost(c, units, m->spoof_suspect);
+        uint64_t next;
+        if (!level_next(c, __atomic_load_n(&ents[l]->state, __ATOMIC_ACQUIRE), now, costs[l], &next, &left))
+            drop_level = l;
+    }
+    rl_baseline_t *base = pol->base ? &pol->base[port] : NULL;
+    if (drop_level < 0 && base && !baseline_ok(base, now, &pol->adapt)) {
+        drop_level = RL_LEVEL_ADAPTIVE;
+        left = __atomic_load_n(&base->thresh, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&base->drops, 1, __ATOMIC_RELAXED);
+    }
+    for (int l = 0; l < RL_LEVELS && drop_level < 0; ++l)
+        if (ents[l] && !entry_conform(&pol->levels[l], ents[l], now, costs[l], &left, w)) drop_level = l;
+    if (drop_level < 0) {
+        if (use_sketch) sketch_update(col, sketch_next);
+        if (base) __atomic_add_fetch(&base->admitted, 1, __ATOMIC_RELAXED);
+        WORKER_COUNTER_ADD(&rl_stats[w].allowed, 1);
+        return true;
+    }
 
+    /* drop, feed the ban table (only the source's own limit bans it) and print */
+    WORKER_COUNTER_ADD(&rl_stats[w].dropped, 1);
+    WORKER_COUNTER_ADD(&rl_stats[w].level_drops[pi][drop_level], 1);
+    if (drop_level == RL_LEVEL_SRC) ban_note_drop(m->src_ip, (uint32_t)h->ts.tv_sec);
+    if (rl_quiet) return false;
+    droplog_event_t *e = droplog_begin(DL_STAGE_RATE_LIMIT, h, m, pol->reason, fmt_drop);
+    if (!e) return false;
+    e->dst_port = port;
+    e->ctx = pol;
+    e->u[0] = (uint32_t)drop_level;
+    e->u[1] = rl_algo == RL_ALGO_GCRA;
+    e->d[0] = left;
+    e->d[1] = drop_level < RL_LEVELS ? pol->levels[drop_level].burst : 0;
+    droplog_commit(e);
     return false;
 }
-
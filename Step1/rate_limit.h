@@ -3,6 +3,7 @@
 
 #include <pcap.h>
 #include <stdbool.h>
+#include "packet.h"
 
 /* Mode for which direction to enforce limits */
 typedef enum {
@@ -11,13 +12,66 @@ typedef enum {
     RL_MODE_BOTH     = 2
 } rl_mode_t;
 
+/* Limiting algorithm (same rate/burst semantics for both) */
+typedef enum {
+    RL_ALGO_TOKEN_BUCKET = 0,
+    RL_ALGO_GCRA         = 1
+} rl_algo_t;
+
+/* Time source: packet header timestamps (default) or CLOCK_MONOTONIC_COARSE */
+typedef enum {
+    RL_CLOCK_PACKET    = 0,
+    RL_CLOCK_MONOTONIC = 1
+} rl_clock_t;
+
+/* Source-level state: exact table (default) or fixed-size Count-Min Sketch */
+typedef enum {
+    RL_BACKEND_TABLE  = 0,
+    RL_BACKEND_SKETCH = 1
+} rl_backend_t;
+
+/* Hierarchy levels, each with its own rate/burst (rate 0 = off) */
+typedef enum {
+    RL_LEVEL_SRC    = 0,   /* per source IP (default 1/s, burst 2) */
+    RL_LEVEL_PREFIX = 1,   /* per source /24 */
+    RL_LEVEL_DPORT  = 2,   /* per destination port */
+    RL_LEVEL_GLOBAL = 3,   /* all traffic */
+    RL_LEVELS
+} rl_level_t;
+
 void rate_limit_init(void);
-bool rate_limit_check(const struct pcap_pkthdr *header, const u_char *packet);
-void rate_limit_set_params(double tokens_per_sec, double burst_capacity);
+/* Return true == ALLOW; the packet is charged to the first matching policy */
+bool rate_limit_check(const struct pcap_pkthdr *header, const u_char *packet, const pkt_meta_t *m);
+/* Limits of the built-in "syn" policy; other policies come from RateLimits.txt */
+void rate_limit_set_params(double tokens_per_sec, double burst_capacity);   /* source level */
+void rate_limit_set_level(rl_level_t lvl, double tokens_per_sec, double burst_capacity);
 
 /* New: set mode to INCOMING / OUTGOING / BOTH (default BOTH) */
 void rate_limit_set_mode(rl_mode_t m);
 
+/* Select algorithm / clock; resets per-source state */
+void rate_limit_set_algo(rl_algo_t a);
+void rate_limit_set_clock(rl_clock_t c);
+void rate_limit_set_backend(rl_backend_t b);
+
+/* Adaptive per-destination-port thresholds of the "syn" policy: learned
+ * mean + k*sigma new connections/s, clamped to [floor, ceiling]
+ * (negative / out-of-range values keep the current setting). Call after
+ * rate_limit_init, which loads the "adaptive" lines of RateLimits.txt, and
+ * before capture starts. */
+void rate_limit_set_adaptive(bool on, double k, double floor_rate, double ceiling_rate);
+
+/* Warm restarts: keep the rate-limit table, sketch and active bans in a
+ * memory-mapped state file (NULL / "" = off, the default). rate_limit_init
+ * maps it, restores a matching checkpoint with timestamps rebased and starts
+ * the thread that saves the active bans every second. */
+void rate_limit_set_state_file(const char *path);
+/* Final checkpoint and unmap; call after capture threads have stopped */
+void rate_limit_save_state(void);
+
+/* Suppress the per-drop console line (counters and bans unaffected) */
+void rate_limit_set_quiet(bool quiet);
+
 /* report stats */
 void rate_limit_report(void);
 
@@ -0,0 +1,101 @@
+/*
+ * tcpopt.c
+ * Table-driven TCP option walk (RFC 9293 3.2, RFC 7323, RFC 2018).
+ *
+ * Each kind has a descriptor: layout letter, required length (0 = any,
+ * checked separately for SACK), the TOPT_HAVE_* bit for single-instance
+ * options and whether it may only appear on a SYN. Unknown kinds are
+ * skipped by their length byte. A length that cannot be trusted stops the
+ * walk, as the kernel's tcp_parse_options does.
+ */
+
+#include "tcpopt.h"
+#include <string.h>
+
+#define TOPT_EOL    0
+#define TOPT_NOP    1
+#define TOPT_MSS    2
+#define TOPT_WSCALE 3
+#define TOPT_SACKOK 4
+#define TOPT_SACK   5
+#define TOPT_TS     8
+
+#define TOPT_WSCALE_MAX 14   /* RFC 7323 2.3 */
+#define TCP_SYN_BIT     0x02
+
+static const struct {
+    char tag;
+    uint8_t len;          /* required total length, 0 = variable */
+    uint8_t have;         /* TOPT_HAVE_* of a single-instance option */
+    bool syn_only;
+} topt_desc[] = {
+    [TOPT_EOL]    = { 'E', 1,  0,                false },
+    [TOPT_NOP]    = { 'N', 1,  0,                false },
+    [TOPT_MSS]    = { 'M', 4,  TOPT_HAVE_MSS,    true },
+    [TOPT_WSCALE] = { 'W', 3,  TOPT_HAVE_WSCALE, true },
+    [TOPT_SACKOK] = { 'S', 2,  TOPT_HAVE_SACKOK, true },
+    [TOPT_SACK]   = { 'K', 0,  0,                false },
+    [6]           = { '?', 0,  0,                false },   /* obsolete echo / echo reply */
+    [7]           = { '?', 0,  0,                false },
+    [TOPT_TS]     = { 'T', 10, TOPT_HAVE_TS,     false },
+};
+#define TOPT_KNOWN (sizeof(topt_desc) / sizeof(topt_desc[0]))
+
+static inline uint32_t rd32(const u_char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+uint8_t tcp_options_parse(const u_char *tcp, size_t hdr_len, tcp_opts_t *o) {
+    memset(o, 0, sizeof(*o));
+    bool syn = (tcp[13] & TCP_SYN_BIT) != 0;
+    size_t n = 0;
+    uint8_t a = 0;
+
+    for (size_t i = 20; i < hdr_len; ) {
+        uint8_t kind = tcp[i];
+        if (kind == TOPT_EOL) { o->layout[n++] = 'E'; break; }   /* the rest is padding */
+        if (kind == TOPT_NOP) { o->layout[n++] = 'N'; ++i; continue; }
+        if (i + 1 >= hdr_len) { a |= TOPT_A_TRUNC; break; }
+        uint8_t len = tcp[i + 1];
+        if (len < 2 || i + len > hdr_len) { a |= TOPT_A_TRUNC; break; }
+
+        const u_char *v = tcp + i + 2;
+        char tag = '?';
+        if (kind < TOPT_KNOWN) {
+            tag = topt_desc[kind].tag;
+            bool len_ok = topt_desc[kind].len ? len == topt_desc[kind].len
+                                              : kind != TOPT_SACK || (len >= 10 && (len - 2) % 8 == 0);
+            if (!len_ok) a |= TOPT_A_BAD_LEN;
+            if (topt_desc[kind].have) {
+                if (o->present & topt_desc[kind].have) a |= TOPT_A_DUP;
+                if (len_ok) o->present |= topt_desc[kind].have;
+            }
+            if (topt_desc[kind].syn_only && !syn) a |= TOPT_A_SYN_ONLY;
+            if (len_ok) {
+                switch (kind) {
+                    case TOPT_MSS:
+                        o->mss = (uint16_t)(v[0] << 8 | v[1]);
+                        if (o->mss == 0) a |= TOPT_A_BAD_VALUE;
+                        break;
+                    case TOPT_WSCALE:
+                        o->wscale = v[0];
+                        if (o->wscale > TOPT_WSCALE_MAX) a |= TOPT_A_BAD_VALUE;
+                        break;
+                    case TOPT_SACK:
+                        o->present |= TOPT_HAVE_SACK;
+                        o->sack_blocks = (uint8_t)((len - 2) / 8);
+                        break;
+                    case TOPT_TS:
+                        o->ts_val = rd32(v);
+                        o->ts_ecr = rd32(v + 4);
+                        break;
+                }
+            }
+        }
+        o->layout[n++] = tag;
+        i += len;
+    }
+    o->layout[n] = '\0';
+    o->anomalies = a;
+    return a;
+}
@@ -0,0 +1,49 @@
+#ifndef TCPOPT_H
+#define TCPOPT_H
+
+/*
+ * tcpopt.h
+ * Bounds-checked TCP option parser shared by malformed.c (anomaly checks)
+ * and preprocess.c (flow features). Only the option area of a header with
+ * th_off > 5 is walked; nothing is read past th_off * 4.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Options seen (tcp_opts_t.present) */
+#define TOPT_HAVE_MSS     0x01
+#define TOPT_HAVE_WSCALE  0x02
+#define TOPT_HAVE_SACKOK  0x04
+#define TOPT_HAVE_SACK    0x08
+#define TOPT_HAVE_TS      0x10
+
+/* Anomalies (tcp_opts_t.anomalies), in the order of malformed.c's tcp_opt_* reasons */
+#define TOPT_A_TRUNC      0x01   /* length byte missing, < 2 or past the header */
+#define TOPT_A_BAD_LEN    0x02   /* known option with the wrong length */
+#define TOPT_A_BAD_VALUE  0x04   /* MSS 0, window scale > 14 */
+#define TOPT_A_DUP        0x08   /* single-instance option repeated */
+#define TOPT_A_SYN_ONLY   0x10   /* MSS / window scale / SACK-permitted without SYN */
+#define TOPT_ANOMALIES    5
+
+#define TOPT_LAYOUT_MAX   40     /* one letter per option, 40 option bytes at most */
+
+typedef struct {
+    uint8_t present;             /* TOPT_HAVE_* */
+    uint8_t anomalies;           /* TOPT_A_* */
+    uint8_t wscale;
+    uint8_t sack_blocks;
+    uint16_t mss;
+    uint32_t ts_val, ts_ecr;
+    /* option order as letters (fingerprint): E eol, N nop, M mss, W wscale,
+     * S sack-permitted, K sack, T timestamp, ? other */
+    char layout[TOPT_LAYOUT_MAX + 1];
+} tcp_opts_t;
+
+/* Parse the options of a TCP header whose hdr_len = th_off * 4 bytes are
+ * all captured; returns o->anomalies (0 for hdr_len <= 20) */
+uint8_t tcp_options_parse(const u_char *tcp, size_t hdr_len, tcp_opts_t *o);
+
+#endif /* TCPOPT_H */
@@ -0,0 +1,57 @@
+/*
+ * worker.c
+ * Lazily hands each capture thread a small integer slot.
+ */
+
+#include "worker.h"
+#include <stdlib.h>
+#include <string.h>
+
+static int next_slot = 0;
+static __thread int my_slot = -1;
+
+int worker_id(void) {
+    if (my_slot < 0) {
+        int s = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED);
+        my_slot = (s < MAX_WORKERS) ? s : MAX_WORKERS - 1;
+    }
+    return my_slot;
+}
+
+int worker_count(void) {
+    int n = __atomic_load_n(&next_slot, __ATOMIC_RELAXED);
+    return n < MAX_WORKERS ? n : MAX_WORKERS;
+}
+
+void worker_counters_init(worker_counters_t *c, size_t n) {
+    memset(c, 0, sizeof(*c));
+    c->n = n;
+}
+
+uint64_t *worker_counters_row(worker_counters_t *c) {
+    uint64_t **slot = &c->rows[worker_id()];
+    uint64_t *row = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (row) return row;
+    /* whole cache lines so neighbouring rows never share one */
+    size_t bytes = ((c->n * sizeof(uint64_t)) | (CACHE_LINE - 1)) + 1;
+    row = aligned_alloc(CACHE_LINE, bytes);
+    if (!row) return NULL;
+    memset(row, 0, bytes);
+    __atomic_store_n(slot, row, __ATOMIC_RELEASE);
+    return row;
+}
+
+uint64_t worker_counters_sum(const worker_counters_t *c, size_t idx) {
+    uint64_t sum = 0;
+    int n = worker_count();
+    for (int w = 0; w < n; ++w) {
+        const uint64_t *row = __atomic_load_n(&c->rows[w], __ATOMIC_ACQUIRE);
+        if (row) sum += WORKER_COUNTER_READ(&row[idx]);
+    }
+    return sum;
+}
+
+void worker_counters_free(worker_counters_t *c) {
+    for (int w = 0; w < MAX_WORKERS; ++w) free(c->rows[w]);
+    worker_counters_init(c, 0);
+}
@@ -0,0 +1,42 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+/*
+ * worker.h
+ * Small per-capture-thread slot ids for sharded (per-thread) state.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MAX_WORKERS 32
+#define CACHE_LINE  64
+
+/* Slot of the calling thread in [0, MAX_WORKERS), assigned on first call.
+ * Threads beyond MAX_WORKERS all share the last slot (their counters may
+ * then undercount slightly). */
+int worker_id(void);
+
+/* Number of slots handed out so far (upper bound for aggregation loops) */
+int worker_count(void);
+
+/* Race-free single-writer increment of a per-thread counter: a plain add
+ * (no lock prefix) that readers on other threads never see torn. */
+#define WORKER_COUNTER_ADD(p, n) \
+    __atomic_store_n((p), __atomic_load_n((p), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+#define WORKER_COUNTER_READ(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+
+/* n counters per thread (e.g. one per rule), rows cache-line aligned and
+ * allocated on a thread's first use so idle threads cost nothing. */
+typedef struct {
+    uint64_t *rows[MAX_WORKERS];
+    size_t n;
+} worker_counters_t;
+
+void worker_counters_init(worker_counters_t *c, size_t n);
+uint64_t *worker_counters_row(worker_counters_t *c);   /* NULL on OOM */
+uint64_t worker_counters_sum(const worker_counters_t *c, size_t idx);
+void worker_counters_free(worker_counters_t *c);
+
+#endif /* WORKER_H */